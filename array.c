@@ -18,13 +18,26 @@
 
 #include "array.h"
 
+#include <limits.h>
 #include <string.h>
 
+#define ARRAY_MIN_SIZE 8	/* smallest capacity allocated by *_grow */
+
 
 /***************************
  * STATIC HELPER FUNCTIONS *
  ***************************/
 
+/* grow_size • geometric capacity fitting at least need elements */
+static int
+grow_size(int asize, int need) {
+	int neo = (asize < ARRAY_MIN_SIZE) ? ARRAY_MIN_SIZE : asize;
+	while (neo < need)
+		if (neo > INT_MAX / 2) return need;
+		else neo *= 2;
+	return neo; }
+
+
 /* arr_realloc • realloc memory of a struct array */
 static int
 arr_realloc(struct array* arr, int neosz) {
@@ -37,13 +50,16 @@ arr_realloc(struct array* arr, int neosz) {
 	return 1; }
 
 
-/* parr_realloc • realloc memory of a struct parray */
+/* parr_realloc • realloc memory of a struct parray, new items are NULL */
 static int
 parr_realloc(struct parray* arr, int neosz) {
 	void* neo;
+	int i;
 	neo = realloc(arr->item, neosz * sizeof (void*));
 	if (neo == 0) return 0;
 	arr->item = neo;
+	for (i = arr->asize; i < neosz; i += 1)
+		arr->item[i] = 0;
 	arr->asize = neosz;
 	if (arr->size > neosz) arr->size = neosz;
 	return 1; }
@@ -70,10 +86,11 @@ arr_free(struct array *arr) {
 
 
 /* arr_grow • increases the array size to fit the given number of elements */
+/*	the capacity grows geometrically, arr_adjust shrinks it back */
 int
 arr_grow(struct array *arr, int need) {
 	if (arr->asize >= need) return 1;
-	else return arr_realloc(arr, need); }
+	else return arr_realloc(arr, grow_size(arr->asize, need)); }
 
 
 /* arr_init • initialization of the contents of the struct */
@@ -192,10 +209,11 @@ parr_free(struct parray *arr) {
 
 
 /* parr_grow • increases the array size to fit the given number of elements */
+/*	the capacity grows geometrically, parr_adjust shrinks it back */
 int
 parr_grow(struct parray *arr, int need) {
 	if (arr->asize >= need) return 1;
-	else return parr_realloc (arr, need); }
+	else return parr_realloc (arr, grow_size(arr->asize, need)); }
 
 
 /* parr_init • initialization of the struct (which is equivalent to zero) */
@@ -247,12 +265,12 @@ parr_push(struct parray *arr, void *i) {
 void *
 parr_remove(struct parray *arr, int idx) {
 	void* ret;
-	int i;
 	if (!arr || idx < 0 || idx >= arr->size) return 0;
 	ret = arr->item[idx];
-	for (i = idx+1; i < arr->size; ++i)
-		arr->item[i - 1] = arr->item[i];
 	arr->size -= 1;
+	if (idx < arr->size)
+		memmove(arr->item + idx, arr->item + idx + 1,
+				(arr->size - idx) * sizeof (void *));
 	return ret; }
 
 
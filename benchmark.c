@@ -16,17 +16,45 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#define _POSIX_C_SOURCE 200112L
+
+#include "array.h"
 #include "markdown.h"
 #include "renderers.h"
 
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
+
 #include <stdio.h>
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #define READ_UNIT 1024
 #define OUTPUT_UNIT 64
 
+#define QUOTE_LINES 2000	/* number of lines in quote benchmarks */
+#define REF_USES 4		/* reference links per reference definition */
+#define IOV_PARAS 20000		/* number of paragraphs in iovec benchmarks */
+#define PARALLEL_SIZE 100000000	/* input size of parallel benchmarks */
+#define BATCH_THREADS 4		/* most threads in batch benchmarks */
+
+
+/* bench_render_with • renders nb times the input with the given renderer */
+static double
+bench_render_with(struct buf *ib, int nb, const struct mkd_renderer *rndr) {
+	struct buf *ob;
+	clock_t start;
+	int i;
+	start = clock();
+	for (i = 0; i < nb; i += 1) {
+		ob = bufnew(OUTPUT_UNIT);
+		markdown(ob, ib, rndr);
+		bufrelease(ob); }
+	return (clock() - start) * 1000.0 / CLOCKS_PER_SEC; }
+
 
 /* markdown_file • performs markdown transformation on FILE* */
 static void
@@ -55,24 +83,795 @@ benchmark(FILE *in, int nb) {
 	bufrelease(ib); }
 
 
+/* bench_render • renders nb times the given input, returning the time in ms */
+static double
+bench_render(struct buf *ib, int nb) {
+	return bench_render_with(ib, nb, &mkd_xhtml); }
+
+
+/* bench_quote • times nested blockquotes of increasing depth */
+static void
+bench_quote(int max_depth, int nb) {
+	struct buf *ib;
+	int depth, line, i;
+	for (depth = 1; depth <= max_depth; depth *= 2) {
+		ib = bufnew(READ_UNIT);
+		for (line = 0; line < QUOTE_LINES; line += 1) {
+			for (i = 0; i < depth; i += 1)
+				BUFPUTSL(ib, "> ");
+			BUFPUTSL(ib, "Lorem ipsum dolor sit amet, consectetur "
+			    "adipiscing elit, sed do *eiusmod* tempor.\n"); }
+		printf("quote depth %3d: %10.3f ms\n",
+		    depth, bench_render(ib, nb));
+		bufrelease(ib);
+		if (depth < max_depth && depth * 2 > max_depth)
+			depth = max_depth / 2; } }
+
+
+/* peak_rss • returns the peak resident set size of the process, in kB */
+static long
+peak_rss(void) {
+	struct rusage ru;
+	if (getrusage(RUSAGE_SELF, &ru) < 0) return 0;
+	return ru.ru_maxrss; }
+
+
+/* bench_refs • times a document with nb_refs reference definitions */
+static void
+bench_refs(int nb_refs, int nb) {
+	struct buf *ib;
+	double ms;
+	long rss;
+	int i;
+
+	ib = bufnew(READ_UNIT);
+	for (i = 0; i < nb_refs; i += 1)
+		bufprintf(ib, "[Reference %d]: http://example.com/%d "
+		    "\"Title %d\"\n", i, i, i);
+	for (i = 0; i < nb_refs * REF_USES; i += 1)
+		bufprintf(ib, "[link][reference  %d]%s",
+		    (int)((i * 7919L) % nb_refs),
+		    (i % 8 == 7) ? "\n\n" : " ");
+	rss = peak_rss();
+	ms = bench_render(ib, nb);
+	printf("refs %7d: %10.3f ms, peak RSS +%ld kB\n",
+	    nb_refs, ms, peak_rss() - rss);
+	bufrelease(ib); }
+
+
+/* single_doc • nb_paras paragraphs using references defined before or after */
+static struct buf *
+single_doc(int nb_paras, int forward) {
+	struct buf *ib = bufnew(READ_UNIT);
+	int i, nb_refs = nb_paras / 4 + 1;
+	for (i = 0; i < nb_refs && !forward; i += 1)
+		bufprintf(ib, "[ref %d]: http://example.com/%d\n", i, i);
+	for (i = 0; i < nb_paras; i += 1)
+		bufprintf(ib, "\nParagraph %d with *emphasis* and a [link]"
+		    "[ref %d], followed by some\nmore text on a second "
+		    "line.\n", i, i % nb_refs);
+	for (i = 0; i < nb_refs && forward; i += 1)
+		bufprintf(ib, "[ref %d]: http://example.com/%d\n", i, i);
+	return ib; }
+
+
+/* single_cases • inputs once rendered differently in single-pass mode */
+static const char *const single_cases[] = {
+	/* a span starting a lazy quote line, hiding an open <p> block */
+	">   \n<section>[ref]: http://r.example/ \"t\"&amp;\n[REF]:\n"
+	"   /z[REF]:\n<p>---\\*\n[a](/b \"c\")more words</section>\n\n"
+	"&</p>\n" };
+
+
+/* check_single • warns about single-pass outputs differing on single_cases */
+static void
+check_single(const struct mkd_renderer *single) {
+	struct buf ib = { 0, 0, 0, 0, 0 }, *ob, *sob, *tob;
+	struct mkd_stream *st;
+	size_t i, off;
+	for (i = 0; i < sizeof single_cases / sizeof *single_cases; i += 1) {
+		ib.data = (char *)single_cases[i];
+		ib.size = strlen(single_cases[i]);
+		ob = bufnew(OUTPUT_UNIT);
+		sob = bufnew(OUTPUT_UNIT);
+		tob = bufnew(OUTPUT_UNIT);
+		markdown(ob, &ib, &mkd_xhtml);
+		markdown(sob, &ib, single);
+		st = mkd_stream_begin(tob, &mkd_xhtml);
+		for (off = 0; st && off < ib.size; off += 3)
+			mkd_stream_feed(st, ib.data + off,
+			    ib.size - off < 3 ? ib.size - off : 3);
+		if (st) mkd_stream_end(st);
+		if (sob->size != ob->size
+		|| memcmp(sob->data, ob->data, ob->size))
+			fprintf(stderr, "Warning: single-pass output differs "
+			    "on case %zu\n", i);
+		if (tob->size != ob->size
+		|| memcmp(tob->data, ob->data, ob->size))
+			fprintf(stderr, "Warning: stream output differs "
+			    "on case %zu\n", i);
+		bufrelease(ob);
+		bufrelease(sob);
+		bufrelease(tob); } }
+
+
+/* bench_single • compares two-pass and single-pass parsing */
+/*	after checking both give the same output on single_cases */
+static void
+bench_single(int nb_paras, int nb) {
+	struct mkd_renderer single = mkd_xhtml;
+	struct buf *ib;
+	int forward;
+	single.parser_flags |= MKD_SINGLE_PASS;
+	check_single(&single);
+	for (forward = 0; forward <= 1; forward += 1) {
+		ib = single_doc(nb_paras, forward);
+		printf("%s refs %7d: two-pass %10.3f ms, "
+		    "single-pass %10.3f ms\n",
+		    forward ? "trailing" : "leading ", nb_paras,
+		    bench_render(ib, nb),
+		    bench_render_with(ib, nb, &single));
+		bufrelease(ib); } }
+
+
+/* bench_iov • compares gathering segments with markdown_iov() */
+static void
+bench_iov(int seg_size, int nb) {
+	struct buf *ib, *cat, *ob;
+	struct iovec *iov;
+	clock_t start;
+	double ms_cat, ms_iov;
+	size_t off;
+	int i, j, n;
+
+	ib = single_doc(IOV_PARAS, 0);
+	n = (ib->size + seg_size - 1) / seg_size;
+	iov = malloc(n * sizeof *iov);
+	if (!iov) {
+		bufrelease(ib);
+		return; }
+	for (i = 0, off = 0; i < n; i += 1, off += seg_size) {
+		iov[i].iov_base = ib->data + off;
+		iov[i].iov_len = (ib->size - off < (size_t)seg_size)
+		    ? ib->size - off : (size_t)seg_size; }
+
+	/* gathering the segments into a single buffer for markdown() */
+	start = clock();
+	for (i = 0; i < nb; i += 1) {
+		cat = bufnew(READ_UNIT);
+		for (j = 0; j < n; j += 1)
+			bufput(cat, iov[j].iov_base, iov[j].iov_len);
+		ob = bufnew(OUTPUT_UNIT);
+		markdown(ob, cat, &mkd_xhtml);
+		bufrelease(ob);
+		bufrelease(cat); }
+	ms_cat = (clock() - start) * 1000.0 / CLOCKS_PER_SEC;
+
+	/* reading the segments in place */
+	start = clock();
+	for (i = 0; i < nb; i += 1) {
+		ob = bufnew(OUTPUT_UNIT);
+		markdown_iov(ob, iov, n, &mkd_xhtml);
+		bufrelease(ob); }
+	ms_iov = (clock() - start) * 1000.0 / CLOCKS_PER_SEC;
+
+	printf("iov %7d: gather+markdown %10.3f ms, markdown_iov %10.3f ms\n",
+	    seg_size, ms_cat, ms_iov);
+	free(iov);
+	bufrelease(ib); }
+
+
+/* iter_render • renders ib step by step, returning the number of steps */
+/*	*longest receives the longest step in ms, when not NULL */
+static int
+iter_render(struct buf *ib, double *longest) {
+	struct mkd_iter *it;
+	struct buf *ob = bufnew(OUTPUT_UNIT);
+	clock_t step = 0;
+	int steps = 0, more;
+
+	it = mkd_iter_begin(ob, ib, &mkd_xhtml);
+	do {
+		if (longest) step = clock();
+		more = mkd_iter_next(it);
+		ob->size = 0;
+		if (longest && (clock() - step) * 1000.0 / CLOCKS_PER_SEC
+								> *longest)
+			*longest = (clock() - step) * 1000.0 / CLOCKS_PER_SEC;
+		steps += 1;
+	} while (more);
+	mkd_iter_free(it);
+	bufrelease(ob);
+	return steps; }
+
+
+/* bench_iter • compares markdown() with a step by step render */
+static void
+bench_iter(int nb_paras, int nb) {
+	struct buf *ib;
+	clock_t start;
+	double ms_iter, longest = 0;
+	int i, steps;
+
+	ib = single_doc(nb_paras, 0);
+	start = clock();
+	for (i = 0; i < nb; i += 1)
+		iter_render(ib, 0);
+	ms_iter = (clock() - start) * 1000.0 / CLOCKS_PER_SEC;
+	steps = iter_render(ib, &longest);
+	printf("iter %7d: markdown %10.3f ms, %d steps %10.3f ms, "
+	    "longest step %.3f ms\n", nb_paras, bench_render(ib, nb),
+	    steps, ms_iter, longest);
+	bufrelease(ib); }
+
+
+/* toc_header • table of contents entry, the only span parsed in lazy mode */
+static void
+toc_header(struct buf *ob, struct buf *text, int level, void *opaque) {
+	mkd_lazy_inline(ob, text, *(struct mkd_lazy **)opaque);
+	bufputc(ob, '\n'); }
+
+
+/* lazy_render • renders ib with the block pass only and spans on demand */
+static double
+lazy_render(struct buf *ib, int nb, const struct mkd_renderer *rndr,
+						struct mkd_lazy **plz) {
+	struct buf *ob;
+	clock_t start;
+	int i;
+	start = clock();
+	for (i = 0; i < nb; i += 1) {
+		ob = bufnew(OUTPUT_UNIT);
+		*plz = mkd_lazy_begin(ib, rndr);
+		mkd_lazy_render(ob, *plz);
+		mkd_lazy_free(*plz);
+		bufrelease(ob); }
+	return (clock() - start) * 1000.0 / CLOCKS_PER_SEC; }
+
+
+/* bench_lazy • compares a full render with the block pass and a TOC */
+static void
+bench_lazy(int nb_sections, int nb) {
+	struct mkd_renderer toc = { 0 };
+	struct mkd_lazy *lz = 0;
+	struct buf *ib;
+	int i, j;
+
+	ib = bufnew(READ_UNIT);
+	for (i = 0; i < nb_sections; i += 1) {
+		bufprintf(ib, "## Section *%d*\n", i);
+		for (j = 0; j < 4; j += 1)
+			bufprintf(ib, "\nParagraph %d with *emphasis* and a "
+			    "[link](http://example.com/%d), followed by some\n"
+			    "more `code` on a second line.\n\n", j, i); }
+	toc.header = toc_header;
+	toc.max_work_stack = 16;
+	toc.emph_chars = "*_";
+	toc.emphasis = mkd_xhtml.emphasis;
+	toc.opaque = &lz;
+	printf("lazy %7d: markdown %10.3f ms, block pass %10.3f ms, "
+	    "headers only %10.3f ms\n", nb_sections, bench_render(ib, nb),
+	    lazy_render(ib, nb, &mkd_xhtml, &lz),
+	    lazy_render(ib, nb, &toc, &lz));
+	bufrelease(ib); }
+
+
+/* wall_ms • wall-clock time in ms, since threads add up in clock() */
+static double
+wall_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0; }
+
+
+/* parallel_doc • mixed blocks using references, of about PARALLEL_SIZE */
+/*	or a single list, like a huge changelog */
+static struct buf *
+parallel_doc(int list) {
+	struct buf *ib = bufnew(READ_UNIT);
+	int i = 0;
+	while (list && ib->size < PARALLEL_SIZE) {
+		bufprintf(ib, "* version %d fixes *emphasis* in a [link]"
+		    "(http://example.com/%d)\n", i, i);
+		if (i % 8 == 0)
+			BUFPUTSL(ib, "    * with a `code` sublist\n");
+		i += 1; }
+	while (!list && ib->size < PARALLEL_SIZE) {
+		bufprintf(ib, "## Section *%d*\n\n"
+		    "Paragraph with *emphasis*, `code` and a [link][ref %d],\n"
+		    "followed by **some** more text on a second line.\n\n"
+		    "* item with a [link](http://example.com/%d)\n"
+		    "* item with _emphasis_\n\n"
+		    "> quoted text with *emphasis*\n"
+		    "> > and a nested quote\n\n"
+		    "    code block %d\n\n"
+		    "[ref %d]: http://example.com/%d \"Title\"\n\n",
+		    i, i, i, i, i, i);
+		i += 1; }
+	return ib; }
+
+
+/* bench_threads • scaling of markdown_parallel() up to max_threads */
+static void
+bench_threads(int max_threads, int nb) {
+	struct buf *ib, *ob;
+	double start, ms, ms_par;
+	int t, i, list;
+
+	for (list = 0; list <= 1; list += 1) {
+		ib = parallel_doc(list);
+		start = wall_ms();
+		for (i = 0; i < nb; i += 1) {
+			ob = bufnew(OUTPUT_UNIT);
+			markdown(ob, ib, &mkd_xhtml);
+			bufrelease(ob); }
+		ms = wall_ms() - start;
+		printf("threads %s %zu MB: markdown %10.3f ms\n",
+		    list ? "list " : "mixed", ib->size >> 20, ms);
+		for (t = 1; t <= max_threads; t = t < max_threads
+		    && t * 2 > max_threads ? max_threads : t * 2) {
+			start = wall_ms();
+			for (i = 0; i < nb; i += 1) {
+				ob = bufnew(OUTPUT_UNIT);
+				markdown_parallel(ob, ib, &mkd_xhtml, t);
+				bufrelease(ob); }
+			ms_par = wall_ms() - start;
+			printf("threads %3d: %10.3f ms, speed-up %5.2f\n",
+			    t, ms_par, ms / ms_par); }
+		bufrelease(ib); } }
+
+
+/* bench_batch • compares markdown() calls with markdown_batch() */
+static void
+bench_batch(int nb_docs, int nb) {
+	struct buf **ins, **outs;
+	double start, ms, *doc_ms, longest;
+	int i, j, t;
+
+	ins = malloc(nb_docs * sizeof *ins);
+	outs = malloc(nb_docs * sizeof *outs);
+	doc_ms = malloc(nb_docs * sizeof *doc_ms);
+	if (!ins || !outs || !doc_ms) return;
+	for (i = 0; i < nb_docs; i += 1)
+		ins[i] = single_doc(1 + i % 7, i % 2);
+
+	start = wall_ms();
+	for (j = 0; j < nb; j += 1)
+		for (i = 0; i < nb_docs; i += 1) {
+			outs[i] = bufnew(OUTPUT_UNIT);
+			markdown(outs[i], ins[i], &mkd_xhtml);
+			bufrelease(outs[i]); }
+	printf("batch %7d: markdown %10.3f ms\n", nb_docs, wall_ms() - start);
+
+	for (t = 1; t <= BATCH_THREADS; t *= 2) {
+		ms = longest = 0;
+		for (j = 0; j < nb; j += 1) {
+			for (i = 0; i < nb_docs; i += 1)
+				outs[i] = bufnew(OUTPUT_UNIT);
+			start = wall_ms();
+			markdown_batch(outs, ins, nb_docs, &mkd_xhtml, t, doc_ms);
+			ms += wall_ms() - start;
+			for (i = 0; i < nb_docs; i += 1) {
+				if (doc_ms[i] > longest) longest = doc_ms[i];
+				bufrelease(outs[i]); } }
+		printf("batch %d thread%s: %10.3f ms, longest document "
+		    "%.3f ms\n", t, t > 1 ? "s" : "", ms, longest); }
+
+	for (i = 0; i < nb_docs; i += 1)
+		bufrelease(ins[i]);
+	free(ins);
+	free(outs);
+	free(doc_ms); }
+
+
+/* plain renderer • text only, as for a search index */
+static void
+plain_block(struct buf *ob, struct buf *text, void *opaque) {
+	bufput(ob, text->data, text->size);
+	bufputc(ob, '\n'); }
+
+static void
+plain_header(struct buf *ob, struct buf *text, int level, void *opaque) {
+	plain_block(ob, text, opaque); }
+
+static int
+plain_emphasis(struct buf *ob, struct buf *text, char c, void *opaque) {
+	bufput(ob, text->data, text->size);
+	return 1; }
+
+static int
+plain_link(struct buf *ob, struct buf *link, struct buf *title,
+					struct buf *content, void *opaque) {
+	bufput(ob, content->data, content->size);
+	return 1; }
+
+
+/* bench_ast • compares markdown() calls with replays of a syntax tree */
+/*	each document is rendered as HTML, XHTML and plain text; the plain
+	renderer parses fewer constructs, so it replays its own tree, while
+	both HTML variants share the tree built for XHTML */
+static void
+bench_ast(int nb_paras, int nb) {
+	struct mkd_renderer plain = { 0 };
+	const struct mkd_renderer *outputs[3];
+	struct mkd_ast *html_ast, *plain_ast;
+	struct buf *ib, *ob, *ref;
+	clock_t start;
+	double ms_md, ms_build, ms_ast;
+	int i, j;
+
+	plain.paragraph = plain_block;
+	plain.header = plain_header;
+	plain.emphasis = plain_emphasis;
+	plain.link = plain_link;
+	plain.max_work_stack = 16;
+	plain.emph_chars = "*_";
+	outputs[0] = &mkd_html;
+	outputs[1] = &mkd_xhtml;
+	outputs[2] = &plain;
+	ib = single_doc(nb_paras, 0);
+
+	/* checking that the replays do the same work as markdown() */
+	html_ast = mkd_ast_build(ib, &mkd_xhtml);
+	plain_ast = mkd_ast_build(ib, &plain);
+	for (i = 0; i < 3; i += 1) {
+		ob = bufnew(OUTPUT_UNIT);
+		ref = bufnew(OUTPUT_UNIT);
+		markdown(ref, ib, outputs[i]);
+		mkd_render_ast(ob, i < 2 ? html_ast : plain_ast, outputs[i]);
+		if (ob->size != ref->size
+		|| memcmp(ob->data, ref->data, ob->size))
+			fprintf(stderr, "Warning: tree replay %d differs from "
+			    "markdown()\n", i);
+		bufrelease(ref);
+		bufrelease(ob); }
+	mkd_ast_free(html_ast);
+	mkd_ast_free(plain_ast);
+
+	start = clock();
+	for (j = 0; j < nb; j += 1)
+		for (i = 0; i < 3; i += 1) {
+			ob = bufnew(OUTPUT_UNIT);
+			markdown(ob, ib, outputs[i]);
+			bufrelease(ob); }
+	ms_md = (clock() - start) * 1000.0 / CLOCKS_PER_SEC;
+
+	start = clock();
+	for (j = 0; j < nb; j += 1) {
+		mkd_ast_free(mkd_ast_build(ib, &mkd_xhtml));
+		mkd_ast_free(mkd_ast_build(ib, &plain)); }
+	ms_build = (clock() - start) * 1000.0 / CLOCKS_PER_SEC;
+
+	start = clock();
+	for (j = 0; j < nb; j += 1) {
+		html_ast = mkd_ast_build(ib, &mkd_xhtml);
+		plain_ast = mkd_ast_build(ib, &plain);
+		for (i = 0; i < 3; i += 1) {
+			ob = bufnew(OUTPUT_UNIT);
+			mkd_render_ast(ob, i < 2 ? html_ast : plain_ast,
+								outputs[i]);
+			bufrelease(ob); }
+		mkd_ast_free(html_ast);
+		mkd_ast_free(plain_ast); }
+	ms_ast = (clock() - start) * 1000.0 / CLOCKS_PER_SEC;
+
+	printf("ast %7d: 3 x markdown %10.3f ms, 2 builds %10.3f ms, "
+	    "builds and 3 renders %10.3f ms\n", nb_paras, ms_md, ms_build,
+	    ms_ast);
+	bufrelease(ib); }
+
+
+/* bench_image • compares markdown() with rendering a mapped syntax tree */
+static void
+bench_image(int nb_paras, int nb) {
+	struct mkd_ast *ast;
+	struct buf *ib, *img, *ob;
+	clock_t start;
+	double ms_load;
+	FILE *f;
+	void *map;
+	int i;
+
+	ib = single_doc(nb_paras, 0);
+	img = bufnew(READ_UNIT);
+	ast = mkd_ast_build(ib, &mkd_xhtml);
+	if (!ast || mkd_ast_save(img, ast) < 0
+	|| (f = tmpfile()) == 0) {
+		fprintf(stderr, "Unable to save the syntax tree\n");
+		mkd_ast_free(ast);
+		return; }
+	mkd_ast_free(ast);
+	fwrite(img->data, 1, img->size, f);
+	fflush(f);
+
+	start = clock();
+	for (i = 0; i < nb; i += 1) {
+		map = mmap(0, img->size, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+		if (map == MAP_FAILED) break;
+		ast = mkd_ast_load(map, img->size);
+		ob = bufnew(OUTPUT_UNIT);
+		mkd_render_ast(ob, ast, &mkd_xhtml);
+		bufrelease(ob);
+		mkd_ast_free(ast);
+		munmap(map, img->size); }
+	ms_load = (clock() - start) * 1000.0 / CLOCKS_PER_SEC;
+
+	printf("image %7d: markdown %10.3f ms, mapped tree %10.3f ms "
+	    "(%ld kB image for %ld kB input)\n", nb_paras,
+	    bench_render(ib, nb), ms_load, (long)(img->size / 1024),
+	    (long)(ib->size / 1024));
+	fclose(f);
+	bufrelease(img);
+	bufrelease(ib); }
+
+
+/* bench_edit • compares rendering each keystroke with markdown() and edits */
+/*	nb characters are typed in the middle of a document of nb_paras */
+static void
+bench_edit(int nb_paras, int nb) {
+	struct mkd_edit *ed;
+	struct mkd_range changed;
+	struct buf *ib, *ob;
+	clock_t start;
+	double ms_md, ms_edit;
+	size_t pos;
+	int i, full = 0;
+
+	ib = single_doc(nb_paras, 0);
+	pos = ib->size / 2;
+	start = clock();
+	for (i = 0; i < nb; i += 1) {
+		bufput(ib, "x", 1);
+		memmove(ib->data + pos + i + 1, ib->data + pos + i,
+						ib->size - pos - i - 1);
+		ib->data[pos + i] = 'x';
+		ob = bufnew(OUTPUT_UNIT);
+		markdown(ob, ib, &mkd_xhtml);
+		bufrelease(ob); }
+	ms_md = (clock() - start) * 1000.0 / CLOCKS_PER_SEC;
+	bufrelease(ib);
+
+	ib = single_doc(nb_paras, 0);
+	ob = bufnew(OUTPUT_UNIT);
+	ed = mkd_edit_begin(ob, ib, &mkd_xhtml);
+	start = clock();
+	for (i = 0; i < nb; i += 1) {
+		bufput(ib, "x", 1);
+		memmove(ib->data + pos + i + 1, ib->data + pos + i,
+						ib->size - pos - i - 1);
+		ib->data[pos + i] = 'x';
+		full += mkd_edit_update(ed, ib, pos + i, pos + i, pos + i + 1,
+								&changed); }
+	ms_edit = (clock() - start) * 1000.0 / CLOCKS_PER_SEC;
+
+	printf("edit %7d: markdown %10.3f ms, edits %10.3f ms "
+	    "(%d keystrokes on %ld kB, %d full)\n", nb_paras, ms_md,
+	    ms_edit, nb, (long)(ib->size / 1024), full);
+	mkd_edit_free(ed);
+	bufrelease(ob);
+	bufrelease(ib); }
+
+
+/* bench_cache • compares markdown() with a render cache on repeated pages */
+/*	each of the nb rounds renders the same nb_pages pages */
+static void
+bench_cache(int nb_pages, int nb) {
+	struct mkd_cache_stats st;
+	struct mkd_cache *cache;
+	struct buf **pages, *ob;
+	clock_t start;
+	double ms_md, ms_cache;
+	int i, j;
+
+	pages = malloc(nb_pages * sizeof *pages);
+	if (!pages) return;
+	for (i = 0; i < nb_pages; i += 1)
+		pages[i] = single_doc(20 + i, 0);
+
+	start = clock();
+	for (j = 0; j < nb; j += 1)
+		for (i = 0; i < nb_pages; i += 1) {
+			ob = bufnew(OUTPUT_UNIT);
+			markdown(ob, pages[i], &mkd_xhtml);
+			bufrelease(ob); }
+	ms_md = (clock() - start) * 1000.0 / CLOCKS_PER_SEC;
+
+	cache = mkd_cache_new(64 << 20);
+	start = clock();
+	for (j = 0; j < nb; j += 1)
+		for (i = 0; i < nb_pages; i += 1) {
+			ob = bufnew(OUTPUT_UNIT);
+			markdown_cached(ob, pages[i], &mkd_xhtml, cache);
+			bufrelease(ob); }
+	ms_cache = (clock() - start) * 1000.0 / CLOCKS_PER_SEC;
+	mkd_cache_stats(cache, &st);
+
+	printf("cache %7d: markdown %10.3f ms, cached %10.3f ms "
+	    "(%lu hits, %lu misses, %lu kB)\n", nb_pages, ms_md, ms_cache,
+	    st.hits, st.misses, (unsigned long)(st.size / 1024));
+	mkd_cache_free(cache);
+	for (i = 0; i < nb_pages; i += 1)
+		bufrelease(pages[i]);
+	free(pages); }
+
+
+/* boilerplate_doc • a page of unique paragraphs framed by shared blocks */
+static struct buf *
+boilerplate_doc(int id) {
+	struct buf *ib = bufnew(READ_UNIT);
+	int i;
+	bufprintf(ib, "# Page %d\n\nWarning: this page describes an "
+	    "*unstable* interface, see\nthe [changelog][log] before "
+	    "relying on it.\n\n", id);
+	for (i = 0; i < 4; i += 1)
+		bufprintf(ib, "Paragraph %d of page %d with *emphasis* and "
+		    "`code`,\nfollowed by some more text.\n\n", i, id);
+	bufputs(ib, "| Option  | Default | Meaning                 |\n"
+	    "|---------|:-------:|-------------------------|\n"
+	    "| `-v`    | off     | prints *more* messages  |\n"
+	    "| `-q`    | off     | prints **no** messages  |\n"
+	    "| `-o`    | stdout  | selects the output file |\n");
+	for (i = 0; i < 3; i += 1)
+		bufprintf(ib, "* shared item %d, see [the manual][man]\n", i);
+	bufputs(ib, "\nPermission to use, copy, modify, and distribute "
+	    "this software for any\npurpose with or without fee is hereby "
+	    "granted, provided that the above\ncopyright notice and this "
+	    "permission notice appear in all copies.\n\n"
+	    "[log]: http://example.com/changelog \"Changes\"\n"
+	    "[man]: http://example.com/manual\n");
+	return ib; }
+
+
+/* bench_blocks • compares markdown() with a cache of top-level blocks */
+/*	each of the nb rounds renders nb_docs new pages sharing boilerplate */
+static void
+bench_blocks(int nb_docs, int nb) {
+	struct mkd_renderer cached = mkd_xhtml;
+	struct mkd_cache_stats st;
+	struct buf **docs, *ob;
+	clock_t start;
+	double ms_md, ms_blocks, lookups;
+	int i, n = nb_docs * nb;
+
+	docs = malloc(n * sizeof *docs);
+	if (!docs) return;
+	for (i = 0; i < n; i += 1)
+		docs[i] = boilerplate_doc(i);
+
+	start = clock();
+	for (i = 0; i < n; i += 1) {
+		ob = bufnew(OUTPUT_UNIT);
+		markdown(ob, docs[i], &mkd_xhtml);
+		bufrelease(ob); }
+	ms_md = (clock() - start) * 1000.0 / CLOCKS_PER_SEC;
+
+	cached.block_cache = mkd_cache_new(64 << 20);
+	start = clock();
+	for (i = 0; i < n; i += 1) {
+		ob = bufnew(OUTPUT_UNIT);
+		markdown(ob, docs[i], &cached);
+		bufrelease(ob); }
+	ms_blocks = (clock() - start) * 1000.0 / CLOCKS_PER_SEC;
+	mkd_cache_stats(cached.block_cache, &st);
+	lookups = st.hits + st.misses;
+
+	printf("blocks %7d: markdown %10.3f ms, cached %10.3f ms "
+	    "(%.1f%% hits, %.1f%% time saved)\n", nb_docs, ms_md, ms_blocks,
+	    lookups > 0 ? 100.0 * st.hits / lookups : 0.0,
+	    ms_md > 0 ? 100.0 * (ms_md - ms_blocks) / ms_md : 0.0);
+	mkd_cache_free(cached.block_cache);
+	for (i = 0; i < n; i += 1)
+		bufrelease(docs[i]);
+	free(docs); }
+
+
+/* bench_append • times nb_items appends to struct array and struct parray */
+static void
+bench_append(int nb_items, int nb) {
+	struct array arr;
+	struct parray parr;
+	clock_t start;
+	double ms_arr, ms_parr;
+	int i, j;
+
+	start = clock();
+	for (j = 0; j < nb; j += 1) {
+		arr_init(&arr, sizeof (size_t));
+		for (i = 0; i < nb_items; i += 1)
+			*(size_t *)arr_item(&arr, arr_newitem(&arr)) = i;
+		arr_free(&arr); }
+	ms_arr = (clock() - start) * 1000.0 / CLOCKS_PER_SEC;
+
+	start = clock();
+	for (j = 0; j < nb; j += 1) {
+		parr_init(&parr);
+		for (i = 0; i < nb_items; i += 1)
+			parr_push(&parr, &parr);
+		parr_free(&parr); }
+	ms_parr = (clock() - start) * 1000.0 / CLOCKS_PER_SEC;
+
+	printf("append %7d: array %10.3f ms, parray %10.3f ms\n",
+	    nb_items, ms_arr, ms_parr); }
+
+
 
 /* main • main function, interfacing STDIO with the parser */
 int
 main(int argc, char **argv) {
 	int nb = 1, i, j, f, files = 0;
+	int quote = 0, refs = 0, append = 0, single = 0, iov = 0, iter = 0;
+	int lazy = 0, threads = 0, batch = 0, ast = 0, image = 0, edit = 0;
+	int cache = 0, blocks = 0;
 	FILE *in = 0;
 
-	/* looking for a count number */
+	/* looking for a count number and synthetic benchmarks */
 	if (argc > 1) {
 		for (i = 1; i < argc; i += 1)
-			if (argv[i][0] == '-' && argv[i][1] == '-')
+			if (strncmp(argv[i], "--quote=", 8) == 0)
+				quote = atoi(argv[i] + 8);
+			else if (strncmp(argv[i], "--refs=", 7) == 0)
+				refs = atoi(argv[i] + 7);
+			else if (strncmp(argv[i], "--append=", 9) == 0)
+				append = atoi(argv[i] + 9);
+			else if (strncmp(argv[i], "--single=", 9) == 0)
+				single = atoi(argv[i] + 9);
+			else if (strncmp(argv[i], "--iov=", 6) == 0)
+				iov = atoi(argv[i] + 6);
+			else if (strncmp(argv[i], "--iter=", 7) == 0)
+				iter = atoi(argv[i] + 7);
+			else if (strncmp(argv[i], "--lazy=", 7) == 0)
+				lazy = atoi(argv[i] + 7);
+			else if (strncmp(argv[i], "--threads=", 10) == 0)
+				threads = atoi(argv[i] + 10);
+			else if (strncmp(argv[i], "--batch=", 8) == 0)
+				batch = atoi(argv[i] + 8);
+			else if (strncmp(argv[i], "--ast=", 6) == 0)
+				ast = atoi(argv[i] + 6);
+			else if (strncmp(argv[i], "--image=", 8) == 0)
+				image = atoi(argv[i] + 8);
+			else if (strncmp(argv[i], "--edit=", 7) == 0)
+				edit = atoi(argv[i] + 7);
+			else if (strncmp(argv[i], "--cache=", 8) == 0)
+				cache = atoi(argv[i] + 8);
+			else if (strncmp(argv[i], "--blocks=", 9) == 0)
+				blocks = atoi(argv[i] + 9);
+			else if (argv[i][0] == '-' && argv[i][1] == '-')
 				nb = atoi(argv[i] + 2);
 			else files += 1;
 		if (nb < 1) {
 			fprintf(stderr, "Usage: %s [--<number>] "
-					"[file] [file] ...\n", argv[0]);
+					"[--quote=<depth>] [--refs=<n>] "
+					"[--append=<n>] [--single=<n>] "
+					"[--iov=<segment size>] [--iter=<n>] "
+					"[--lazy=<n>] [--threads=<max>] "
+					"[--batch=<n>] [--ast=<n>] "
+					"[--image=<n>] [--edit=<n>] "
+					"[--cache=<n>] [--blocks=<n>] "
+					"[file] [file] ...\n",
+					argv[0]);
 			return 2; } }
 
+	/* synthetic benchmarks replace the default stdin input */
+	if (quote > 0) bench_quote(quote, nb);
+	if (refs > 0) bench_refs(refs, nb);
+	if (append > 0) bench_append(append, nb);
+	if (single > 0) bench_single(single, nb);
+	if (iov > 0) bench_iov(iov, nb);
+	if (iter > 0) bench_iter(iter, nb);
+	if (lazy > 0) bench_lazy(lazy, nb);
+	if (threads > 0) bench_threads(threads, nb);
+	if (batch > 0) bench_batch(batch, nb);
+	if (ast > 0) bench_ast(ast, nb);
+	if (image > 0) bench_image(image, nb);
+	if (edit > 0) bench_edit(edit, nb);
+	if (cache > 0) bench_cache(cache, nb);
+	if (blocks > 0) bench_blocks(blocks, nb);
+	if (files <= 0 && (quote > 0 || refs > 0 || append > 0 || single > 0
+			|| iov > 0 || iter > 0 || lazy > 0 || threads > 0
+			|| batch > 0 || ast > 0 || image > 0 || edit > 0
+			|| cache > 0 || blocks > 0))
+		return 0;
+
 	/* if no file is given, using stdin as the only file */
 	if (files <= 0) {
 		in = stdin;
@@ -16,29 +16,114 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#define _POSIX_C_SOURCE 200809L	/* for clock_gettime and mkstemp */
+
 #include "markdown.h"
 
 #include "array.h"
 
+#include <sys/stat.h>
+#include <sys/uio.h>
+
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <string.h>
 #include <strings.h> /* for strncasecmp */
+#include <time.h>
+#include <unistd.h>
 
 #define TEXT_UNIT 64	/* unit for the copy of the input buffer */
 #define WORK_UNIT 64	/* block-level working buffer */
+#define REF_UNIT 1024	/* reference string pool */
+#define STREAM_UNIT 1024	/* pending input of a stream */
+#define STREAM_HOLD 1048576	/* most output held for forward references */
+#define ITER_UNIT 65536	/* input bytes normalized by an iteration step */
+
+#define LOOKAHEAD_LINES 6	/* complete lines needed after a pieced line */
+#define PARALLEL_UNIT 65536	/* smallest text worth a parallel chunk */
+#define CHUNKS_PER_THREAD 4	/* parallel chunks, for load balancing */
+#define SEAM_MARKS 16		/* line starts kept to reconcile scan chunks */
+#define BATCH_JOBS 64		/* jobs per thread in a batch render */
+#define AST_NULL UINT32_MAX	/* span offset of a NULL buffer */
+#define AST_MAGIC "mkdT"	/* first bytes of a serialized syntax tree */
+#define AST_ORDER 0x01020304	/* byte order mark of a serialized tree */
+#define AST_VERSION 1		/* layout of the nodes and spans */
+#define EDIT_UNIT 4096		/* smallest text of an editable render chunk */
+#define TAG_SEEDS 1024		/* hash seeds tried for each block tag table size */
+#define TAG_TABLES 16		/* extra block tag sets kept built */
+#define CACHE_SHARDS 16		/* parts of a cache, locked separately */
+#define CACHE_SEEN 512		/* recent block hashes kept by a shard */
+#define DISK_MAGIC "soldout-cache 1"	/* first bytes of a disk cache entry */
+#define DISK_HEAD 80		/* longest header line of a disk cache entry */
 
 #define MKD_LI_END 8	/* internal list flag */
 
+/* block probes, selected by the first non-blank char of a block */
+#define BLOCK_EMPTY	1
+#define BLOCK_HRULE	2
+#define BLOCK_QUOTE	4
+#define BLOCK_CODE	8
+#define BLOCK_ULI	16
+#define BLOCK_OLI	32
+#define BLOCK_ATX	64	/* only without indentation */
+#define BLOCK_HTML	128	/* only without indentation */
+
 
 /***************
  * LOCAL TYPES *
  ***************/
 
-/* link_ref • reference to a link */
+/* link_ref • reference to a link, as offsets in the string pool */
 struct link_ref {
-	struct buf *	id;
-	struct buf *	link;
-	struct buf *	title; };
+	size_t		id;	/* normalized and lowercase */
+	size_t		id_size;
+	size_t		link;
+	size_t		link_size;
+	size_t		title;
+	size_t		title_size;
+	uint32_t	hash; };
+
+
+/* ref_table • link references, with their string pool and hash index */
+struct ref_table {
+	struct array	refs;	/* array of struct link_ref */
+	struct buf *	pool;	/* ids, links and titles */
+	int *		slot;	/* index + 1 in refs, 0 if free */
+	size_t		mask;
+	int		indexed; };	/* number of refs in the index */
+
+
+/* deferred_block • single-pass chunk which missed some link references */
+struct deferred_block {
+	size_t	text_beg;	/* normalized text, in the text pool */
+	size_t	text_end;
+	size_t	ob_beg;		/* output range of its first rendering */
+	size_t	ob_end;
+	int	miss_beg;	/* range of its missed ids */
+	int	miss_end; };
+
+
+/* ref_miss • link id not found in the document references (yet) */
+struct ref_miss {
+	size_t	id;		/* raw id, in the miss pool */
+	size_t	size; };
+
+
+/* backpatch • state of a single-pass render */
+struct backpatch {
+	struct array	blocks;	/* array of struct deferred_block */
+	struct array	misses;	/* array of struct ref_miss */
+	struct buf *	pool;	/* raw ids of the misses */
+	struct buf *	texts;	/* normalized text of the deferred chunks */
+	struct buf *	text;	/* chunk being read */
+	size_t		html;	/* first line of text maybe in an HTML block */
+	size_t		html_scan;	/* where to look again for its end */
+	int		html_wait; }; /* whether to wait for a '>' */
 
 
 /* char_trigger • function pointer to render active chars */
@@ -51,18 +136,434 @@ typedef size_t
 		char *data, size_t offset, size_t size);
 
 
+/* mkd_refdict • immutable reference table shared between renders */
+struct mkd_refdict {
+	struct ref_table	refs; };
+
+
 /* render • structure containing one particular render */
 struct render {
 	struct mkd_renderer	make;
-	struct array		refs;
+	struct ref_table	refs;
+	struct backpatch *	patch;	/* single-pass mode only */
+	int			lazy;	/* raw inline contents, see mkd_lazy */
+	struct parray		lazy_items;	/* item texts kept for lazy */
+	struct array		lazy_spans;	/* struct lazy_span */
+	size_t			lazy_top;	/* work stack of the span */
+	size_t			lazy_depth;	/* parsed by mkd_lazy_inline */
+	int			threads;	/* for huge lists and tables */
+	struct ast_build *	ast;	/* recording, see mkd_ast_build */
+	struct buf *		uses;	/* references used, for a block cache */
 	char_trigger		active_char[256];
-	struct parray		work; };
+	struct parray		work;
+	struct array		blocks;	/* struct block_task stack */
+	struct array		spans;	/* struct inline_span stack */
+	struct array		quote_lines;
+	struct array		quote_cuts;	/* see parse_blockquote */
+	struct array		code_lines;
+	const struct tag_table *	tags;	/* block tags */
+	struct tag_table *	own_tags; };	/* when not kept built */
+
+
+/* piece_carry • input lines going on in the next pieces, see take_piece */
+/*	the last line starts are kept, so that only new bytes are scanned */
+struct piece_carry {
+	struct buf *	buf;
+	size_t		scanned;	/* bytes of buf looked at */
+	size_t		nb;		/* line starts kept, the last ones */
+	size_t		line[LOOKAHEAD_LINES + 1]; };
+
+
+/* mkd_stream • render fed by pieces of input */
+struct mkd_stream {
+	struct render		rndr;
+	struct backpatch	patch;
+	struct buf *		ob;	/* caller buffer, for the final output */
+	struct piece_carry	in;	/* input lines not complete yet */
+	struct buf *		out;	/* output not given to ob yet */
+	size_t			given; };	/* bytes of out already in ob */
+
+
+/* iter_state • current step of a pull-style render */
+enum iter_state {
+	ITER_SINGLE_PASS,	/* rendering lines, see MKD_SINGLE_PASS */
+	ITER_FIRST_PASS,	/* collecting references */
+	ITER_BLOCKS,		/* rendering top-level blocks */
+	ITER_END };
+
+
+/* mkd_iter • pull-style render, one step at a time */
+struct mkd_iter {
+	struct render		rndr;
+	struct backpatch	patch;	/* single-pass mode only */
+	const struct buf *	ib;	/* input, left unchanged by the caller */
+	struct buf *		text;	/* normalized input */
+	struct buf *		ob;	/* caller buffer */
+	struct buf *		out;	/* output not given to ob yet */
+	size_t			given;	/* bytes of out already in ob */
+	size_t			beg;	/* next line of ib, or next block */
+	enum iter_state		state; };
+
+
+/* mkd_lazy • render whose inline spans are parsed on demand */
+struct mkd_lazy {
+	struct render		rndr;
+	struct buf *		text;	/* normalized input, with the spans */
+	int			rendered;	/* 1 while rendering, 2 after */
+	int			sorted; };	/* lazy_spans, once looked up */
+
+
+/* lazy_span • raw span handed out, with the depth it would be parsed at */
+struct lazy_span {
+	uintptr_t	data;
+	size_t		size;
+	size_t		depth; };	/* of the work stack */
+
+
+/* edit_line • line start of an input, with the normalized text before it */
+struct edit_line {
+	size_t	in;
+	size_t	text; };
+
+
+/* edit_chunk • top-level blocks rendered together by an editable render */
+struct edit_chunk {
+	size_t	in;	/* first line, in the input */
+	size_t	out; };	/* first byte of the output */
+
+
+/* mkd_edit • render kept up to date with the edits of its input */
+struct mkd_edit {
+	struct render		rndr;
+	struct buf *		ob;	/* caller buffer, holding the output */
+	size_t			base;	/* size of ob before the render */
+	size_t			end;	/* end of the blocks, before epilog */
+	struct buf *		in;	/* copy of the input */
+	struct buf *		text;	/* normalized input being rendered */
+	struct buf *		old;	/* normalized replaced input */
+	struct buf *		out;	/* render of the edited chunks */
+	struct array		chunks;	/* struct edit_chunk, in input order */
+	struct array		lines;	/* struct edit_line of text */
+	struct array		cuts;	/* struct edit_line, chunk starts */
+	struct ref_table	old_refs;	/* of the replaced input */
+	struct ref_table	new_refs; };	/* of its replacement */
+
+
+/* cache_kind • what a cached render is made of */
+enum cache_kind {
+	CACHE_DOCUMENT,		/* whole render, with prolog and epilog */
+	CACHE_FIRST_BLOCKS,	/* top-level blocks, with no output before */
+	CACHE_BLOCKS };		/* top-level blocks, after some output */
+
+
+/* cache_key • what a cached render is looked up by */
+struct cache_key {
+	uint64_t			hash;	/* of the data and kind */
+	const char *			data;	/* input or normalized text */
+	size_t				size;
+	uint64_t			rndr;	/* renderer_hash() */
+	enum cache_kind			kind; };
+
+
+/* cache_entry • render kept in a shard of a cache */
+struct cache_entry {
+	uint64_t			hash;
+	uint64_t			rndr;
+	enum cache_kind			kind;
+	struct buf *			in;	/* copy of the key data */
+	struct buf *			out;	/* render, shared with callers */
+	struct buf *			uses;	/* references used by blocks */
+	struct cache_entry *		newer;	/* LRU list */
+	struct cache_entry *		older;
+	struct cache_entry *		chain; };	/* in the same slot */
+
+
+/* cache_shard • part of a render cache, with its own lock */
+struct cache_shard {
+	pthread_mutex_t		lock;
+	struct cache_entry **	slot;	/* hash chains */
+	size_t			mask;
+	size_t			nb;	/* number of entries */
+	size_t			size;	/* bytes used by the entries */
+	struct cache_entry *	newest;
+	struct cache_entry *	oldest;
+	unsigned long		hits;
+	unsigned long		misses;
+	unsigned long		evictions;
+	uint64_t		seen[CACHE_SEEN]; };	/* blocks met once */
+
+
+/* mkd_cache • renders kept by input hash and renderer, in LRU order */
+struct mkd_cache {
+	struct cache_shard	shards[CACHE_SHARDS];
+	size_t			max_size;	/* of all the shards */
+	size_t			size;		/* bytes used by them */
+	pthread_mutex_t		size_lock;	/* for the size */
+	pthread_mutex_t		ref_lock; };	/* for the shared renders */
+
+
+/* pool_worker • thread of a pool, with the range of jobs it still owns */
+struct pool_worker {
+	struct pool *	pool;
+	pthread_mutex_t	lock;
+	int		next;	/* next job to run */
+	int		end;
+	int		id; };
+
+
+/* pool • jobs shared by threads, idle ones stealing from the others */
+struct pool {
+	struct pool_worker *	workers;
+	int			nb;	/* number of workers */
+	void			(*run)(void *ctx, int worker, int job);
+	void *			ctx; };
+
+
+/* text_chunk • top-level blocks of the text, rendered by a parallel job */
+struct text_chunk {
+	size_t		beg;
+	size_t		end;
+	struct buf *	out;	/* render, after a placeholder byte if pad */
+	int		pad; };
+
+
+/* scan_mark • line start reached while scanning, with the output so far */
+struct scan_mark {
+	size_t	pos;
+	size_t	text;	/* size of the normalized text */
+	int	refs; };	/* number of references */
+
+
+/* scan_chunk • slice of the input, scanned by a parallel first pass job */
+struct scan_chunk {
+	size_t			beg;
+	size_t			end;	/* where the scan actually stopped */
+	struct buf *		text;	/* normalized lines */
+	struct ref_table	refs;
+	struct scan_mark	marks[SEAM_MARKS];	/* first line starts */
+	int			nb_marks;
+	size_t			skip_text;	/* output before the seam */
+	int			skip_refs;
+	size_t			at; };	/* offset of the text in the result */
+
+
+/* first_pass • state of a parallel first pass */
+struct first_pass {
+	const struct buf *	ib;
+	struct buf *		text;	/* result */
+	struct scan_chunk *	chunks;
+	int			nb; };
+
+
+/* block_part • consecutive list items or table rows, rendered by a job */
+struct block_part {
+	int		first;
+	int		last;
+	struct buf *	out;	/* render, after a placeholder byte if pad */
+	int		pad; };
+
+
+/* block_jobs • huge list or table, whose items or rows are parallel jobs */
+struct block_jobs {
+	struct render *		rndr;
+	struct render *		workers;
+	char *			data;
+	size_t			size;
+	struct array		starts;	/* size_t offset of each item or row */
+	struct array		flags;	/* int list flags before each item */
+	int *			aligns;
+	size_t			align_size;
+	struct block_part *	parts;
+	int			nb;
+	size_t			depth;	/* work stack of the serial render */
+	void			(*render)(struct buf *ob,
+					struct render *rndr,
+					struct block_jobs *bj, int first,
+					int last); };
+
+
+/* batch • documents rendered by a pool, jobs being consecutive documents */
+struct batch {
+	struct buf **	outs;
+	struct buf **	ins;
+	size_t *	first;	/* first document of each job, and the end */
+	struct render *	workers;	/* render of each thread, reused */
+	struct buf **	texts;	/* normalized text of each thread */
+	double *	ms;	/* time spent on each document, if not NULL */
+	int		nb; };	/* number of jobs */
+
+
+/* parallel • state of a parallel render */
+struct parallel {
+	struct buf *		text;	/* normalized text, left unchanged */
+	struct text_chunk *	chunks;
+	struct render *		workers;	/* render of each thread */
+	struct buf **		copies;	/* text of the chunk of each thread */
+	int			nb;	/* number of chunks */
+	int			threads; };
+
+
+/* ast_type • kind of a syntax tree node, mostly one per callback */
+enum ast_type {
+	AST_RAW,		/* input copied verbatim by the parser */
+	AST_TRIM,		/* last output char dropped when it is flags */
+	AST_BLOCKCODE,
+	AST_BLOCKQUOTE,
+	AST_BLOCKHTML,
+	AST_HEADER,
+	AST_HRULE,
+	AST_LIST,
+	AST_LISTITEM,
+	AST_PARAGRAPH,
+	AST_TABLE,		/* flags is the size of the header row or -1 */
+	AST_TABLE_CELL,
+	AST_TABLE_ROW,
+	AST_AUTOLINK,
+	AST_CODESPAN,
+	AST_DOUBLE_EMPHASIS,
+	AST_EMPHASIS,
+	AST_IMAGE,
+	AST_LINEBREAK,
+	AST_LINK,
+	AST_RAW_HTML_TAG,
+	AST_TRIPLE_EMPHASIS,
+	AST_ENTITY,
+	AST_NORMAL_TEXT };
+
+
+/* ast_node • node of a syntax tree, children and spans being ranges */
+struct ast_node {
+	uint8_t		type;	/* enum ast_type */
+	uint8_t		nb_spans;
+	int16_t		flags;	/* level, list or cell flags, emphasis char */
+	uint32_t	spans;	/* first buffer argument in the span array */
+	uint32_t	kids;	/* first child in the kid array */
+	uint32_t	nb_kids; };
+
+
+/* ast_span • buffer argument of a callback, as a range of the text */
+struct ast_span {
+	uint32_t	off;	/* AST_NULL for a NULL buffer */
+	uint32_t	size; };
+
+
+/* mkd_ast • flat syntax tree, its spans pointing into its own text */
+struct mkd_ast {
+	struct buf *	text;	/* normalized text, then copied spans */
+	struct array	nodes;	/* struct ast_node */
+	struct array	kids;	/* uint32_t, node numbers */
+	struct array	spans;	/* struct ast_span */
+	uint32_t	root;	/* first top-level block in kids */
+	uint32_t	nb_root;
+	struct buf	view;	/* text of a loaded image */
+	const void *	image; };	/* loaded image, or NULL */
+
+
+/* ast_image • header of a serialized syntax tree, see mkd_ast_save */
+/*	followed by the nodes, the kids, the spans and the text */
+struct ast_image {
+	char		magic[4];
+	uint32_t	order;	/* AST_ORDER, for the byte order */
+	uint32_t	version;
+	uint32_t	nb_nodes;
+	uint32_t	nb_kids;
+	uint32_t	nb_spans;
+	uint32_t	root;
+	uint32_t	nb_root;
+	uint32_t	text_size; };
+
+
+/* ast_build • state of the renderer recording a syntax tree */
+struct ast_build {
+	struct mkd_ast *		ast;
+	const struct mkd_renderer *	make;	/* renderer mirrored */
+	struct buf *			pool;	/* spans out of the text */
+	struct buf *			scratch;	/* span callbacks output */
+	const char *			text;	/* normalized text, parsed */
+	size_t				text_size;
+	size_t				table_mark;	/* rows of a table */
+	int				failed; };
+
+
+/* ast_frame • node of a syntax tree being replayed, see mkd_render_ast */
+struct ast_frame {
+	uint32_t	node;
+	uint32_t	next;	/* next child to render */
+	struct buf *	ob;	/* output of the node */
+	struct buf *	work;	/* output of the children */
+	struct buf *	head; };	/* header row of a table */
+
+
+/* quote_line • line of a blockquote, with its nested quote prefixes */
+/*	cut is the quote level from which the line is an empty line followed
+ *	by a non-quote line, ending the blockquote there, or SIZE_MAX */
+struct quote_line {
+	size_t	beg;	/* beginning of the line, outer prefix stripped */
+	size_t	end;	/* end of the line, newline included */
+	size_t	depth;	/* number of nested quote prefixes */
+	size_t	cut;
+	int	blank;	/* whether the line is empty past its prefixes */
+	int	bare; };	/* whether nothing is left past its prefixes */
+
+
+/* block_step • pending step of the block-level parser, see run_blocks */
+enum block_step {
+	STEP_BLOCKS,	/* parsing of a sequence of blocks */
+	STEP_QUOTE,	/* blockquote render, once its content is parsed */
+	STEP_LIST,	/* next list item, or list render after the last one */
+	STEP_ITEM };	/* list item render, once its content is parsed */
+
+
+/* block_task • block-level parsing state, stacked instead of recursing */
+struct block_task {
+	enum block_step	step;
+	struct buf *	ob;	/* output of the task */
+	char *		data;	/* blocks or list items to parse */
+	size_t		size;
+	size_t		beg;	/* size of data already parsed */
+	size_t		nb;	/* number of blocks or items begun */
+	size_t		base;	/* first working buffer owned by the task */
+	size_t		level;	/* number of working buffers owned */
+	int		flags; };	/* list flags, or single block */
+
+
+/* span_step • render of an inline span once parsed, see parse_inline */
+enum span_step {
+	SPAN_TEXT,	/* text given to parse_inline */
+	SPAN_EMPH1,	/* content of a single emphasis */
+	SPAN_EMPH2,	/* content of a double emphasis */
+	SPAN_EMPH3,	/* content of a triple emphasis */
+	SPAN_LINK };	/* content of a link */
+
+
+/* inline_span • inline parsing state, stacked instead of recursing */
+struct inline_span {
+	enum span_step	step;
+	struct buf *	ob;	/* output of the span */
+	char *		data;
+	size_t		size;
+	size_t		i;	/* beginning of the text not parsed yet */
+	size_t		end;	/* end of the inactive chars from i */
+	size_t		skip;	/* size of the whole construct in the parent */
+	char		c; };	/* emphasis char */
 
 
 /* html_tag • structure for quick HTML tag search (inspired from discount) */
 struct html_tag {
-	char *	text;
-	int	size; };
+	const char *	text;
+	size_t		size; };
+
+
+/* tag_table • perfect hash of block_tags and of extra tags */
+/*	the extra tags and their names are copied after the structure */
+struct tag_table {
+	const struct html_tag **	slot;
+	uint32_t		seed;
+	uint32_t		mask;
+	size_t			max;	/* longest tag name */
+	struct html_tag *	extra;
+	size_t			nb_extra;
+	struct tag_table *	next; };	/* in tag_tables */
 
 
 
@@ -70,8 +571,8 @@ struct html_tag {
  * GLOBAL VARIABLES *
  ********************/
 
-/* block_tags • recognised block tags, sorted by cmp_html_tag */
-static struct html_tag block_tags[] = {
+/* block_tags • recognised block tags, sorted by size */
+static const struct html_tag block_tags[] = {
 /*0*/	{ "p",		1 },
 	{ "dl",		2 },
 	{ "h1",		2 },
@@ -85,105 +586,340 @@ static struct html_tag block_tags[] = {
 /*10*/	{ "del",	3 },
 	{ "div",	3 },
 /*12*/	{ "ins",	3 },
+	{ "nav",	3 },
 	{ "pre",	3 },
 	{ "form",	4 },
+	{ "main",	4 },
 	{ "math",	4 },
+	{ "aside",	5 },
 	{ "table",	5 },
+/*20*/	{ "dialog",	6 },
+	{ "figure",	6 },
+	{ "footer",	6 },
+	{ "header",	6 },
+	{ "hgroup",	6 },
 	{ "iframe",	6 },
 	{ "script",	6 },
+	{ "address",	7 },
+	{ "article",	7 },
+	{ "details",	7 },
+/*30*/	{ "section",	7 },
+	{ "summary",	7 },
 	{ "fieldset",	8 },
 	{ "noscript",	8 },
-	{ "blockquote",	10 } };
+	{ "blockquote",	10 },
+	{ "figcaption",	10 } };
 
 #define INS_TAG (block_tags + 12)
 #define DEL_TAG (block_tags + 10)
 
 
+/* default_tags • perfect hash of block_tags only, see default_tag_table */
+#define BLOCK_TAG_MAX	10	/* longest tag in block_tags */
+static const struct html_tag *default_slot[256];
+static struct tag_table default_tags = { default_slot, 0, 0, BLOCK_TAG_MAX,
+								0, 0, 0 };
+static pthread_once_t default_tags_once = PTHREAD_ONCE_INIT;
+
+/* tag_tables • tables with extra tags, kept until the process ends */
+static struct tag_table *tag_tables;
+static size_t nb_tag_tables;
+static pthread_mutex_t tag_tables_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* block_probe • block probes worth trying, from the first non-blank char */
+static const unsigned char block_probe[256] = {
+	['\t'] = BLOCK_EMPTY | BLOCK_CODE,
+	['\n'] = BLOCK_EMPTY,
+	[' '] = BLOCK_EMPTY | BLOCK_CODE,
+	['#'] = BLOCK_ATX,
+	['*'] = BLOCK_HRULE | BLOCK_ULI,
+	['+'] = BLOCK_ULI,
+	['-'] = BLOCK_HRULE | BLOCK_ULI,
+	['0'] = BLOCK_OLI, ['1'] = BLOCK_OLI, ['2'] = BLOCK_OLI,
+	['3'] = BLOCK_OLI, ['4'] = BLOCK_OLI, ['5'] = BLOCK_OLI,
+	['6'] = BLOCK_OLI, ['7'] = BLOCK_OLI, ['8'] = BLOCK_OLI,
+	['9'] = BLOCK_OLI,
+	['<'] = BLOCK_HTML,
+	['>'] = BLOCK_QUOTE,
+	['_'] = BLOCK_HRULE };
+
+
 
 /***************************
  * STATIC HELPER FUNCTIONS *
  ***************************/
 
+/* is_ref_space • whitespace collapsed in ref ids */
+static int
+is_ref_space(char c) {
+	return c == ' ' || c == '\t' || c == '\n'; }
+
+
+/* fold_ref_char • ASCII lowercase, as in bufcasecmp */
+static char
+fold_ref_char(char c) {
+	return (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c; }
+
+
+/* trim_ref_id • strips leading and trailing whitespace of a raw ref id */
+static size_t
+trim_ref_id(const char **data, size_t size) {
+	while (size > 0 && is_ref_space((*data)[0])) {
+		*data += 1;
+		size -= 1; }
+	while (size > 0 && is_ref_space((*data)[size - 1]))
+		size -= 1;
+	return size; }
+
+
 /* build_ref_id • collapse whitespace from input text to make it a ref id */
+/*	the id is appended to the given buffer */
 static int
 build_ref_id(struct buf *id, const char *data, size_t size) {
 	size_t beg, i;
 
-	/* skip leading whitespace */
-	while (size > 0
-	&& (data[0] == ' ' || data[0] == '\t' || data[0] == '\n')) {
-		data += 1;
-		size -= 1; }
-
-	/* skip trailing whitespace */
-	while (size > 0
-	&& (data[size - 1] == ' ' || data[size - 1] == '\t'
-	 || data[size - 1] == '\n'))
-		size -= 1;
+	/* skip leading and trailing whitespace */
+	size = trim_ref_id(&data, size);
 	if (size == 0) return -1;
 
 	/* making the ref id */
 	i = 0;
-	id->size = 0;
 	while (i < size) {
 		/* copy non-whitespace into the output buffer */
 		beg = i;
-		while (i < size
-		&& !(data[i] == ' ' || data[i] == '\t' || data[i] == '\n'))
+		while (i < size && !is_ref_space(data[i]))
 			i += 1;
 		bufput(id, data + beg, i - beg);
 
 		/* add a single space and skip all consecutive whitespace */
 		if (i < size) bufputc(id, ' ');
-		while (i < size
-		&& (data[i] == ' ' || data[i] == '\t' || data[i] == '\n'))
+		while (i < size && is_ref_space(data[i]))
 			i += 1; }
 	return 0; }
 
 
-/* cmp_link_ref • comparison function for link_ref sorted arrays */
-static int
-cmp_link_ref(void *key, void *array_entry) {
-	struct link_ref *lr = array_entry;
-	return bufcasecmp(key, lr->id); }
+/* hash_ref_id • case-folding hash of a trimmed ref id */
+/*	whitespace runs are hashed as a single space, as build_ref_id does */
+static uint32_t
+hash_ref_id(const char *data, size_t size) {
+	size_t i;
+	uint32_t h = 2166136261u;
+	for (i = 0; i < size; i += 1) {
+		if (!is_ref_space(data[i]))
+			h ^= (unsigned char)fold_ref_char(data[i]);
+		else if (is_ref_space(data[i - 1]))
+			continue;
+		else	h ^= ' ';
+		h *= 16777619u; }
+	return h ^ (h >> 16); }
 
 
-/* cmp_link_ref_sort • comparison function for link_ref qsort */
+/* match_ref_id • compares a stored id with a trimmed raw ref id */
 static int
-cmp_link_ref_sort(const void *a, const void *b) {
-	const struct link_ref *lra = a;
-	const struct link_ref *lrb = b;
-	return bufcasecmp(lra->id, lrb->id); }
+match_ref_id(const char *id, size_t id_size, const char *data, size_t size) {
+	size_t i = 0, j = 0;
+	while (i < size && j < id_size) {
+		if (is_ref_space(data[i])) {
+			if (id[j] != ' ') return 0;
+			while (i < size && is_ref_space(data[i])) i += 1; }
+		else if (fold_ref_char(data[i]) != id[j])
+			return 0;
+		else	i += 1;
+		j += 1; }
+	return i >= size && j >= id_size; }
+
+
+/* hash_block_tag • case-folding hash of a tag name, for alphanumeric names */
+static uint32_t
+hash_block_tag(const char *data, size_t size, uint32_t seed) {
+	size_t i;
+	uint32_t h = seed;
+	for (i = 0; i < size; i += 1) {
+		h ^= (unsigned char)(data[i] | 0x20);
+		h *= 16777619u; }
+	return h ^ (h >> 16); }
 
 
-/* cmp_html_tag • comparison function for bsearch() (stolen from discount) */
+/* is_tag_name • case-insensitive comparison of data with a tag name */
 static int
-cmp_html_tag(const void *a, const void *b) {
-	const struct html_tag *hta = a;
-	const struct html_tag *htb = b;
-	if (hta->size != htb->size) return hta->size - htb->size;
-	return strncasecmp(hta->text, htb->text, hta->size); }
+is_tag_name(const struct html_tag *tag, const char *data, size_t size) {
+	size_t i;
+	char c;
+	if (tag->size > size) return 0;
+	for (i = 0; i < tag->size; i += 1) {
+		c = data[i];
+		if (c >= 'A' && c <= 'Z') c += 'a' - 'A';
+		if (c != tag->text[i]) return 0; }
+	return 1; }
 
 
 /* find_block_tag • returns the current block tag */
-static struct html_tag *
-find_block_tag(char *data, size_t size) {
+static const struct html_tag *
+find_block_tag(struct render *rndr, char *data, size_t size) {
 	size_t i = 0;
-	struct html_tag key;
+	const struct html_tag *tag;
 
 	/* looking for the word end */
-	while (i < size && ((data[i] >= '0' && data[i] <= '9')
+	while (i < size && i <= rndr->tags->max
+			&& ((data[i] >= '0' && data[i] <= '9')
 				|| (data[i] >= 'A' && data[i] <= 'Z')
 				|| (data[i] >= 'a' && data[i] <= 'z')))
 		i += 1;
-	if (i >= size) return 0;
+	if (i >= size || i > rndr->tags->max) return 0;
+
+	/* single probe into the perfect hash */
+	tag = rndr->tags->slot[hash_block_tag(data, i, rndr->tags->seed)
+						& rndr->tags->mask];
+	return (tag && tag->size == i && is_tag_name(tag, data, i)) ? tag : 0; }
+
+
+/* fill_block_tags • tries to fill a hash table without collision */
+static int
+fill_block_tags(const struct html_tag **slot, uint32_t mask, uint32_t seed,
+				const struct html_tag *extra, size_t nb_extra) {
+	const size_t nb_default = sizeof block_tags / sizeof block_tags[0];
+	const struct html_tag *tag;
+	size_t i, h;
+
+	for (i = 0; i <= mask; i += 1)
+		slot[i] = 0;
+	for (i = 0; i < nb_default + nb_extra; i += 1) {
+		tag = (i < nb_default)
+		    ? block_tags + i : extra + (i - nb_default);
+		h = hash_block_tag(tag->text, tag->size, seed) & mask;
+		if (!slot[h])
+			slot[h] = tag;
+		else if (slot[h]->size != tag->size
+		|| !is_tag_name(slot[h], tag->text, tag->size))
+			return 0; /* collision with a different tag */ }
+	return 1; }
+
+
+/* search_block_tags • looks for the smallest collision-free table */
+/*	slot is reallocated as needed, up to max_mask + 1 entries */
+static int
+search_block_tags(struct tag_table *t, const struct html_tag ***slot,
+							uint32_t max_mask) {
+	const struct html_tag **neo;
+	size_t n = t->nb_extra + sizeof block_tags / sizeof block_tags[0];
+	uint32_t mask, seed;
+
+	for (mask = 63; mask <= max_mask && mask < n * n * 4;
+						mask = mask * 2 + 1) {
+		if (max_mask == UINT32_MAX) {
+			neo = realloc(*slot, (mask + 1) * sizeof *neo);
+			if (!neo) return 0;
+			*slot = neo; }
+		for (seed = 0; seed < TAG_SEEDS; seed += 1)
+			if (fill_block_tags(*slot, mask, seed,
+						t->extra, t->nb_extra)) {
+				t->slot = *slot;
+				t->seed = seed;
+				t->mask = mask;
+				return 1; } }
+	return 0; }
+
+
+/* default_tag_table • fills default_tags, see pthread_once */
+static void
+default_tag_table(void) {
+	const struct html_tag **slot = default_slot;
+	search_block_tags(&default_tags, &slot,
+			sizeof default_slot / sizeof default_slot[0] - 1); }
+
+
+/* same_extra_tags • whether a table was built from the given tags */
+static int
+same_extra_tags(const struct tag_table *t, const struct html_tag *extra,
+							size_t nb) {
+	size_t i;
+	if (t->nb_extra != nb) return 0;
+	for (i = 0; i < nb; i += 1)
+		if (t->extra[i].size != extra[i].size
+		|| memcmp(t->extra[i].text, extra[i].text, extra[i].size))
+			return 0;
+	return 1; }
+
+
+/* new_tag_table • builds a table with copies of the extra tags */
+static struct tag_table *
+new_tag_table(const struct html_tag *extra, size_t nb) {
+	struct tag_table *t;
+	const struct html_tag **slot = 0;
+	size_t i, len = 0;
+	char *names;
+
+	for (i = 0; i < nb; i += 1)
+		len += extra[i].size + 1;
+	t = malloc(sizeof *t + nb * sizeof *extra + len);
+	if (!t) return 0;
+	t->extra = (struct html_tag *)(t + 1);
+	t->nb_extra = nb;
+	t->max = BLOCK_TAG_MAX;
+	t->next = 0;
+	names = (char *)(t->extra + nb);
+	for (i = 0; i < nb; i += 1) {
+		memcpy(names, extra[i].text, extra[i].size + 1);
+		t->extra[i].text = names;
+		t->extra[i].size = extra[i].size;
+		if (extra[i].size > t->max) t->max = extra[i].size;
+		names += extra[i].size + 1; }
+	if (!search_block_tags(t, &slot, UINT32_MAX)) {
+		free(slot);
+		free(t);
+		return 0; }
+	return t; }
+
+
+/* free_tag_table • releases a table from new_tag_table */
+static void
+free_tag_table(struct tag_table *t) {
+	if (!t) return;
+	free(t->slot);
+	free(t); }
+
 
-	/* binary search of the tag */
-	key.text = data;
-	key.size = i;
-	return bsearch(&key, block_tags,
-				sizeof block_tags / sizeof block_tags[0],
-				sizeof block_tags[0], cmp_html_tag); }
+/* build_block_tags • perfect hash of block_tags and renderer extra tags */
+/*	the table for a given set of extra tags is built once and kept, up to
+ *	TAG_TABLES sets, further ones are built for the render and released
+ *	with it; the default table is kept on failure */
+static void
+build_block_tags(struct render *rndr) {
+	const char *const *names = rndr->make.extra_block_tags;
+	struct html_tag *extra;
+	struct tag_table *t;
+	size_t n = 0, nb = 0, i, j;
+
+	/* collecting valid extra tags, lowercase alphanumeric only */
+	if (!names) return;
+	while (names[n]) n += 1;
+	if (!n) return;
+	extra = malloc(n * sizeof *extra);
+	if (!extra) return;
+	for (i = 0; i < n; i += 1) {
+		j = 0;
+		while ((names[i][j] >= '0' && names[i][j] <= '9')
+		|| (names[i][j] >= 'a' && names[i][j] <= 'z'))
+			j += 1;
+		if (j == 0 || names[i][j]) continue;
+		extra[nb].text = names[i];
+		extra[nb].size = j;
+		nb += 1; }
+
+	/* looking for a table already built */
+	if (nb) {
+		pthread_mutex_lock(&tag_tables_lock);
+		for (t = tag_tables; t; t = t->next)
+			if (same_extra_tags(t, extra, nb)) break;
+		if (!t && nb_tag_tables < TAG_TABLES
+		&& (t = new_tag_table(extra, nb)) != 0) {
+			t->next = tag_tables;
+			tag_tables = t;
+			nb_tag_tables += 1; }
+		pthread_mutex_unlock(&tag_tables_lock);
+		if (!t) t = rndr->own_tags = new_tag_table(extra, nb);
+		if (t) rndr->tags = t; }
+	free(extra); }
 
 
 /* new_work_buffer • get a new working buffer from the stack or create one */
@@ -191,7 +927,8 @@ static struct buf *
 new_work_buffer(struct render *rndr) {
 	struct buf *ret = 0;
 
-	if (rndr->work.size < rndr->work.asize) {
+	if (rndr->work.size < rndr->work.asize
+	&& rndr->work.item[rndr->work.size]) {
 		ret = rndr->work.item[rndr->work.size ++];
 		ret->size = 0; }
 	else {
@@ -208,6 +945,101 @@ release_work_buffer(struct render *rndr, struct buf *buf) {
 	rndr->work.size -= 1; }
 
 
+/* ast_node • appends a node to a syntax tree, its number going into ob */
+/*	returns the node number, or -1 when out of memory */
+static int
+ast_node(struct buf *ob, struct ast_build *b, enum ast_type type, int flags){
+	struct ast_node *node;
+	uint32_t no;
+	int n;
+
+	if (b->failed
+	|| (n = arr_newitem(&b->ast->nodes)) < 0) {
+		b->failed = 1;
+		return -1; }
+	node = arr_item(&b->ast->nodes, n);
+	node->type = type;
+	node->flags = flags;
+	node->kids = b->ast->kids.size;
+	node->spans = b->ast->spans.size;
+	node->nb_kids = node->nb_spans = 0;
+	no = n;
+	bufput(ob, &no, sizeof no);
+	return n; }
+
+
+/* ast_span • appends a buffer argument to the node n */
+/*	buffers pointing into the text are kept in place, others are copied */
+static void
+ast_span(struct ast_build *b, int n, const char *data, size_t size, int null){
+	struct ast_span *sp;
+	struct ast_node *node;
+	size_t off = 0;
+	int i;
+
+	if (n < 0 || b->failed) return;
+	if (null) off = AST_NULL;
+	else if (size && data >= b->text && data < b->text + b->text_size
+	&& size <= b->text_size - (data - b->text))
+		off = data - b->text;
+	else if (size) {
+		off = b->text_size + b->pool->size;
+		bufput(b->pool, data, size); }
+	if ((null ? 0 : off + size) >= AST_NULL
+	|| (i = arr_newitem(&b->ast->spans)) < 0) {
+		b->failed = 1;
+		return; }
+	sp = arr_item(&b->ast->spans, i);
+	sp->off = off;
+	sp->size = size;
+	node = arr_item(&b->ast->nodes, n);
+	node->nb_spans += 1; }
+
+
+/* ast_buf • appends a buffer argument, which may be NULL, to the node n */
+static void
+ast_buf(struct ast_build *b, int n, const struct buf *buf) {
+	if (buf) ast_span(b, n, buf->data, buf->size, 0);
+	else ast_span(b, n, 0, 0, 1); }
+
+
+/* ast_kids • appends the nodes whose numbers are in buf to the node n */
+/*	returns the number of nodes appended */
+static int
+ast_kids(struct ast_build *b, int n, const struct buf *buf) {
+	struct ast_node *node;
+	size_t nb = buf ? buf->size / sizeof (uint32_t) : 0;
+	int first = b->ast->kids.size;
+
+	if (n < 0 || b->failed || !nb) return 0;
+	if (!arr_grow(&b->ast->kids, first + nb)) {
+		b->failed = 1;
+		return 0; }
+	memcpy((uint32_t *)b->ast->kids.base + first, buf->data,
+					nb * sizeof (uint32_t));
+	b->ast->kids.size += nb;
+	node = arr_item(&b->ast->nodes, n);
+	node->nb_kids += nb;
+	return nb; }
+
+
+/* put_raw • copies input directly into the output */
+static void
+put_raw(struct buf *ob, struct render *rndr, char *data, size_t size) {
+	if (!size) return;
+	if (rndr->ast)
+		ast_span(rndr->ast, ast_node(ob, rndr->ast, AST_RAW, 0),
+							data, size, 0);
+	else bufput(ob, data, size); }
+
+
+/* trim_last • drops the last char of the output when it is c */
+static void
+trim_last(struct buf *ob, struct render *rndr, char c) {
+	if (rndr->ast) ast_node(ob, rndr->ast, AST_TRIM, c);
+	else if (ob->size && ob->data[ob->size - 1] == c) ob->size -= 1; }
+
+
 
 /****************************
  * INLINE PARSING FUNCTIONS *
@@ -281,17 +1113,40 @@ tag_length(char *data, size_t size, enum mkd_autolink *autolink) {
 	return i + 1; }
 
 
-/* parse_inline • parses inline markdown elements */
-static void
-parse_inline(struct buf *ob, struct render *rndr, char *data, size_t size) {
-	size_t i = 0, end = 0;
+/* open_span • pushes an inline span, parsed before its parent goes on */
+/*	returns 0 when the stack cannot grow */
+static int
+open_span(struct render *rndr, enum span_step step, struct buf *ob,
+			char *data, size_t size, size_t skip, char c) {
+	struct inline_span *sp;
+
+	sp = arr_item(&rndr->spans, arr_newitem(&rndr->spans));
+	if (!sp) return 0;
+	sp->step = step;
+	sp->ob = ob;
+	sp->data = data;
+	sp->size = size;
+	sp->i = sp->end = 0;
+	sp->skip = skip;
+	sp->c = c;
+	if (rndr->work.size - rndr->lazy_top + rndr->lazy_depth
+					> rndr->make.max_work_stack) {
+		put_raw(ob, rndr, data, size);
+		sp->i = size; }
+	return 1; }
+
+
+/* run_span • parses the span n until its end or until a child is opened */
+/*	returns whether a child span has been opened */
+static int
+run_span(struct render *rndr, int n) {
+	struct inline_span *sp = arr_item(&rndr->spans, n);
+	struct buf *ob = sp->ob;
+	char *data = sp->data;
+	size_t i = sp->i, end = sp->end, size = sp->size, ret;
 	char_trigger action = 0;
 	struct buf work = { 0, 0, 0, 0, 0 };
 
-	if (rndr->work.size > rndr->make.max_work_stack) {
-		if (size) bufput(ob, data, size);
-		return; }
-
 	while (i < size) {
 		/* copying inactive chars into the output */
 		while (end < size
@@ -307,12 +1162,108 @@ parse_inline(struct buf *ob, struct render *rndr, char *data, size_t size) {
 		i = end;
 
 		/* calling the trigger */
-		end = action(ob, rndr, data + i, i, size - i);
-		if (!end) /* no action from the callback */
+		ret = action(ob, rndr, data + i, i, size - i);
+		if (rndr->spans.size > n + 1) {
+			sp = arr_item(&rndr->spans, n);
+			sp->i = i;
+			return 1; }
+		if (!ret) /* no action from the callback */
 			end = i + 1;
 		else {
-			i += end;
-			end = i; } } }
+			i += ret;
+			end = i; } }
+	return 0; }
+
+
+/* close_span • renders a parsed span into the output of its parent */
+/*	returns the size of the construct in the parent, 0 when refused */
+static size_t
+close_span(struct render *rndr, struct inline_span *sp, struct buf *ob) {
+	struct buf *link, *title;
+	int r = 0;
+
+	switch (sp->step) {
+	    case SPAN_TEXT:
+		return 0;
+	    case SPAN_EMPH1:
+		r = rndr->make.emphasis(ob, sp->ob, sp->c, rndr->make.opaque);
+		break;
+	    case SPAN_EMPH2:
+		r = rndr->make.double_emphasis(ob, sp->ob, sp->c,
+							rndr->make.opaque);
+		break;
+	    case SPAN_EMPH3:
+		r = rndr->make.triple_emphasis(ob, sp->ob, sp->c,
+							rndr->make.opaque);
+		break;
+	    case SPAN_LINK:
+		/* link and title are the working buffers above the content */
+		title = rndr->work.item[rndr->work.size - 1];
+		link = rndr->work.item[rndr->work.size - 2];
+		r = rndr->make.link(ob, link, title, sp->ob,
+							rndr->make.opaque);
+		release_work_buffer(rndr, title);
+		release_work_buffer(rndr, link);
+		break; }
+	release_work_buffer(rndr, sp->ob);
+	return r ? sp->skip : 0; }
+
+
+/* parse_inline • parses inline markdown elements */
+/*	nested spans (emphasis, link content) are stacked in rndr->spans
+ *	instead of recursing, so the C stack depth does not depend on input */
+static void
+parse_inline(struct buf *ob, struct render *rndr, char *data, size_t size) {
+	int base = rndr->spans.size, n;
+	struct inline_span *sp, *parent;
+	size_t ret;
+
+	if (!open_span(rndr, SPAN_TEXT, ob, data, size, 0, 0)) {
+		put_raw(ob, rndr, data, size);
+		return; }
+
+	while ((n = rndr->spans.size - 1) >= base) {
+		if (run_span(rndr, n)) continue;
+		if (n == base) break;
+		sp = arr_item(&rndr->spans, n);
+		parent = arr_item(&rndr->spans, n - 1);
+		ret = close_span(rndr, sp, parent->ob);
+		rndr->spans.size -= 1;
+
+		/* resuming the parent after the trigger */
+		if (!ret) parent->end = parent->i + 1;
+		else {
+			parent->i += ret;
+			parent->end = parent->i; } }
+	rndr->spans.size = base; }
+
+
+/* keep_lazy_span • records the depth a raw span is handed out at */
+/*	so that mkd_lazy_inline keeps the spans past max_work_stack raw, as
+ *	parse_inline would have at this point, even once the render is done */
+static void
+keep_lazy_span(struct render *rndr, const char *data, size_t size) {
+	struct lazy_span *ls;
+
+	ls = arr_item(&rndr->lazy_spans, arr_newitem(&rndr->lazy_spans));
+	if (!ls) return;
+	ls->data = (uintptr_t)data;
+	ls->size = size;
+	ls->depth = rndr->work.size; }
+
+
+/* block_span • inline contents of a block, parsed into work */
+/*	in lazy mode, the raw text is handed through view instead */
+static struct buf *
+block_span(struct buf *work, struct buf *view, struct render *rndr,
+				char *data, size_t size) {
+	if (rndr->lazy) {
+		keep_lazy_span(rndr, data, size);
+		view->data = data;
+		view->size = size;
+		return view; }
+	parse_inline(work, rndr, data, size);
+	return work; }
 
 
 /* find_emph_char • looks for the next emph char, skipping other constructs */
@@ -379,12 +1330,11 @@ find_emph_char(char *data, size_t size, char c) {
 
 /* parse_emph1 • parsing single emphasis */
 /* closed by a symbol not preceded by whitespace and not followed by symbol */
-static size_t
-parse_emph1(struct buf *ob, struct render *rndr,
-			char *data, size_t size, char c) {
+/*	data is one char after the trigger, the content is opened as a span */
+static int
+parse_emph1(struct render *rndr, char *data, size_t size, char c) {
 	size_t i = 0, len;
 	struct buf *work = 0;
-	int r;
 
 	if (!rndr->make.emphasis) return 0;
 
@@ -403,20 +1353,20 @@ parse_emph1(struct buf *ob, struct render *rndr,
 		if (data[i] == c && data[i - 1] != ' '
 		&& data[i - 1] != '\t' && data[i - 1] != '\n') {
 			work = new_work_buffer(rndr);
-			parse_inline(work, rndr, data, i);
-			r = rndr->make.emphasis(ob, work, c, rndr->make.opaque);
+			if (open_span(rndr, SPAN_EMPH1, work,
+						data, i, i + 2, c))
+				return 1;
 			release_work_buffer(rndr, work);
-			return r ? i + 1 : 0; } }
+			return 0; } }
 	return 0; }
 
 
 /* parse_emph2 • parsing single emphasis */
-static size_t
-parse_emph2(struct buf *ob, struct render *rndr,
-			char *data, size_t size, char c) {
+/*	data is two chars after the trigger, the content is opened as a span */
+static int
+parse_emph2(struct render *rndr, char *data, size_t size, char c) {
 	size_t i = 0, len;
 	struct buf *work = 0;
-	int r;
 
 	if (!rndr->make.double_emphasis) return 0;
 
@@ -428,22 +1378,21 @@ parse_emph2(struct buf *ob, struct render *rndr,
 		&& i && data[i - 1] != ' '
 		&& data[i - 1] != '\t' && data[i - 1] != '\n') {
 			work = new_work_buffer(rndr);
-			parse_inline(work, rndr, data, i);
-			r = rndr->make.double_emphasis(ob, work, c,
-				rndr->make.opaque);
+			if (open_span(rndr, SPAN_EMPH2, work,
+						data, i, i + 4, c))
+				return 1;
 			release_work_buffer(rndr, work);
-			return r ? i + 2 : 0; }
+			return 0; }
 		i += 1; }
 	return 0; }
 
 
 /* parse_emph3 • parsing single emphasis */
 /* finds the first closing tag, and delegates to the other emph */
-static size_t
-parse_emph3(struct buf *ob, struct render *rndr,
-			char *data, size_t size, char c) {
+/*	data is three chars after the trigger */
+static int
+parse_emph3(struct render *rndr, char *data, size_t size, char c) {
 	size_t i = 0, len;
-	int r;
 
 	while (i < size) {
 		len = find_emph_char(data + i, size - i, c);
@@ -459,46 +1408,36 @@ parse_emph3(struct buf *ob, struct render *rndr,
 		&& rndr->make.triple_emphasis) {
 			/* triple symbol found */
 			struct buf *work = new_work_buffer(rndr);
-			parse_inline(work, rndr, data, i);
-			r = rndr->make.triple_emphasis(ob, work, c,
-							rndr->make.opaque);
+			if (open_span(rndr, SPAN_EMPH3, work,
+						data, i, i + 6, c))
+				return 1;
 			release_work_buffer(rndr, work);
-			return r ? i + 3 : 0; }
-		else if (i + 1 < size && data[i + 1] == c) {
+			return 0; }
+		else if (i + 1 < size && data[i + 1] == c)
 			/* double symbol found, handing over to emph1 */
-			len = parse_emph1(ob, rndr, data - 2, size + 2, c);
-			if (!len) return 0;
-			else return len - 2; }
-		else {
+			return parse_emph1(rndr, data - 2, size + 2, c);
+		else
 			/* single symbol found, handing over to emph2 */
-			len = parse_emph2(ob, rndr, data - 1, size + 1, c);
-			if (!len) return 0;
-			else return len - 1; } }
+			return parse_emph2(rndr, data - 1, size + 1, c); }
 	return 0; }
 
 
 /* char_emphasis • single and double emphasis parsing */
+/*	the emphasis is rendered when its span is closed, see parse_inline */
 static size_t
 char_emphasis(struct buf *ob, struct render *rndr,
 				char *data, size_t offset, size_t size) {
 	char c = data[0];
-	size_t ret;
 	if (size > 2 && data[1] != c) {
 		/* whitespace cannot follow an opening emphasis */
-		if (data[1] == ' ' || data[1] == '\t' || data[1] == '\n'
-		|| (ret = parse_emph1(ob, rndr, data + 1, size - 1, c)) == 0)
-			return 0;
-		return ret + 1; }
-	if (size > 3 && data[1] == c && data[2] != c) {
-		if (data[2] == ' ' || data[2] == '\t' || data[2] == '\n'
-		|| (ret = parse_emph2(ob, rndr, data + 2, size - 2, c)) == 0)
-			return 0;
-		return ret + 2; }
-	if (size > 4 && data[1] == c && data[2] == c && data[3] != c) {
-		if (data[3] == ' ' || data[3] == '\t' || data[3] == '\n'
-		|| (ret = parse_emph3(ob, rndr, data + 3, size - 3, c)) == 0)
-			return 0;
-		return ret + 3; }
+		if (data[1] != ' ' && data[1] != '\t' && data[1] != '\n')
+			parse_emph1(rndr, data + 1, size - 1, c); }
+	else if (size > 3 && data[1] == c && data[2] != c) {
+		if (data[2] != ' ' && data[2] != '\t' && data[2] != '\n')
+			parse_emph2(rndr, data + 2, size - 2, c); }
+	else if (size > 4 && data[1] == c && data[2] == c && data[3] != c) {
+		if (data[3] != ' ' && data[3] != '\t' && data[3] != '\n')
+			parse_emph3(rndr, data + 3, size - 3, c); }
 	return 0; }
 
 
@@ -508,7 +1447,7 @@ char_linebreak(struct buf *ob, struct render *rndr,
 				char *data, size_t offset, size_t size) {
 	if (offset < 2 || data[-1] != ' ' || data[-2] != ' ') return 0;
 	/* removing the last space from ob and rendering */
-	if (ob->size && ob->data[ob->size - 1] == ' ') ob->size -= 1;
+	trim_last(ob, rndr, ' ');
 	return rndr->make.linebreak(ob, rndr->make.opaque) ? 1 : 0; }
 
 
@@ -673,26 +1612,79 @@ get_link_inline(struct buf *link, struct buf *title, char *data, size_t size) {
 	return 0; }
 
 
+/* find_link_ref • looks up a raw ref id in the reference hash table */
+static const struct link_ref *
+find_link_ref(const struct ref_table *refs, const char *data, size_t size) {
+	const struct link_ref *lr = refs->refs.base;
+	uint32_t h;
+	size_t i;
+	int n;
+
+	size = trim_ref_id(&data, size);
+	if (!size || !refs->slot) return 0;
+	h = hash_ref_id(data, size);
+	for (i = h & refs->mask; (n = refs->slot[i]) != 0;
+					i = (i + 1) & refs->mask)
+		if (lr[n - 1].hash == h
+		&& match_ref_id(refs->pool->data + lr[n - 1].id,
+					lr[n - 1].id_size, data, size))
+			return lr + n - 1;
+	return 0; }
+
+
+/* note_ref_miss • records a link id not defined so far in the document */
+static void
+note_ref_miss(struct backpatch *patch, const char *data, size_t size) {
+	struct ref_miss *miss;
+	miss = arr_item(&patch->misses, arr_newitem(&patch->misses));
+	if (!miss) return;
+	miss->id = patch->pool->size;
+	miss->size = size;
+	bufput(patch->pool, data, size); }
+
+
+/* note_ref_use • records how an id was resolved, see same_ref_uses */
+/*	as the size of the id and the id, then the size and data of the
+ *	link and of the title, or SIZE_MAX when undefined */
+static void
+note_ref_use(struct buf *uses, const char *data, size_t size,
+			const struct link_ref *lr, const char *pool) {
+	size_t none = SIZE_MAX;
+
+	bufput(uses, &size, sizeof size);
+	bufput(uses, data, size);
+	if (!lr) {
+		bufput(uses, &none, sizeof none);
+		return; }
+	bufput(uses, &lr->link_size, sizeof lr->link_size);
+	bufput(uses, pool + lr->link, lr->link_size);
+	bufput(uses, &lr->title_size, sizeof lr->title_size);
+	bufput(uses, pool + lr->title, lr->title_size); }
+
+
 /* get_link_ref • extract referenced link and title from id */
 static int
 get_link_ref(struct render *rndr, struct buf *link, struct buf *title,
 				char * data, size_t size) {
-	struct link_ref *lr;
-
-	/* find the link from its id (stored temporarily in link) */
-	link->size = 0;
-	if (build_ref_id(link, data, size) < 0)
-		return -1;
-	lr = arr_sorted_find(&rndr->refs, link, cmp_link_ref);
+	const struct ref_table *refs = &rndr->refs;
+	const struct link_ref *lr;
+	const char *pool;
+
+	/* find the link from its id, in the document then in the dictionary */
+	lr = find_link_ref(refs, data, size);
+	if (!lr && rndr->patch) note_ref_miss(rndr->patch, data, size);
+	if (!lr && rndr->make.refdict) {
+		refs = &rndr->make.refdict->refs;
+		lr = find_link_ref(refs, data, size); }
+	pool = lr ? refs->pool->data : 0;
+	if (rndr->uses) note_ref_use(rndr->uses, data, size, lr, pool);
 	if (!lr) return -1;
 
 	/* fill the output buffers */
 	link->size = 0;
-	if (lr->link)
-		bufput(link, lr->link->data, lr->link->size);
+	bufput(link, pool + lr->link, lr->link_size);
 	title->size = 0;
-	if (lr->title)
-		bufput(title, lr->title->data, lr->title->size);
+	bufput(title, pool + lr->title, lr->title_size);
 	return 0; }
 
 
@@ -782,13 +1774,17 @@ char_link(struct buf *ob, struct render *rndr,
 		i = txt_e + 1; }
 
 	/* building content: img alt is escaped, link content is parsed */
+	/* as a span, the link being rendered when it is closed */
 	if (txt_e > 1) {
 		if (is_img) bufput(content, data + 1, txt_e - 1);
-		else parse_inline(content, rndr, data + 1, txt_e - 1); }
+		else if (open_span(rndr, SPAN_LINK, content,
+						data + 1, txt_e - 1, i, 0))
+			return 0;
+		else goto char_link_cleanup; }
 
 	/* calling the relevant rendering function */
 	if (is_img) {
-		if (ob->size && ob->data[ob->size - 1] == '!') ob->size -= 1;
+		trim_last(ob, rndr, '!');
 		ret = rndr->make.image(ob, link, title, content,
 							rndr->make.opaque); }
 	else ret = rndr->make.link(ob, link, title, content, rndr->make.opaque);
@@ -953,19 +1949,67 @@ prefix_uli(char *data, size_t size) {
 	return i; }
 
 
-/* parse_block • parsing of one block, returning next char to parse */
-static void parse_block(struct buf *ob, struct render *rndr,
-			char *data, size_t size);
+/* reserve_tasks • makes room for nb more block tasks */
+/*	once room is made, pushing does not move the existing tasks */
+static int
+reserve_tasks(struct render *rndr, int nb) {
+	return arr_grow(&rndr->blocks, rndr->blocks.size + nb); }
+
+
+/* push_task • pushes a block task, room being reserved by the caller */
+static struct block_task *
+push_task(struct render *rndr, enum block_step step, struct buf *ob) {
+	struct block_task *t;
+
+	t = arr_item(&rndr->blocks, arr_newitem(&rndr->blocks));
+	assert(t);
+	t->step = step;
+	t->ob = ob;
+	t->data = 0;
+	t->size = t->beg = t->nb = 0;
+	t->base = rndr->work.size;
+	t->level = 0;
+	t->flags = 0;
+	return t; }
+
+
+/* push_blocks • pushes the parsing of a sequence of blocks */
+static void
+push_blocks(struct render *rndr, struct buf *ob, char *data, size_t size,
+							int single) {
+	struct block_task *t = push_task(rndr, STEP_BLOCKS, ob);
+	t->data = data;
+	t->size = size;
+	t->flags = single; }
+
+
+/* drop_quote_cut • takes a line out of the lines checked for cuts */
+static void
+drop_quote_cut(size_t *cuts, const struct quote_line *ql, size_t level,
+							size_t *below) {
+	if (ql->cut == SIZE_MAX) return;
+	cuts[ql->cut] -= 1;
+	if (ql->cut <= level) *below -= 1; }
 
 
 /* parse_blockquote • handles parsing of a blockquote fragment */
+/*	directly nested blockquotes are handled here in a single descent:
+ *	the quote depth of each line is computed once, and a level is a
+ *	single nested blockquote as long as no line in [first, last - 1) is
+ *	an empty line followed by a non-quote line, which is tracked by
+ *	counting the lines by the level where they become so */
+/*	the content is pushed as block tasks, with room for two tasks */
 static size_t
 parse_blockquote(struct buf *ob, struct render *rndr,
 			char *data, size_t size) {
-	size_t beg, end = 0, pre, work_size = 0;
+	size_t beg, end = 0, pre, work_size = 0, max_depth = 0, below;
+	size_t first, last, i, base, level, rel, p, nb, *cuts;
 	char *work_data = 0;
-	struct buf *out = new_work_buffer(rndr);
+	struct quote_line *ql;
+	struct block_task *t;
 
+	/* splitting the outer blockquote into lines */
+	rndr->quote_lines.size = 0;
 	beg = 0;
 	while (beg < size) {
 		for (end = beg + 1; end < size && data[end - 1] != '\n';
@@ -977,23 +2021,111 @@ parse_blockquote(struct buf *ob, struct render *rndr,
 					&& !is_empty(data + end, size - end))))
 			/* empty line followed by non-quote line */
 			break;
-		if (beg < end) { /* copy into the in-place working buffer */
-			/* bufput(work, data + beg, end - beg); */
-			if (!work_data)
-				work_data = data + beg;
-			else if (data + beg != work_data + work_size)
-				memmove(work_data + work_size, data + beg,
-						end - beg);
-			work_size += end - beg; }
+		if (beg < end) {
+			ql = arr_item(&rndr->quote_lines,
+					arr_newitem(&rndr->quote_lines));
+			if (ql) {
+				ql->beg = beg;
+				ql->end = end;
+				ql->depth = 0;
+				for (p = beg; (pre = prefix_quote(data + p,
+							end - p)) != 0; p += pre)
+					ql->depth += 1;
+				ql->blank = is_empty(data + p, end - p) != 0;
+				ql->bare = p >= end;
+				if (ql->depth > max_depth)
+					max_depth = ql->depth; } }
 		beg = end; }
 
-	parse_block(out, rndr, work_data, work_size);
-	if (rndr->make.blockquote)
-		rndr->make.blockquote(ob, out, rndr->make.opaque);
-	release_work_buffer(rndr, out);
+	/* counting the lines by cut level */
+	ql = rndr->quote_lines.base;
+	nb = rndr->quote_lines.size;
+	rndr->quote_cuts.size = 0;
+	cuts = max_depth < INT_MAX
+	    && arr_grow(&rndr->quote_cuts, max_depth + 1)
+				? rndr->quote_cuts.base : 0;
+	if (!cuts) max_depth = 0;
+	for (i = 0; i <= max_depth && cuts; i += 1)
+		cuts[i] = 0;
+	for (i = 0; i < nb; i += 1) {
+		ql[i].cut = SIZE_MAX;
+		if (cuts && i + 1 < nb && ql[i].blank && !ql[i + 1].blank) {
+			ql[i].cut = ql[i].depth > ql[i + 1].depth
+					? ql[i].depth : ql[i + 1].depth;
+			cuts[ql[i].cut] += 1; } }
+
+	/* going down nested levels while they make up the whole content */
+	first = 0;
+	last = nb;
+	base = rndr->work.size;
+	new_work_buffer(rndr);
+	level = 1;
+	rel = 0;
+	below = cuts ? cuts[0] : 0;
+	while (cuts && rndr->work.size <= rndr->make.max_work_stack) {
+		/* lines empty at this level are skipped */
+		while (first < last && ql[first].depth <= rel
+		&& ql[first].blank) {
+			if (first + 2 <= last)
+				drop_quote_cut(cuts, ql + first, rel, &below);
+			first += 1; }
+		if (first >= last || ql[first].depth <= rel || below > 0)
+			break;
+
+		/* a final empty line is left out of the nested level */
+		if (ql[last - 1].depth <= rel && ql[last - 1].blank) {
+			if (last >= first + 2)
+				drop_quote_cut(cuts, ql + last - 2, rel, &below);
+			last -= 1; }
+		rel += 1;
+		below += cuts[rel];
+		if (last > first && ql[last - 1].depth == rel
+		&& ql[last - 1].bare) {
+			if (last >= first + 2)
+				drop_quote_cut(cuts, ql + last - 2, rel, &below);
+			last -= 1; }
+		new_work_buffer(rndr);
+		level += 1; }
+
+	/* copy of the innermost content into the in-place working buffer */
+	for (i = first; i < last; i += 1) {
+		beg = ql[i].beg;
+		for (p = 0; p < rel && p < ql[i].depth; p += 1)
+			beg += prefix_quote(data + beg, ql[i].end - beg);
+		if (!work_data)
+			work_data = data + beg;
+		else if (data + beg != work_data + work_size)
+			memmove(work_data + work_size, data + beg,
+						ql[i].end - beg);
+		work_size += ql[i].end - beg; }
+
+	/* parsing of the innermost content, before the render below */
+	t = push_task(rndr, STEP_QUOTE, ob);
+	t->base = base;
+	t->level = level;
+	push_blocks(rndr, rndr->work.item[base + level - 1],
+						work_data, work_size, 0);
 	return end; }
 
 
+/* close_blockquote • renders nested blockquotes, once the content is parsed */
+static void
+close_blockquote(struct buf *ob, struct render *rndr,
+				size_t base, size_t level) {
+	/* rendering from the innermost level outwards */
+	while (level > 1) {
+		level -= 1;
+		if (rndr->make.blockquote)
+			rndr->make.blockquote(rndr->work.item[base + level - 1],
+				rndr->work.item[base + level],
+				rndr->make.opaque);
+		release_work_buffer(rndr, rndr->work.item[base + level]); }
+	if (rndr->make.blockquote)
+		rndr->make.blockquote(ob, rndr->work.item[base],
+						rndr->make.opaque);
+	release_work_buffer(rndr, rndr->work.item[base]); }
+
+
 /* parse_paragraph • handles parsing of a regular paragraph */
 static size_t
 parse_paragraph(struct buf *ob, struct render *rndr,
@@ -1001,6 +2133,7 @@ parse_paragraph(struct buf *ob, struct render *rndr,
 	size_t i = 0, end = 0;
 	int level = 0;
 	struct buf work = { data, 0, 0, 0, 0 }; /* volatile working buffer */
+	struct buf view = { 0, 0, 0, 0, 0 }, *span;
 
 	while (i < size) {
 		for (end = i + 1; end < size && data[end - 1] != '\n';
@@ -1019,9 +2152,9 @@ parse_paragraph(struct buf *ob, struct render *rndr,
 		work.size -= 1;
 	if (!level) {
 		struct buf *tmp = new_work_buffer(rndr);
-		parse_inline(tmp, rndr, work.data, work.size);
+		span = block_span(tmp, &view, rndr, work.data, work.size);
 		if (rndr->make.paragraph)
-			rndr->make.paragraph(ob, tmp, rndr->make.opaque);
+			rndr->make.paragraph(ob, span, rndr->make.opaque);
 		release_work_buffer(rndr, tmp); }
 	else {
 		if (work.size) {
@@ -1035,29 +2168,86 @@ parse_paragraph(struct buf *ob, struct render *rndr,
 				work.size -= 1;
 			if (work.size) {
 				struct buf *tmp = new_work_buffer(rndr);
-				parse_inline(tmp, rndr, work.data, work.size);
+				span = block_span(tmp, &view, rndr,
+						work.data, work.size);
 				if (rndr->make.paragraph)
-					rndr->make.paragraph(ob, tmp,
+					rndr->make.paragraph(ob, span,
 							rndr->make.opaque);
 				release_work_buffer(rndr, tmp);
 				work.data += beg;
 				work.size = i - beg; }
 			else work.size = i; }
 		if (rndr->make.header) {
-			struct buf *span = new_work_buffer(rndr);
-			parse_inline(span, rndr, work.data, work.size);
+			struct buf *tmp = new_work_buffer(rndr);
+			span = block_span(tmp, &view, rndr,
+						work.data, work.size);
 			rndr->make.header(ob, span, level,rndr->make.opaque);
-			release_work_buffer(rndr, span); } }
+			release_work_buffer(rndr, tmp); } }
 	return end; }
 
 
+/* parse_blockcode_lines • block-level code fragment as a list of spans */
+/*	the concatenation of the spans is the text given to blockcode */
+static size_t
+parse_blockcode_lines(struct buf *ob, struct render *rndr,
+			char *data, size_t size) {
+	static char newline[] = "\n";
+	struct array *lines = &rndr->code_lines;
+	struct buf *line;
+	size_t beg, end, pre;
+	int last = 0;
+
+	lines->size = 0;
+	beg = 0;
+	while (beg < size) {
+		for (end = beg + 1; end < size && data[end - 1] != '\n';
+							end += 1);
+		pre = prefix_code(data + beg, end - beg);
+		if (pre) beg += pre; /* skipping prefix */
+		else if (!is_empty(data + beg, end - beg))
+			/* non-empty non-prefixed line breaks the pre */
+			break;
+		if (beg < end
+		&& (line = arr_item(lines, arr_newitem(lines))) != 0) {
+			line->asize = line->unit = 0;
+			line->ref = 0;
+			if (is_empty(data + beg, end - beg)) {
+				line->data = newline;
+				line->size = 1; }
+			else {
+				line->data = data + beg;
+				line->size = end - beg;
+				last = lines->size; } }
+		beg = end; }
+
+	/* trailing empty lines are dropped, and the last one terminated */
+	lines->size = last;
+	line = arr_item(lines, last - 1);
+	while (line && line->size && line->data[line->size - 1] == '\n')
+		line->size -= 1;
+	line = arr_item(lines, arr_newitem(lines));
+	if (line) {
+		line->data = newline;
+		line->size = 1;
+		line->asize = line->unit = 0;
+		line->ref = 0; }
+
+	rndr->make.blockcode_lines(ob, lines->base, lines->size,
+						rndr->make.opaque);
+	return beg; }
+
+
 /* parse_blockcode • handles parsing of a block-level code fragment */
 static size_t
 parse_blockcode(struct buf *ob, struct render *rndr,
 			char *data, size_t size) {
 	size_t beg, end, pre;
-	struct buf *work = new_work_buffer(rndr);
+	struct buf *work;
+
+	if (rndr->make.blockcode_lines)
+		return parse_blockcode_lines(ob, rndr, data, size);
 
+	work = new_work_buffer(rndr);
 	beg = 0;
 	while (beg < size) {
 		for (end = beg + 1; end < size && data[end - 1] != '\n';
@@ -1084,12 +2274,12 @@ parse_blockcode(struct buf *ob, struct render *rndr,
 	return beg; }
 
 
-/* parse_listitem • parsing of a single list item */
-/*	assuming initial prefix is already removed */
+/* scan_listitem • finds the extent of a list item and copies its contents */
+/*	the lines are put into work without their prefix, *sublist is the
+ *	offset of the first sublist in work, if any; returns the item size */
 static size_t
-parse_listitem(struct buf *ob, struct render *rndr,
-			char *data, size_t size, int *flags) {
-	struct buf *work = 0, *inter = 0;
+scan_listitem(struct buf *work, char *data, size_t size, int *flags,
+							size_t *psublist) {
 	size_t beg = 0, end, pre, sublist = 0, orgpre = 0, i;
 	int in_empty = 0, has_inside_empty = 0;
 
@@ -1104,10 +2294,6 @@ parse_listitem(struct buf *ob, struct render *rndr,
 	end = beg;
 	while (end < size && data[end - 1] != '\n') end += 1;
 
-	/* getting working buffers */
-	work = new_work_buffer(rndr);
-	inter = new_work_buffer(rndr);
-
 	/* putting the first line into the working buffer */
 	bufput(work, data + beg, end - beg);
 	beg = end;
@@ -1155,49 +2341,89 @@ parse_listitem(struct buf *ob, struct render *rndr,
 		bufput(work, data + beg + i, end - beg - i);
 		beg = end; }
 
-	/* render of li contents */
 	if (has_inside_empty) *flags |= MKD_LI_BLOCK;
+	*psublist = sublist;
+	return beg; }
+
+
+/* keep_item_text • copy of an item text kept until the render is released */
+/*	lazy spans may be parsed after the working buffers are reused;
+ *	returns text itself when out of memory */
+static struct buf *
+keep_item_text(struct render *rndr, struct buf *text) {
+	struct buf *kept = bufnew(TEXT_UNIT);
+	if (!kept) return text;
+	bufput(kept, text->data, text->size);
+	if (kept->size < text->size || !parr_push(&rndr->lazy_items, kept)) {
+		bufrelease(kept);
+		return text; }
+	return kept; }
+
+
+/* parse_listitem • parsing of a single list item */
+/*	assuming initial prefix is already removed */
+/*	block contents are pushed as block tasks, with room for three tasks */
+static size_t
+parse_listitem(struct buf *ob, struct render *rndr,
+			char *data, size_t size, int *flags) {
+	struct buf *work, *inter;
+	size_t beg, sublist;
+	struct block_task *t;
+
+	/* getting working buffers */
+	work = new_work_buffer(rndr);
+	inter = new_work_buffer(rndr);
+	beg = scan_listitem(work, data, size, flags, &sublist);
+	if (!beg) {
+		release_work_buffer(rndr, inter);
+		release_work_buffer(rndr, work);
+		return 0; }
+	if (rndr->lazy) work = keep_item_text(rndr, work);
+
+	/* render of li itself, once its contents are parsed */
+	t = push_task(rndr, STEP_ITEM, ob);
+	t->base = rndr->work.size - 2;
+	t->level = 2;
+	t->flags = *flags;
+
+	/* render of li contents, pushing the last blocks first */
 	if (*flags & MKD_LI_BLOCK) {
 		/* intermediate render of block li */
 		if (sublist && sublist < work->size) {
-			parse_block(inter, rndr, work->data, sublist);
-			parse_block(inter, rndr, work->data + sublist,
-						work->size - sublist); }
+			push_blocks(rndr, inter, work->data + sublist,
+						work->size - sublist, 0);
+			push_blocks(rndr, inter, work->data, sublist, 0); }
 		else
-			parse_block(inter, rndr, work->data, work->size); }
+			push_blocks(rndr, inter, work->data, work->size, 0); }
 	else {
 		/* intermediate render of inline li */
 		if (sublist && sublist < work->size) {
 			parse_inline(inter, rndr, work->data, sublist);
-			parse_block(inter, rndr, work->data + sublist,
-						work->size - sublist); }
+			push_blocks(rndr, inter, work->data + sublist,
+						work->size - sublist, 0); }
+		else if (rndr->lazy) {
+			keep_lazy_span(rndr, work->data, work->size);
+			t->data = work->data;
+			t->size = work->size;
+			t->flags |= MKD_LI_RAW; }
 		else
 			parse_inline(inter, rndr, work->data, work->size); }
-
-	/* render of li itself */
-	if (rndr->make.listitem)
-		rndr->make.listitem(ob, inter, *flags, rndr->make.opaque);
-	release_work_buffer(rndr, inter);
-	release_work_buffer(rndr, work);
 	return beg; }
 
 
 /* parse_list • parsing ordered or unordered list block */
+/*	the items are parsed by run_blocks, which accounts for the list size
+ *	once the last one is found, so 0 is returned here */
 static size_t
 parse_list(struct buf *ob, struct render *rndr,
 			char *data, size_t size, int flags) {
-	struct buf *work = new_work_buffer(rndr);
-	size_t i = 0, j;
-
-	while (i < size) {
-		j = parse_listitem(work, rndr, data + i, size - i, &flags);
-		i += j;
-		if (!j || (flags & MKD_LI_END)) break; }
-
-	if (rndr->make.list)
-		rndr->make.list(ob, work, flags, rndr->make.opaque);
-	release_work_buffer(rndr, work);
-	return i; }
+	struct block_task *t = push_task(rndr, STEP_LIST, ob);
+	t->data = data;
+	t->size = size;
+	t->level = 1;
+	t->flags = flags;
+	new_work_buffer(rndr);
+	return 0; }
 
 
 /* parse_atxheader • parsing of atx-style headers */
@@ -1225,24 +2451,26 @@ parse_atxheader(struct buf *ob, struct render *rndr,
 
 	span_size = end - span_beg;
 	if (rndr->make.header) {
-		struct buf *span = new_work_buffer(rndr);
-		parse_inline(span, rndr, data + span_beg, span_size);
-		rndr->make.header(ob, span, level, rndr->make.opaque);
-		release_work_buffer(rndr, span); }
+		struct buf view = { 0, 0, 0, 0, 0 };
+		struct buf *tmp = new_work_buffer(rndr);
+		rndr->make.header(ob, block_span(tmp, &view, rndr,
+					data + span_beg, span_size),
+					level, rndr->make.opaque);
+		release_work_buffer(rndr, tmp); }
 	return skip; }
 
 
 /* htmlblock_end • checking end of HTML block : </tag>[ \t]*\n[ \t*]\n */
 /*	returns the length on match, 0 otherwise */
 static size_t
-htmlblock_end(struct html_tag *tag, char *data, size_t size) {
+htmlblock_end(const struct html_tag *tag, char *data, size_t size) {
 	size_t i, w;
 
 	/* assuming data[0] == '<' && data[1] == '/' already tested */
 
 	/* checking tag is a match */
 	if (tag->size + 3 >= size
-	|| strncasecmp(data + 2, tag->text, tag->size)
+	|| !is_tag_name(tag, data + 2, size - 2)
 	|| data[tag->size + 2] != '>')
 		return 0;
 
@@ -1258,25 +2486,25 @@ htmlblock_end(struct html_tag *tag, char *data, size_t size) {
 	return i + w; }
 
 
-/* parse_htmlblock • parsing of inline HTML block */
+/* htmlblock_size • size of the inline HTML block at data, or 0 */
+/*	the end of the block is only looked for from the given offset,
+ *	the data before it being known not to hold it */
 static size_t
-parse_htmlblock(struct buf *ob, struct render *rndr,
-			char *data, size_t size) {
+htmlblock_size(struct render *rndr, char *data, size_t size, size_t from) {
 	size_t i, j = 0;
-	struct html_tag *curtag;
+	const struct html_tag *curtag;
 	int found;
-	struct buf work = { data, 0, 0, 0, 0 };
 
 	/* identification of the opening tag */
 	if (size < 2 || data[0] != '<') return 0;
-	curtag = find_block_tag(data + 1, size - 1);
+	curtag = find_block_tag(rndr, data + 1, size - 1);
 
 	/* handling of special cases */
 	if (!curtag) {
 		/* HTML comment, laxist form */
 		if (size > 5 && data[1] == '!'
 		&& data[2] == '-' && data[3] == '-') {
-			i = 5;
+			i = from > 3 ? from + 2 : 5;
 			while (i < size
 			&& !(data[i - 2] == '-' && data[i - 1] == '-'
 						&& data[i] == '>'))
@@ -1284,29 +2512,19 @@ parse_htmlblock(struct buf *ob, struct render *rndr,
 			i += 1;
 			if (i < size) {
 				j = is_empty(data + i, size - i);
-				if (j) {
-					work.size = i + j;
-					if (rndr->make.blockhtml)
-						rndr->make.blockhtml(ob, &work,
-							rndr->make.opaque);
-					return work.size; } } }
+				if (j) return i + j; } }
 
 		/* HR, which is the only self-closing block tag considered */
 		if (size > 4
 		&& (data[1] == 'h' || data[1] == 'H')
 		&& (data[2] == 'r' || data[2] == 'R')) {
-			i = 3;
+			i = from > 3 ? from : 3;
 			while (i < size && data[i] != '>')
 				i += 1;
 			if (i + 1 < size) {
 				i += 1;
 				j = is_empty(data + i, size - i);
-				if (j) {
-					work.size = i + j;
-					if (rndr->make.blockhtml)
-						rndr->make.blockhtml(ob, &work,
-							rndr->make.opaque);
-					return work.size; } } }
+				if (j) return i + j; } }
 
 		/* no special case recognised */
 		return 0; }
@@ -1332,7 +2550,7 @@ parse_htmlblock(struct buf *ob, struct render *rndr,
 	/* if not found, trying a second pass looking for indented match */
 	/* but not if tag is "ins" or "del" (following original Markdown.pl) */
 	if (!found && curtag != INS_TAG && curtag != DEL_TAG) {
-		i = 1;
+		i = from > 1 ? from : 1;
 		while (i < size) {
 			i += 1;
 			while (i < size
@@ -1345,22 +2563,40 @@ parse_htmlblock(struct buf *ob, struct render *rndr,
 			found = 1;
 			break; } } }
 
-	if (!found) return 0;
+	return found ? i : 0; }
 
-	/* the end of the block has been found */
-	work.size = i;
-	if (rndr->make.blockhtml)
+
+/* parse_htmlblock • parsing of inline HTML block */
+static size_t
+parse_htmlblock(struct buf *ob, struct render *rndr,
+			char *data, size_t size) {
+	struct buf work = { data, 0, 0, 0, 0 };
+	work.size = htmlblock_size(rndr, data, size, 0);
+	if (work.size && rndr->make.blockhtml)
 		rndr->make.blockhtml(ob, &work, rndr->make.opaque);
-	return i; }
+	return work.size; }
 
 
 /* parse_table_cell • parse a cell inside a table */
+/*	when streaming, cells without active char are handed over verbatim */
 static void
 parse_table_cell(struct buf *ob, struct render *rndr, char *data, size_t size,
 				int flags) {
-	struct buf *span = new_work_buffer(rndr);
-	parse_inline(span, rndr, data, size);
-	rndr->make.table_cell(ob, span, flags, rndr->make.opaque);
+	struct buf *span, view = { 0, 0, 0, 0, 0 };
+	size_t i = 0;
+
+	if (rndr->make.table_begin && rndr->make.table_end) {
+		while (i < size && !rndr->active_char[(unsigned char)data[i]])
+			i += 1;
+		if (i >= size) {
+			struct buf work = { data, size, 0, 0, 0 };
+			rndr->make.table_cell(ob, &work, flags | MKD_CELL_RAW,
+							rndr->make.opaque);
+			return; } }
+
+	span = new_work_buffer(rndr);
+	rndr->make.table_cell(ob, block_span(span, &view, rndr, data, size),
+						flags, rndr->make.opaque);
 	release_work_buffer(rndr, span); }
 
 
@@ -1431,14 +2667,26 @@ parse_table_row(struct buf *ob, struct render *rndr, char *data, size_t size,
 	return total ? total : size; }
 
 
+/* huge lists and tables, see PARALLEL RENDERING */
+static size_t parse_rows_parallel(struct buf *ob, struct render *rndr,
+			char *data, size_t size, size_t beg, int *aligns,
+			size_t align_size);
+static void parse_items_parallel(struct render *rndr,
+			struct block_task *t);
+
+
 /* parse_table • parsing of a whole table */
+/*	when streaming, rows are rendered directly into the output */
 static size_t
 parse_table(struct buf *ob, struct render *rndr, char *data, size_t size) {
 	size_t i = 0, head_end, col;
 	size_t align_size = 0;
 	int *aligns = 0;
 	struct buf *head = 0;
-	struct buf *rows = new_work_buffer(rndr);
+	struct buf *rows = ob;
+	int stream = (rndr->make.table_begin && rndr->make.table_end);
+
+	if (!stream) rows = new_work_buffer(rndr);
 
 	/* skip the first (presumably header) line */
 	while (i < size && data[i] != '\n')
@@ -1447,6 +2695,11 @@ parse_table(struct buf *ob, struct render *rndr, char *data, size_t size) {
 
 	/* fallback on end of input */
 	if (i >= size) {
+		if (stream) {
+			rndr->make.table_begin(ob, 0, rndr->make.opaque);
+			parse_table_row(ob, rndr, data, size, 0, 0, 0);
+			rndr->make.table_end(ob, 0, rndr->make.opaque);
+			return i; }
 		parse_table_row(rows, rndr, data, size, 0, 0, 0);
 		rndr->make.table(ob, 0, rows, rndr->make.opaque);
 		release_work_buffer(rndr, rows);
@@ -1502,79 +2755,220 @@ parse_table(struct buf *ob, struct render *rndr, char *data, size_t size) {
 		i = 0; }
 
 	/* render the table body lines */
+	if (stream)
+		rndr->make.table_begin(ob, head, rndr->make.opaque);
+	if (rndr->threads > 1 && size - i >= PARALLEL_UNIT)
+		i = parse_rows_parallel(rows, rndr, data, size, i,
+						aligns, align_size);
 	while (i < size && is_tableline(data + i, size - i))
 		i += parse_table_row(rows, rndr, data + i, size - i,
 		    aligns, align_size, 0);
 
 	/* render the full table */
-	rndr->make.table(ob, head, rows, rndr->make.opaque);
+	if (stream)
+		rndr->make.table_end(ob, head, rndr->make.opaque);
+	else
+		rndr->make.table(ob, head, rows, rndr->make.opaque);
 
 	/* cleanup */
 	if (head) release_work_buffer(rndr, head);
-	release_work_buffer(rndr, rows);
+	if (!stream) release_work_buffer(rndr, rows);
 	free(aligns);
 	return i; }
 
 
-/* parse_block • parsing of one block, returning next char to parse */
-static void
-parse_block(struct buf *ob, struct render *rndr,
-			char *data, size_t size) {
-	size_t beg, end, i;
-	char *txt_data;
-	int has_table = (rndr->make.table && rndr->make.table_row
-	    && rndr->make.table_cell);
+/* find_block_probes • returns the block probes that can match the line */
+static int
+find_block_probes(char *data, size_t size) {
+	size_t i = 0;
+	int probes;
 
-	if (rndr->work.size > rndr->make.max_work_stack) {
-		if (size) bufput(ob, data, size);
-		return; }
+	/* up to 3 spaces of indentation are allowed by most blocks */
+	while (i < 3 && i < size && data[i] == ' ')
+		i += 1;
+	if (i >= size) return BLOCK_EMPTY;
+	probes = block_probe[(unsigned char)data[i]];
 
-	beg = 0;
-	while (beg < size) {
-		txt_data = data + beg;
-		end = size - beg;
-		if (data[beg] == '#')
-			beg += parse_atxheader(ob, rndr, txt_data, end);
-		else if (data[beg] == '<' && rndr->make.blockhtml
-			&& (i = parse_htmlblock(ob, rndr, txt_data, end)) != 0)
-			beg += i;
-		else if ((i = is_empty(txt_data, end)) != 0)
-			beg += i;
-		else if (is_hrule(txt_data, end)) {
-			if (rndr->make.hrule)
-				rndr->make.hrule(ob, rndr->make.opaque);
-			while (beg < size && data[beg] != '\n') beg += 1;
-			beg += 1; }
-		else if (prefix_quote(txt_data, end))
-			beg += parse_blockquote(ob, rndr, txt_data, end);
-		else if (prefix_code(txt_data, end))
-			beg += parse_blockcode(ob, rndr, txt_data, end);
-		else if (prefix_uli(txt_data, end))
-			beg += parse_list(ob, rndr, txt_data, end, 0);
-		else if (prefix_oli(txt_data, end))
-			beg += parse_list(ob, rndr, txt_data, end,
-						MKD_LIST_ORDERED);
-		else if (has_table && is_tableline(txt_data, end))
-			beg += parse_table(ob, rndr, txt_data, end);
-		else
-			beg += parse_paragraph(ob, rndr, txt_data, end); } }
+	/* header and HTML must begin the line, code needs a full indent */
+	if (i) {
+		probes &= ~(BLOCK_ATX | BLOCK_HTML);
+		if (data[i] == '\t') probes &= ~BLOCK_CODE; }
+	return probes; }
 
 
+/* has_table_sep • returns whether the line contains a pipe */
+static int
+has_table_sep(char *data, size_t size) {
+	char *eol = memchr(data, '\n', size);
+	return memchr(data, '|', eol ? (size_t)(eol - data) : size) != 0; }
 
-/*********************
- * REFERENCE PARSING *
- *********************/
 
-/* is_ref • returns whether a line is a reference or not */
+/* has_tables • whether the renderer can render tables */
 static int
-is_ref(char *data, size_t beg, size_t end, size_t *last, struct array *refs) {
-	size_t i = 0;
-	size_t id_offset, id_end;
+has_tables(struct render *rndr) {
+	return (rndr->make.table
+	    || (rndr->make.table_begin && rndr->make.table_end))
+	    && rndr->make.table_row && rndr->make.table_cell; }
+
+
+/* open_block • parsing of one block, returning its size */
+/*	containers push their contents as block tasks, and lists only know
+ *	their size once their last item is parsed, see run_blocks */
+static size_t
+open_block(struct buf *ob, struct render *rndr, char *data, size_t size,
+							int has_table) {
+	size_t i;
+	int probes = find_block_probes(data, size);
+
+	if (probes & BLOCK_ATX)
+		return parse_atxheader(ob, rndr, data, size);
+	else if ((probes & BLOCK_HTML) && rndr->make.blockhtml
+		&& (i = parse_htmlblock(ob, rndr, data, size)) != 0)
+		return i;
+	else if ((probes & BLOCK_EMPTY) && (i = is_empty(data, size)) != 0)
+		return i;
+	else if ((probes & BLOCK_HRULE) && is_hrule(data, size)) {
+		if (rndr->make.hrule)
+			rndr->make.hrule(ob, rndr->make.opaque);
+		for (i = 0; i < size && data[i] != '\n'; i += 1);
+		return i + 1; }
+	else if ((probes & BLOCK_QUOTE) && prefix_quote(data, size)
+		&& reserve_tasks(rndr, 2))
+		return parse_blockquote(ob, rndr, data, size);
+	else if ((probes & BLOCK_CODE) && prefix_code(data, size))
+		return parse_blockcode(ob, rndr, data, size);
+	else if ((probes & BLOCK_ULI) && prefix_uli(data, size)
+		&& reserve_tasks(rndr, 1))
+		return parse_list(ob, rndr, data, size, 0);
+	else if ((probes & BLOCK_OLI) && prefix_oli(data, size)
+		&& reserve_tasks(rndr, 1))
+		return parse_list(ob, rndr, data, size, MKD_LIST_ORDERED);
+	else if (has_table && has_table_sep(data, size)
+		&& is_tableline(data, size))
+		return parse_table(ob, rndr, data, size);
+	else
+		return parse_paragraph(ob, rndr, data, size); }
+
+
+/* run_blocks • runs the block tasks above base until they are all done */
+/*	returns the size parsed by the task at base */
+static size_t
+run_blocks(struct render *rndr, int base) {
+	struct block_task *t;
+	struct buf view = { 0, 0, 0, 0, 0 };
+	size_t ret = 0, j;
+	int has_table = has_tables(rndr), n;
+
+	while ((n = rndr->blocks.size - 1) >= base) {
+		t = arr_item(&rndr->blocks, n);
+		switch (t->step) {
+		    case STEP_BLOCKS:
+			if (!t->nb
+			&& rndr->work.size > rndr->make.max_work_stack) {
+				put_raw(t->ob, rndr, t->data, t->size);
+				t->beg = t->size; }
+			if (t->beg >= t->size || (t->flags && t->nb)) {
+				if (n == base) ret = t->beg;
+				rndr->blocks.size -= 1;
+				break; }
+			t->nb += 1;
+			j = open_block(t->ob, rndr, t->data + t->beg,
+					t->size - t->beg, has_table);
+			t = arr_item(&rndr->blocks, n);
+			t->beg += j;
+			break;
+
+		    case STEP_QUOTE:
+			close_blockquote(t->ob, rndr, t->base, t->level);
+			rndr->blocks.size -= 1;
+			break;
+
+		    case STEP_LIST:
+			if (!t->nb && rndr->threads > 1
+			&& t->size >= PARALLEL_UNIT) {
+				parse_items_parallel(rndr, t);
+				t = arr_item(&rndr->blocks, n); }
+			if (t->beg < t->size && !(t->flags & MKD_LI_END)
+			&& reserve_tasks(rndr, 3)) {
+				t = arr_item(&rndr->blocks, n);
+				j = parse_listitem(rndr->work.item[t->base],
+					rndr, t->data + t->beg,
+					t->size - t->beg, &t->flags);
+				t->nb += 1;
+				t->beg += j;
+				if (j) break; }
+
+			/* no more items, the parent goes on after the list */
+			if (rndr->make.list)
+				rndr->make.list(t->ob,
+					rndr->work.item[t->base],
+					t->flags, rndr->make.opaque);
+			release_work_buffer(rndr, rndr->work.item[t->base]);
+			if (n == base) ret = t->beg;
+			else t[-1].beg += t->beg;
+			rndr->blocks.size -= 1;
+			break;
+
+		    case STEP_ITEM:
+			/* raw text of lazy items, see parse_listitem */
+			view.data = t->data;
+			view.size = t->size;
+			if (rndr->make.listitem)
+				rndr->make.listitem(t->ob, (t->flags & MKD_LI_RAW)
+					? &view : rndr->work.item[t->base + 1],
+					t->flags, rndr->make.opaque);
+			release_work_buffer(rndr, rndr->work.item[t->base + 1]);
+			release_work_buffer(rndr, rndr->work.item[t->base]);
+			rndr->blocks.size -= 1;
+			break; } }
+	return ret; }
+
+
+/* parse_block • parsing of a sequence of blocks */
+/*	nested blocks are stacked in rndr->blocks instead of recursing, so
+ *	the C stack depth does not depend on input */
+static void
+parse_block(struct buf *ob, struct render *rndr,
+			char *data, size_t size) {
+	int base = rndr->blocks.size;
+
+	if (!reserve_tasks(rndr, 1)) {
+		put_raw(ob, rndr, data, size);
+		return; }
+	push_blocks(rndr, ob, data, size, 0);
+	run_blocks(rndr, base); }
+
+
+/* parse_one_block • parsing of one block, returning its size */
+static size_t
+parse_one_block(struct buf *ob, struct render *rndr,
+			char *data, size_t size) {
+	int base = rndr->blocks.size;
+
+	if (!reserve_tasks(rndr, 1)) {
+		put_raw(ob, rndr, data, size);
+		return size; }
+	push_blocks(rndr, ob, data, size, 1);
+	return run_blocks(rndr, base); }
+
+
+
+/*********************
+ * REFERENCE PARSING *
+ *********************/
+
+/* is_ref • returns whether a line is a reference or not */
+static int
+is_ref(char *data, size_t beg, size_t end, size_t *last,
+				struct ref_table *refs) {
+	size_t i = 0;
+	size_t id_offset, id_end;
 	size_t link_offset, link_end;
 	size_t title_offset, title_end;
 	size_t line_end;
 	struct link_ref *lr;
-	struct buf *id;
+	struct buf *pool;
+	size_t org;
 
 	/* up to 3 optional leading spaces */
 	if (beg + 3 >= end) return 0;
@@ -1653,109 +3047,3305 @@ is_ref(char *data, size_t beg, size_t end, size_t *last, struct array *refs) {
 	/* a valid ref has been found, filling-in return structures */
 	if (last) *last = line_end;
 	if (!refs) return 1;
-	id = bufnew(WORK_UNIT);
-	if (build_ref_id(id, data + id_offset, id_end - id_offset) < 0) {
-		bufrelease(id);
-		return 0; }
-	lr = arr_item(refs, arr_newitem(refs));
-	lr->id = id;
-	lr->link = bufnew(link_end - link_offset);
-	bufput(lr->link, data + link_offset, link_end - link_offset);
+	pool = refs->pool;
+	org = pool->size;
+	if (build_ref_id(pool, data + id_offset, id_end - id_offset) < 0)
+		return 0;
+	lr = arr_item(&refs->refs, arr_newitem(&refs->refs));
+	if (!lr) {
+		pool->size = org;
+		return 1; }
+	for (i = org; i < pool->size; i += 1)
+		pool->data[i] = fold_ref_char(pool->data[i]);
+	lr->id = org;
+	lr->id_size = pool->size - org;
+	lr->hash = hash_ref_id(pool->data + org, lr->id_size);
+	lr->link = pool->size;
+	lr->link_size = link_end - link_offset;
+	bufput(pool, data + link_offset, lr->link_size);
+	lr->title = pool->size;
+	lr->title_size = 0;
 	if (title_end > title_offset) {
-		lr->title = bufnew(title_end - title_offset);
-		bufput(lr->title, data + title_offset,
-					title_end - title_offset); }
-	else lr->title = 0;
+		lr->title_size = title_end - title_offset;
+		bufput(pool, data + title_offset, lr->title_size); }
+	return 1; }
+
+
+
+/* normalize_line • takes in the reference or the line at beg */
+/*	lines are copied into text with normalized newlines, references are
+ *	added to refs; returns the beginning of the next line */
+static size_t
+normalize_line(struct buf *text, const struct buf *ib, size_t beg,
+					struct ref_table *refs) {
+	size_t end;
+
+	if (is_ref(ib->data, beg, ib->size, &end, refs))
+		return end;
+
+	/* skipping to the next line */
+	end = beg;
+	while (end < ib->size
+	&& ib->data[end] != '\n' && ib->data[end] != '\r')
+		end += 1;
+	/* adding the line body if present */
+	if (end > beg) bufput(text, ib->data + beg, end - beg);
+	while (end < ib->size
+	&& (ib->data[end] == '\n' || ib->data[end] == '\r')) {
+		/* add one \n per newline */
+		if (ib->data[end] == '\n'
+		|| (end + 1 < ib->size && ib->data[end + 1] != '\n'))
+			bufputc(text, '\n');
+		end += 1; }
+	return end; }
+
+
+/* end_text • adds a final newline to text if not already present */
+static void
+end_text(struct buf *text) {
+	if (text->size
+	&&  text->data[text->size - 1] != '\n'
+	&&  text->data[text->size - 1] != '\r')
+		bufputc(text, '\n'); }
+
+
+/* init_ref_table • empty reference table */
+static void
+init_ref_table(struct ref_table *refs) {
+	arr_init(&refs->refs, sizeof (struct link_ref));
+	refs->pool = bufnew(REF_UNIT);
+	refs->slot = 0;
+	refs->mask = 0;
+	refs->indexed = 0; }
+
+
+/* index_ref_table • adds the new references to the hash index */
+/*	the first definition of an id takes precedence */
+static void
+index_ref_table(struct ref_table *refs) {
+	struct link_ref *lr = refs->refs.base;
+	const char *pool = refs->pool->data;
+	size_t i, mask;
+	int n, k, *neo;
+
+	/* keeping the table at most half full */
+	if ((size_t)refs->refs.size * 2 > refs->mask) {
+		mask = refs->mask ? refs->mask : 15;
+		while (mask < (size_t)refs->refs.size * 2)
+			mask = mask * 2 + 1;
+		neo = calloc(mask + 1, sizeof *neo);
+		if (!neo) return;
+		free(refs->slot);
+		refs->slot = neo;
+		refs->mask = mask;
+		refs->indexed = 0; }
+
+	mask = refs->mask;
+	for (n = refs->indexed; n < refs->refs.size; n += 1) {
+		for (i = lr[n].hash & mask; (k = refs->slot[i]) != 0;
+							i = (i + 1) & mask)
+			if (lr[k - 1].hash == lr[n].hash
+			&& lr[k - 1].id_size == lr[n].id_size
+			&& !memcmp(pool + lr[k - 1].id, pool + lr[n].id,
+							lr[n].id_size))
+				break;
+		if (!k) refs->slot[i] = n + 1; }
+	refs->indexed = refs->refs.size; }
+
+
+/* free_ref_table • releases the memory of a reference table */
+static void
+free_ref_table(struct ref_table *refs) {
+	arr_free(&refs->refs);
+	bufrelease(refs->pool);
+	free(refs->slot); }
+
+
+
+/*************************
+ * SINGLE-PASS RENDERING *
+ *************************/
+
+/* ends_with_empty • whether the last line of text is blank */
+static int
+ends_with_empty(struct buf *text) {
+	size_t i;
+	if (!text->size || text->data[text->size - 1] != '\n') return 0;
+	i = text->size - 1;
+	while (i > 0 && (text->data[i - 1] == ' ' || text->data[i - 1] == '\t'))
+		i -= 1;
+	return i == 0 || text->data[i - 1] == '\n'; }
+
+
+/* table_may_go_on • whether a table header precedes the final blank line */
+/*	parse_table accepts a blank line as an empty ruler */
+static int
+table_may_go_on(struct render *rndr, struct buf *text) {
+	size_t end, beg;
+	if (!rndr->make.table
+	&& !(rndr->make.table_begin && rndr->make.table_end))
+		return 0;
+	end = text->size - 1;
+	while (end > 0 && text->data[end - 1] != '\n')
+		end -= 1;
+	if (end == 0) return 0;
+	beg = end - 1;
+	while (beg > 0 && text->data[beg - 1] != '\n')
+		beg -= 1;
+	return is_tableline(text->data + beg, end - beg) != 0; }
+
+
+/* is_chunk_start • whether a line after a blank one starts a new block */
+/*	i.e. it is not indented, nor a quote, a list item or HTML */
+static int
+is_chunk_start(char c) {
+	return c != ' ' && c != '\t' && c != '\n' && c != '\r'
+	    && c != '>' && c != '<' && c != '*' && c != '+' && c != '-'
+	    && !(c >= '0' && c <= '9'); }
+
+
+/* may_open_html • whether an HTML block may start at data */
+static int
+may_open_html(struct render *rndr, char *data, size_t size) {
+	return find_block_tag(rndr, data + 1, size - 1)
+	    || (size > 3 && data[1] == '!' && data[2] == '-' && data[3] == '-')
+	    || (size > 2 && (data[1] == 'h' || data[1] == 'H')
+			&& (data[2] == 'r' || data[2] == 'R')); }
+
+
+/* html_may_end • whether more text may end the HTML block at data */
+/*	i.e. whether htmlblock_size failing is not definitive: comments and
+ *	rules end at their first "-->" or '>', looked for from the given
+ *	offset, tags at any matching closing tag, except ins and del */
+static int
+html_may_end(struct render *rndr, char *data, size_t size, size_t from) {
+	const struct html_tag *tag = find_block_tag(rndr, data + 1, size - 1);
+	size_t i = from > 3 ? from : 3;
+
+	if (tag) return tag != INS_TAG && tag != DEL_TAG;
+	if (data[1] == '!') {
+		while (i + 2 < size && !(data[i] == '-' && data[i + 1] == '-'
+							&& data[i + 2] == '>'))
+			i += 1;
+		return i + 2 >= size; }
+	while (i < size && data[i] != '>')
+		i += 1;
+	return i >= size; }
+
+
+/* html_blocks_closed • whether no HTML block of text may extend further */
+/*	*from is the first line which might still be in an HTML block, and
+ *	*scan where to look again for the end of that block; each line is
+ *	checked, since a block found here may be a mere span of a paragraph */
+static int
+html_blocks_closed(struct render *rndr, struct buf *text, size_t *from,
+							size_t *scan) {
+	char *data = text->data;
+	size_t i = *from;
+
+	while (i < text->size) {
+		if (data[i] == '<'
+		&& may_open_html(rndr, data + i, text->size - i)
+		&& !htmlblock_size(rndr, data + i, text->size - i,
+						*scan > i ? *scan - i : 0)
+		&& html_may_end(rndr, data + i, text->size - i,
+						*scan > i ? *scan - i : 0)) {
+			/* maybe closed by the following lines, whose end
+			 * may only be decided from the last two lines */
+			*from = i;
+			*scan = text->size - 1;
+			while (*scan > i && data[*scan - 1] != '\n')
+				*scan -= 1;
+			if (*scan > i) *scan -= 1;
+			while (*scan > i && data[*scan - 1] != '\n')
+				*scan -= 1;
+			return 0; }
+		while (i < text->size && data[i] != '\n') i += 1;
+		i += 1; }
+	*from = i;
 	return 1; }
 
 
+/* render_chunk • renders a chunk, deferring it when it missed references */
+static void
+render_chunk(struct buf *ob, struct render *rndr, struct buf *text) {
+	struct backpatch *patch = rndr->patch;
+	struct deferred_block *blk;
+	size_t ob_beg = ob->size, text_beg = patch->texts->size;
+	int miss = patch->misses.size;
+
+	if (rndr->refs.indexed < rndr->refs.refs.size)
+		index_ref_table(&rndr->refs);
+
+	/* blockquotes are rewritten in place, so the text which may hold
+	 * reference links is kept before rendering */
+	if (memchr(text->data, '[', text->size))
+		bufput(patch->texts, text->data, text->size);
+	parse_block(ob, rndr, text->data, text->size);
+	if (patch->misses.size == miss
+	|| !(blk = arr_item(&patch->blocks, arr_newitem(&patch->blocks)))) {
+		patch->texts->size = text_beg;
+		return; }
+	blk->text_beg = text_beg;
+	blk->text_end = patch->texts->size;
+	blk->ob_beg = ob_beg;
+	blk->ob_end = ob->size;
+	blk->miss_beg = miss;
+	blk->miss_end = patch->misses.size; }
+
+
+/* patch_blocks • renders again the chunks whose missed ids got defined */
+static void
+patch_blocks(struct buf *ob, struct render *rndr, struct backpatch *patch) {
+	struct deferred_block *blk = patch->blocks.base;
+	struct ref_miss *miss = patch->misses.base;
+	struct buf *tail = 0;
+	size_t base = 0, done = 0;
+	int i, j;
+
+	for (i = 0; i < patch->blocks.size; i += 1) {
+		/* checking whether one of the missed ids is now defined */
+		for (j = blk[i].miss_beg; j < blk[i].miss_end; j += 1)
+			if (find_link_ref(&rndr->refs,
+			    patch->pool->data + miss[j].id, miss[j].size))
+				break;
+		if (j >= blk[i].miss_end) continue;
+
+		/* moving aside the output from the first patched chunk */
+		if (!tail) {
+			base = done = blk[i].ob_beg;
+			tail = bufnew(TEXT_UNIT);
+			bufput(tail, ob->data + base, ob->size - base);
+			ob->size = base; }
+
+		/* copying the output up to the chunk, and rendering it again */
+		bufput(ob, tail->data + done - base, blk[i].ob_beg - done);
+		parse_block(ob, rndr, patch->texts->data + blk[i].text_beg,
+					blk[i].text_end - blk[i].text_beg);
+		done = blk[i].ob_end; }
+
+	/* copying the remaining output */
+	if (!tail) return;
+	bufput(ob, tail->data + done - base, tail->size - (done - base));
+	bufrelease(tail); }
+
+
+/* init_backpatch • empty single-pass state */
+static void
+init_backpatch(struct backpatch *patch) {
+	arr_init(&patch->blocks, sizeof (struct deferred_block));
+	arr_init(&patch->misses, sizeof (struct ref_miss));
+	patch->pool = bufnew(WORK_UNIT);
+	patch->texts = bufnew(TEXT_UNIT);
+	patch->text = bufnew(TEXT_UNIT);
+	patch->html = 0;
+	patch->html_scan = 0;
+	patch->html_wait = 0; }
+
+
+/* free_backpatch • releases the memory of a single-pass state */
+static void
+free_backpatch(struct backpatch *patch) {
+	arr_free(&patch->blocks);
+	arr_free(&patch->misses);
+	bufrelease(patch->pool);
+	bufrelease(patch->texts);
+	bufrelease(patch->text); }
+
+
+/* single_pass_line • takes in the line at beg, rendering the chunk it ends */
+/*	the input is cut into chunks, at blank lines followed by a line that
+ *	cannot continue the previous block; returns the next line */
+static size_t
+single_pass_line(struct buf *ob, struct render *rndr, struct buf *ib,
+							size_t beg) {
+	struct backpatch *patch = rndr->patch;
+	struct buf *text = patch->text;
+	size_t org = text->size;
+
+	beg = normalize_line(text, ib, beg, &rndr->refs);
+
+	/* an open HTML block is only checked again after a '>' */
+	if (patch->html_wait && text->size > org
+	&& memchr(text->data + org, '>', text->size - org))
+		patch->html_wait = 0;
+
+	/* rendering the chunk when the next line starts a new one */
+	/*	(references lines are blank, so they do not count) */
+	if (beg >= ib->size || patch->html_wait
+	|| !is_chunk_start(ib->data[beg]) || !ends_with_empty(text)
+	|| table_may_go_on(rndr, text)
+	|| is_ref(ib->data, beg, ib->size, 0, 0))
+		return beg;
+	if (!html_blocks_closed(rndr, text, &patch->html, &patch->html_scan)) {
+		patch->html_wait = 1;
+		return beg; }
+	render_chunk(ob, rndr, text);
+	text->size = 0;
+	patch->html = 0;
+	patch->html_scan = 0;
+	return beg; }
+
+
+/* single_pass_last • renders the last chunk of the input */
+static void
+single_pass_last(struct buf *ob, struct render *rndr) {
+	end_text(rndr->patch->text);
+	render_chunk(ob, rndr, rndr->patch->text); }
+
+
+/*****************
+ * PIECED INPUTS *
+ *****************/
+
+/* is_piece_line • whether a line begins at i, with its first byte known */
+/*	newline runs are never split, since a "\r\n" may straddle two pieces */
+static int
+is_piece_line(const char *data, size_t i) {
+	return (data[i - 1] == '\n' || data[i - 1] == '\r')
+	    && data[i] != '\n' && data[i] != '\r'; }
+
+
+/* piece_safe_end • end of the input lines which can be taken in */
+/*	a line is only taken in with LOOKAHEAD_LINES complete lines after it,
+ *	since references and chunk ends are decided from the next lines;
+ *	*complete receives the end of the last complete line */
+static size_t
+piece_safe_end(const char *data, size_t size, size_t *complete) {
+	size_t i;
+	int lines = 0;
+	for (i = size; i > 0; i -= 1)
+		if (i < size && is_piece_line(data, i)) {
+			if (!lines) *complete = i;
+			if ((lines += 1) > LOOKAHEAD_LINES)
+				return i; }
+	return 0; }
+
+
+/* carry_safe_end • piece_safe_end of the carry, scanning its new bytes */
+static size_t
+carry_safe_end(struct piece_carry *carry, size_t *complete) {
+	const char *data = carry->buf->data;
+	size_t i = carry->scanned ? carry->scanned : 1;
+
+	for (; i < carry->buf->size; i += 1)
+		if (is_piece_line(data, i)) {
+			if (carry->nb > LOOKAHEAD_LINES) {
+				memmove(carry->line, carry->line + 1,
+					LOOKAHEAD_LINES * sizeof *carry->line);
+				carry->nb -= 1; }
+			carry->line[carry->nb++] = i; }
+	carry->scanned = carry->buf->size;
+	if (carry->nb <= LOOKAHEAD_LINES) return 0;
+	*complete = carry->line[carry->nb - 1];
+	return carry->line[0]; }
+
+
+/* carry_slurp • removes the first len bytes of the carry */
+/*	the line starts after them are among the kept ones */
+static void
+carry_slurp(struct piece_carry *carry, size_t len) {
+	size_t i, n = 0;
+	bufslurp(carry->buf, len);
+	for (i = 0; i < carry->nb; i += 1)
+		if (carry->line[i] > len)
+			carry->line[n++] = carry->line[i] - len;
+	carry->nb = n;
+	carry->scanned = carry->buf->size; }
+
+
+/* init_carry • empty carry */
+static void
+init_carry(struct piece_carry *carry, struct buf *buf) {
+	carry->buf = buf;
+	carry->scanned = 0;
+	carry->nb = 0; }
+
+
+/* piece_head • end of the LOOKAHEAD_LINES + 1 first lines of data */
+/*	and of the first byte after them, or size if there are fewer lines */
+static size_t
+piece_head(const char *data, size_t size) {
+	size_t i;
+	int lines = 0;
+	for (i = 1; i < size; i += 1)
+		if ((data[i - 1] == '\n' || data[i - 1] == '\r')
+		&& data[i] != '\n' && data[i] != '\r'
+		&& (lines += 1) > LOOKAHEAD_LINES)
+			return i + 1;
+	return size; }
+
+
+/* take_lines • takes in the lines of data beginning before end */
+/*	lookahead is allowed up to complete; returns the end of the last line;
+ *	lines are rendered in single-pass mode, or copied into text */
+static size_t
+take_lines(struct buf *ob, struct render *rndr, struct buf *text,
+			const char *data, size_t end, size_t complete) {
+	struct buf win = { (char *)data, complete, 0, 0, 0 };
+	size_t beg = 0;
+	while (beg < end)
+		beg = rndr->patch ? single_pass_line(ob, rndr, &win, beg)
+			: normalize_line(text, &win, beg, &rndr->refs);
+	return beg; }
+
+
+/* take_piece • takes in the complete lines of a piece of input */
+/*	lines going on in the next pieces are copied into carry */
+static void
+take_piece(struct buf *ob, struct render *rndr, struct buf *text,
+		struct piece_carry *carry, const char *data, size_t size,
+								int last) {
+	size_t off = 0, old, end, complete = 0, beg;
+
+	/* completing the carried lines with the head of the piece */
+	if (carry->buf->size) {
+		old = carry->buf->size;
+		off = last ? size : piece_head(data, size);
+		bufput(carry->buf, data, off);
+		if (last) end = complete = carry->buf->size;
+		else end = carry_safe_end(carry, &complete);
+		beg = end ? take_lines(ob, rndr, text,
+				carry->buf->data, end, complete) : 0;
+		if (off >= size) {
+			carry_slurp(carry, beg);
+			return; }
+		off = beg - old;
+		init_carry(carry, carry->buf);
+		carry->buf->size = 0; }
+
+	/* taking in the lines of the piece in place */
+	if (last) end = complete = size - off;
+	else end = piece_safe_end(data + off, size - off, &complete);
+	beg = end ? take_lines(ob, rndr, text, data + off, end, complete) : 0;
+	bufput(carry->buf, data + off + beg, size - off - beg); }
+
+
+
+/* hand_over • appends the new output to the caller buffer */
+/*	the last byte is kept in out, renderers looking at whether it is empty;
+ *	*given is the number of bytes at the beginning of out already in ob */
+static void
+hand_over(struct buf *ob, struct buf *out, size_t *given) {
+	if (out->size <= *given) return;
+	bufput(ob, out->data + *given, out->size - *given);
+	bufslurp(out, out->size - 1);
+	*given = 1; }
+
+
+/* stream_flush • gives the output to the caller, unless a chunk is deferred */
+/*	past STREAM_HOLD bytes held back, the deferred chunks are given as
+ *	first rendered, and references defined later no longer patch them */
+static void
+stream_flush(struct backpatch *patch, struct buf *ob, struct buf *out,
+							size_t *given) {
+	if (patch->blocks.size && out->size - *given > STREAM_HOLD) {
+		patch->blocks.size = 0;
+		patch->misses.size = 0;
+		patch->pool->size = 0;
+		patch->texts->size = 0; }
+	if (!patch->blocks.size)
+		hand_over(ob, out, given); }
+
+
+
+/**********************
+ * PARALLEL RENDERING *
+ **********************/
+
+static void markdown_cleanup(struct render *rndr);
+static void markdown_setup(struct render *rndr,
+			const struct mkd_renderer *rndrer);
+static void render_blocks(struct buf *ob, struct render *rndr,
+						struct buf *text);
+
+
+/* take_job • next job of a pool worker, stolen from another one if needed */
+/*	half of the jobs left to the first worker found with some are stolen,
+ *	from the end of its range; returns -1 when there is no job left */
+static int
+take_job(struct pool_worker *w) {
+	struct pool *pool = w->pool;
+	struct pool_worker *v;
+	int job, end, k;
+
+	pthread_mutex_lock(&w->lock);
+	job = w->next < w->end ? w->next++ : -1;
+	pthread_mutex_unlock(&w->lock);
+	for (k = 1; job < 0 && k < pool->nb; k += 1) {
+		v = pool->workers + (w->id + k) % pool->nb;
+		pthread_mutex_lock(&v->lock);
+		end = v->end;
+		if (v->next < end) {
+			job = end - (end - v->next + 1) / 2;
+			v->end = job; }
+		pthread_mutex_unlock(&v->lock);
+		if (job >= 0) {
+			pthread_mutex_lock(&w->lock);
+			w->next = job + 1;
+			w->end = end;
+			pthread_mutex_unlock(&w->lock); } }
+	return job; }
+
+
+/* pool_thread • runs jobs of the pool until there is none left */
+static void *
+pool_thread(void *arg) {
+	struct pool_worker *w = arg;
+	int job;
+
+	while ((job = take_job(w)) >= 0)
+		w->pool->run(w->pool->ctx, w->id, job);
+	return 0; }
+
+
+/* run_pool • runs nb jobs on at most nthreads threads, including the caller */
+/*	the workers are numbered from 0, the caller being worker 0, and each
+ *	one starts with its share of consecutive jobs */
+static void
+run_pool(int nthreads, int nb, void (*run)(void *, int, int), void *ctx) {
+	struct pool pool;
+	pthread_t *th;
+	int i, started = 0;
+
+	pool.nb = nthreads;
+	pool.run = run;
+	pool.ctx = ctx;
+	pool.workers = malloc(nthreads * sizeof *pool.workers);
+	th = malloc(nthreads * sizeof *th);
+	if (!pool.workers || !th) {
+		for (i = 0; i < nb; i += 1)
+			run(ctx, 0, i);
+		free(pool.workers);
+		free(th);
+		return; }
+	for (i = 0; i < nthreads; i += 1) {
+		pool.workers[i].pool = &pool;
+		pthread_mutex_init(&pool.workers[i].lock, 0);
+		pool.workers[i].next = (long)nb * i / nthreads;
+		pool.workers[i].end = (long)nb * (i + 1) / nthreads;
+		pool.workers[i].id = i; }
+
+	/* jobs of threads which cannot be started are stolen */
+	for (i = 1; i < nthreads; i += 1)
+		if (pthread_create(th + i, 0, pool_thread,
+						pool.workers + i) == 0)
+			started = i;
+		else break;
+	pool_thread(pool.workers);
+	for (i = 1; i <= started; i += 1)
+		pthread_join(th[i], 0);
+	for (i = 0; i < nthreads; i += 1)
+		pthread_mutex_destroy(&pool.workers[i].lock);
+	free(pool.workers);
+	free(th); }
+
+
+/* new_workers • renders for nb threads, sharing the references of rndr */
+/*	the references are only read once the first pass is over */
+static struct render *
+new_workers(struct render *rndr, int nb) {
+	struct render *w = malloc(nb * sizeof *w);
+	int i;
+
+	for (i = 0; w && i < nb; i += 1) {
+		markdown_setup(w + i, &rndr->make);
+		free_ref_table(&w[i].refs);
+		w[i].refs = rndr->refs;
+		w[i].lazy = rndr->lazy; }
+	return w; }
+
+
+/* free_workers • releases renders made by new_workers() */
+static void
+free_workers(struct render *w, int nb) {
+	int i;
+
+	for (i = 0; i < nb; i += 1) {
+		init_ref_table(&w[i].refs);
+		markdown_cleanup(w + i); }
+	free(w); }
+
+
+/* render_items • renders list items from first to last, as in run_blocks */
+static void
+render_items(struct buf *ob, struct render *rndr, struct block_jobs *bj,
+						int first, int last) {
+	size_t *starts = bj->starts.base, beg;
+	int *flags = bj->flags.base;
+	int i, fl, base;
+
+	for (i = first; i < last; i += 1) {
+		base = rndr->blocks.size;
+		if (!reserve_tasks(rndr, 3)) break;
+		fl = flags[i];
+		beg = starts[i];
+		if (parse_listitem(ob, rndr, bj->data + beg, bj->size - beg,
+									&fl))
+			run_blocks(rndr, base); } }
+
+
+/* render_rows • renders table rows from first to last, as in parse_table */
+static void
+render_rows(struct buf *ob, struct render *rndr, struct block_jobs *bj,
+						int first, int last) {
+	size_t *starts = bj->starts.base;
+	int i;
+
+	for (i = first; i < last; i += 1)
+		parse_table_row(ob, rndr, bj->data + starts[i],
+				bj->size - starts[i], bj->aligns,
+				bj->align_size, 0); }
+
+
+/* render_block_part • renders items or rows, as a job of the pool */
+/*	the work stack is filled up to the depth of the serial render, so
+ *	that max_work_stack works the same */
+static void
+render_block_part(void *ctx, int worker, int job) {
+	struct block_jobs *bj = ctx;
+	struct block_part *part = bj->parts + job;
+	struct render *w = bj->workers + worker;
+
+	while (w->work.size < bj->depth)
+		new_work_buffer(w);
+	part->out = bufnew(WORK_UNIT);
+	if (part->pad) bufputc(part->out, 0);
+	bj->render(part->out, w, bj, part->first, part->last);
+	w->work.size = 0; }
+
+
+/* run_block_jobs • renders the items or rows of bj into ob, in parallel */
+/*	items or rows are gathered into parts of about the same size; returns
+ *	0 when they are not worth it, without rendering anything */
+static int
+run_block_jobs(struct buf *ob, struct block_jobs *bj, size_t end) {
+	struct render *rndr = bj->rndr;
+	size_t *starts = bj->starts.base, beg = starts[0], next;
+	int i, k, nb = bj->starts.size, nthreads = rndr->threads;
+
+	if (end - beg < PARALLEL_UNIT || nb < 2) return 0;
+	if (nb > nthreads * CHUNKS_PER_THREAD)
+		nb = nthreads * CHUNKS_PER_THREAD;
+	bj->parts = malloc(nb * sizeof *bj->parts);
+	if (!bj->parts) return 0;
+	bj->nb = 0;
+	for (i = 0; i < bj->starts.size; i = k) {
+		next = beg + (end - beg) / nb * (bj->nb + 1);
+		for (k = i + 1; k < bj->starts.size && starts[k] < next;
+								k += 1);
+		if (bj->nb + 1 >= nb) k = bj->starts.size;
+		bj->parts[bj->nb].first = i;
+		bj->parts[bj->nb].last = k;
+		bj->parts[bj->nb].out = 0;
+		bj->parts[bj->nb].pad = bj->nb > 0 || ob->size > 0;
+		bj->nb += 1; }
+	if (nthreads > bj->nb) nthreads = bj->nb;
+	bj->depth = rndr->work.size;
+	bj->workers = new_workers(rndr, nthreads);
+	if (!bj->workers) {
+		free(bj->parts);
+		return 0; }
+	run_pool(nthreads, bj->nb, render_block_part, bj);
+
+	/* stitching the parts, as in render_parallel */
+	for (i = 0; i < bj->nb; i += 1) {
+		if (bj->parts[i].pad && !ob->size)
+			bj->render(ob, rndr, bj, bj->parts[i].first,
+						bj->parts[i].last);
+		else
+			bufput(ob, bj->parts[i].out->data + bj->parts[i].pad,
+				bj->parts[i].out->size - bj->parts[i].pad);
+		bufrelease(bj->parts[i].out); }
+	free_workers(bj->workers, nthreads);
+	free(bj->parts);
+	return 1; }
+
+
+/* parse_items_parallel • renders the items of a huge list in parallel */
+/*	the extent and flags of the items are found first, then the list task
+ *	is updated as if run_blocks had rendered them */
+static void
+parse_items_parallel(struct render *rndr, struct block_task *t) {
+	struct block_jobs bj;
+	struct buf *scratch = bufnew(WORK_UNIT);
+	struct buf *ob = rndr->work.item[t->base];
+	size_t beg = t->beg, j, sublist, *start;
+	int flags = t->flags, *fl, nb = 0;
+
+	bj.rndr = rndr;
+	bj.data = t->data;
+	bj.size = t->size;
+	bj.aligns = 0;
+	bj.align_size = 0;
+	bj.render = render_items;
+	arr_init(&bj.starts, sizeof (size_t));
+	arr_init(&bj.flags, sizeof (int));
+	while (beg < t->size && !(flags & MKD_LI_END)) {
+		start = arr_item(&bj.starts, arr_newitem(&bj.starts));
+		fl = arr_item(&bj.flags, arr_newitem(&bj.flags));
+		if (!start || !fl) break;
+		*start = beg;
+		*fl = flags;
+		scratch->size = 0;
+		j = scan_listitem(scratch, t->data + beg, t->size - beg,
+							&flags, &sublist);
+		if (!j) break;
+		beg += j;
+		nb += 1; }
+	bj.starts.size = bj.flags.size = nb;
+
+	if (nb && run_block_jobs(ob, &bj, beg)) {
+		t->beg = beg;
+		t->flags = flags;
+		t->nb = nb; }
+	bufrelease(scratch);
+	arr_free(&bj.starts);
+	arr_free(&bj.flags); }
+
+
+/* parse_rows_parallel • renders the rows of a huge table in parallel */
+/*	returns the end of the rows, or beg when they are left to the caller */
+static size_t
+parse_rows_parallel(struct buf *ob, struct render *rndr, char *data,
+		size_t size, size_t beg, int *aligns, size_t align_size) {
+	struct block_jobs bj;
+	size_t i = beg, *start;
+
+	bj.rndr = rndr;
+	bj.data = data;
+	bj.size = size;
+	bj.aligns = aligns;
+	bj.align_size = align_size;
+	bj.render = render_rows;
+	arr_init(&bj.starts, sizeof (size_t));
+	arr_init(&bj.flags, sizeof (int));
+	while (i < size && is_tableline(data + i, size - i)) {
+		start = arr_item(&bj.starts, arr_newitem(&bj.starts));
+		if (!start) break;
+		*start = i;
+		while (i < size && data[i] != '\n')
+			i += 1;
+		if (i < size) i += 1; }
+	if (i > beg && run_block_jobs(ob, &bj, i)) beg = i;
+	arr_free(&bj.starts);
+	return beg; }
+
+
+/* scan_part • runs the first pass over a chunk, as a job of the pool */
+/*	the chunk may begin inside a reference, this is fixed later */
+static void
+scan_part(void *ctx, int worker, int job) {
+	struct first_pass *fp = ctx;
+	struct scan_chunk *sc = fp->chunks + job;
+	size_t beg = sc->beg;
+	size_t limit = job + 1 < fp->nb ? sc[1].beg : fp->ib->size;
+
+	bufgrow(sc->text, limit - beg);
+	while (beg < limit) {
+		if (sc->nb_marks < SEAM_MARKS) {
+			sc->marks[sc->nb_marks].pos = beg;
+			sc->marks[sc->nb_marks].text = sc->text->size;
+			sc->marks[sc->nb_marks].refs = sc->refs.refs.size;
+			sc->nb_marks += 1; }
+		beg = normalize_line(sc->text, fp->ib, beg, &sc->refs); }
+	sc->end = beg; }
+
+
+/* copy_part • copies the text of a chunk in the result, as a pool job */
+static void
+copy_part(void *ctx, int worker, int job) {
+	struct first_pass *fp = ctx;
+	struct scan_chunk *sc = fp->chunks + job;
+	if (sc->text->size > sc->skip_text)
+		memcpy(fp->text->data + sc->at, sc->text->data + sc->skip_text,
+					sc->text->size - sc->skip_text); }
+
+
+/* join_seams • makes the chunk scans agree with a single scan */
+/*	a chunk scan is only right from the first line start it shares with
+ *	the scan of the chunks before it, which goes on until then */
+static void
+join_seams(struct first_pass *fp) {
+	struct scan_chunk *owner = fp->chunks, *sc;
+	size_t pos = owner->end;
+	int k, j;
+
+	for (k = 1; k < fp->nb; k += 1) {
+		sc = fp->chunks + k;
+		j = 0;
+		while (pos < sc->end) {
+			while (j < sc->nb_marks && sc->marks[j].pos < pos)
+				j += 1;
+			if (j < sc->nb_marks && sc->marks[j].pos == pos)
+				break;
+			pos = normalize_line(owner->text, fp->ib, pos,
+							&owner->refs); }
+		if (pos < sc->end) {
+			sc->skip_text = sc->marks[j].text;
+			sc->skip_refs = sc->marks[j].refs;
+			pos = sc->end;
+			owner = sc; }
+		else {
+			/* the chunk was scanned whole by its owner */
+			sc->skip_text = sc->text->size;
+			sc->skip_refs = sc->refs.refs.size; } } }
+
+
+/* append_refs • appends the references of src from the given one to dst */
+static void
+append_refs(struct ref_table *dst, struct ref_table *src, int from) {
+	struct link_ref *lr = src->refs.base, *neo;
+	size_t base = dst->pool->size;
+	int i;
+
+	if (from >= src->refs.size) return;
+	bufput(dst->pool, src->pool->data, src->pool->size);
+	for (i = from; i < src->refs.size; i += 1) {
+		neo = arr_item(&dst->refs, arr_newitem(&dst->refs));
+		if (!neo) return;
+		*neo = lr[i];
+		neo->id += base;
+		neo->link += base;
+		neo->title += base; } }
+
+
+/* first_pass_parallel • first pass over ib, on nthreads threads */
+/*	ib is cut anywhere into chunks scanned from their first line start,
+ *	i.e. after every newline character, so that \r\n are never split */
+static void
+first_pass_parallel(struct buf *text, struct render *rndr,
+				const struct buf *ib, int nthreads) {
+	struct first_pass fp;
+	struct scan_chunk *sc;
+	size_t beg = 0, total = 0, i;
+	int k, nb;
+
+	nb = nthreads * CHUNKS_PER_THREAD;
+	if ((size_t)nb > ib->size / PARALLEL_UNIT)
+		nb = ib->size / PARALLEL_UNIT;
+	fp.chunks = nb > 1 ? calloc(nb, sizeof *fp.chunks) : 0;
+	if (!fp.chunks) {
+		while (beg < ib->size)
+			beg = normalize_line(text, ib, beg, &rndr->refs);
+		return; }
+	fp.ib = ib;
+	fp.text = text;
+	fp.nb = nb;
+
+	/* looking for the first line start of each chunk */
+	for (k = 0; k < nb; k += 1) {
+		sc = fp.chunks + k;
+		i = k ? ib->size / nb * k : 0;
+		if (k && i < sc[-1].beg) i = sc[-1].beg;
+		while (i > 0 && i < ib->size
+		&& (ib->data[i] == '\n' || ib->data[i] == '\r'
+		|| (ib->data[i - 1] != '\n' && ib->data[i - 1] != '\r')))
+			i += 1;
+		sc->beg = i;
+		sc->text = bufnew(TEXT_UNIT);
+		init_ref_table(&sc->refs); }
+	run_pool(nthreads, nb, scan_part, &fp);
+	join_seams(&fp);
+
+	/* gathering the references, then the text */
+	for (k = 0; k < nb; k += 1) {
+		sc = fp.chunks + k;
+		append_refs(&rndr->refs, &sc->refs, sc->skip_refs);
+		sc->at = text->size + total;
+		total += sc->text->size - sc->skip_text; }
+	if (bufgrow(text, text->size + total)) {
+		run_pool(nthreads, nb, copy_part, &fp);
+		text->size += total; }
+
+	/* clean-up */
+	for (k = 0; k < nb; k += 1) {
+		bufrelease(fp.chunks[k].text);
+		free_ref_table(&fp.chunks[k].refs); }
+	free(fp.chunks); }
+
+
+/* next_cut • first boundary between top-level blocks at or after beg */
+/*	using the rules of single-pass chunks; *html is the first line which
+ *	might still be in an HTML block, and *retry the first position where
+ *	it is worth checking again; returns text->size when there is none */
+static size_t
+next_cut(struct render *rndr, struct buf *text, size_t beg,
+				size_t *html, size_t *retry) {
+	struct buf head = { text->data, 0, 0, 0, 0 };
+	size_t i = beg, scan = 0;
+
+	while (i > 0 && i < text->size && text->data[i - 1] != '\n')
+		i += 1;
+	while (i < text->size) {
+		head.size = i;
+		if (i >= *retry && is_chunk_start(text->data[i])
+		&& ends_with_empty(&head) && !table_may_go_on(rndr, &head)) {
+			if (html_blocks_closed(rndr, &head, html, &scan))
+				return i;
+			/* an HTML block is still open, backing off */
+			*retry = i + (i - *html); }
+		while (i < text->size && text->data[i] != '\n')
+			i += 1;
+		i += 1; }
+	return text->size; }
+
+
+/* render_part • renders a chunk of the text, as a job of the pool */
+/*	blockquotes are rewritten in place, so a copy of the text is used;
+ *	chunks without cut are left to the caller, which may run their
+ *	lists and tables on all the threads */
+static void
+render_part(void *ctx, int worker, int job) {
+	struct parallel *par = ctx;
+	struct text_chunk *chunk = par->chunks + job;
+	struct buf *copy = par->copies[worker];
+
+	if (chunk->end - chunk->beg > par->text->size / par->threads)
+		return;
+	copy->size = 0;
+	bufput(copy, par->text->data + chunk->beg, chunk->end - chunk->beg);
+	chunk->out = bufnew(TEXT_UNIT);
+	if (chunk->pad) bufputc(chunk->out, 0);
+	render_blocks(chunk->out, par->workers + worker, copy); }
+
+
+/* render_parallel • renders the blocks of text on nthreads threads */
+/*	the text is cut between top-level blocks into chunks rendered with
+ *	renders sharing the references of rndr, which are read-only */
+static void
+render_parallel(struct buf *ob, struct render *rndr, struct buf *text,
+							int nthreads) {
+	struct parallel par;
+	size_t cut, html = 0, retry = 0;
+	int i, nb;
+
+	/* cutting the text into roughly equal chunks */
+	nb = nthreads * CHUNKS_PER_THREAD;
+	if ((size_t)nb > text->size / PARALLEL_UNIT)
+		nb = text->size / PARALLEL_UNIT;
+	par.chunks = nb > 1 ? malloc(nb * sizeof *par.chunks) : 0;
+	if (!par.chunks) {
+		render_blocks(ob, rndr, text);
+		return; }
+	par.nb = 0;
+	cut = 0;
+	while (par.nb < nb && cut < text->size) {
+		par.chunks[par.nb].beg = cut;
+		if (par.nb + 1 < nb)
+			cut = next_cut(rndr, text, text->size / nb
+				* (par.nb + 1), &html, &retry);
+		if (par.nb + 1 >= nb || cut >= text->size) cut = text->size;
+		par.chunks[par.nb].end = cut;
+		par.chunks[par.nb].out = 0;
+		par.chunks[par.nb].pad = par.nb > 0 || ob->size > 0;
+		par.nb += 1; }
+	par.threads = nthreads;
+	if (nthreads > par.nb) nthreads = par.nb;
+
+	/* one render per thread, sharing the references */
+	par.text = text;
+	par.workers = par.nb > 1 ? new_workers(rndr, nthreads) : 0;
+	par.copies = malloc(nthreads * sizeof *par.copies);
+	if (!par.workers || !par.copies) {
+		render_blocks(ob, rndr, text);
+		if (par.workers) free_workers(par.workers, nthreads);
+		free(par.copies);
+		free(par.chunks);
+		return; }
+	for (i = 0; i < nthreads; i += 1)
+		par.copies[i] = bufnew(TEXT_UNIT);
+	run_pool(nthreads, par.nb, render_part, &par);
+
+	/* concatenating the outputs, a chunk being rendered here when it was
+	 * left by the jobs or when the output before it is empty */
+	for (i = 0; i < par.nb; i += 1) {
+		if (!par.chunks[i].out || (par.chunks[i].pad && !ob->size))
+			parse_block(ob, rndr, text->data + par.chunks[i].beg,
+				par.chunks[i].end - par.chunks[i].beg);
+		else
+			bufput(ob, par.chunks[i].out->data + par.chunks[i].pad,
+				par.chunks[i].out->size - par.chunks[i].pad);
+		bufrelease(par.chunks[i].out); }
+
+	/* clean-up */
+	for (i = 0; i < nthreads; i += 1)
+		bufrelease(par.copies[i]);
+	free_workers(par.workers, nthreads);
+	free(par.copies);
+	free(par.chunks); }
+
+
+
+/* clear_ref_table • empties a reference table, keeping its memory */
+static void
+clear_ref_table(struct ref_table *refs) {
+	if (refs->indexed)
+		memset(refs->slot, 0, (refs->mask + 1) * sizeof *refs->slot);
+	refs->refs.size = 0;
+	refs->pool->size = 0;
+	refs->indexed = 0; }
+
+
+/* wall_ms • wall-clock time in ms, for batch timings */
+static double
+wall_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0; }
+
+
+/* render_doc • two-pass render of ib, reusing rndr and text */
+static void
+render_doc(struct buf *ob, struct render *rndr, struct buf *text,
+						const struct buf *ib) {
+	size_t beg = 0;
+
+	if (rndr->make.parser_flags & MKD_SINGLE_PASS) {
+		markdown(ob, (struct buf *)ib, &rndr->make);
+		return; }
+	clear_ref_table(&rndr->refs);
+	text->size = 0;
+	while (beg < ib->size)
+		beg = normalize_line(text, ib, beg, &rndr->refs);
+	if (rndr->refs.refs.size)
+		index_ref_table(&rndr->refs);
+	end_text(text);
+	if (rndr->make.prolog)
+		rndr->make.prolog(ob, rndr->make.opaque);
+	render_blocks(ob, rndr, text);
+	if (rndr->make.epilog)
+		rndr->make.epilog(ob, rndr->make.opaque); }
+
+
+/* batch_part • renders consecutive documents, as a job of the pool */
+static void
+batch_part(void *ctx, int worker, int job) {
+	struct batch *bt = ctx;
+	size_t i;
+	double start = 0;
+
+	for (i = bt->first[job]; i < bt->first[job + 1]; i += 1) {
+		if (!bt->outs[i] || !bt->ins[i]) continue;
+		if (bt->ms) start = wall_ms();
+		render_doc(bt->outs[i], bt->workers + worker,
+					bt->texts[worker], bt->ins[i]);
+		if (bt->ms) bt->ms[i] = wall_ms() - start; } }
+
+
+
+/****************
+ * SYNTAX TREES *
+ ****************/
+
+/* the recording renderer mirrors the profile of the renderer it is built
+ * for, each callback appending a node and writing its number into ob, so
+ * that the output buffers of the parser hold the children of a node */
+
+static void
+rec_blockcode(struct buf *ob, struct buf *text, void *opaque) {
+	struct ast_build *b = opaque;
+	ast_buf(b, ast_node(ob, b, AST_BLOCKCODE, 0), text); }
+
+static void
+rec_blockquote(struct buf *ob, struct buf *text, void *opaque) {
+	struct ast_build *b = opaque;
+	ast_kids(b, ast_node(ob, b, AST_BLOCKQUOTE, 0), text); }
+
+static void
+rec_blockhtml(struct buf *ob, struct buf *text, void *opaque) {
+	struct ast_build *b = opaque;
+	ast_buf(b, ast_node(ob, b, AST_BLOCKHTML, 0), text); }
+
+static void
+rec_header(struct buf *ob, struct buf *text, int level, void *opaque) {
+	struct ast_build *b = opaque;
+	ast_kids(b, ast_node(ob, b, AST_HEADER, level), text); }
+
+static void
+rec_hrule(struct buf *ob, void *opaque) {
+	ast_node(ob, opaque, AST_HRULE, 0); }
+
+static void
+rec_list(struct buf *ob, struct buf *text, int flags, void *opaque) {
+	struct ast_build *b = opaque;
+	ast_kids(b, ast_node(ob, b, AST_LIST, flags), text); }
+
+static void
+rec_listitem(struct buf *ob, struct buf *text, int flags, void *opaque) {
+	struct ast_build *b = opaque;
+	ast_kids(b, ast_node(ob, b, AST_LISTITEM, flags), text); }
+
+static void
+rec_paragraph(struct buf *ob, struct buf *text, void *opaque) {
+	struct ast_build *b = opaque;
+	ast_kids(b, ast_node(ob, b, AST_PARAGRAPH, 0), text); }
+
+static void
+rec_table(struct buf *ob, struct buf *head_row, struct buf *rows,
+							void *opaque) {
+	struct ast_build *b = opaque;
+	struct ast_node *node;
+	int n = ast_node(ob, b, AST_TABLE, -1);
+	if (n < 0) return;
+	if (head_row) {
+		node = arr_item(&b->ast->nodes, n);
+		node->flags = ast_kids(b, n, head_row); }
+	ast_kids(b, n, rows); }
+
+/* rec_table_begin • streaming tables are recorded when they end */
+/*	so that the parser uses the same work buffers as when rendering */
+static void
+rec_table_begin(struct buf *ob, struct buf *head_row, void *opaque) {
+	struct ast_build *b = opaque;
+	b->table_mark = ob->size; }
+
+static void
+rec_table_end(struct buf *ob, struct buf *head_row, void *opaque) {
+	struct ast_build *b = opaque;
+	b->scratch->size = 0;
+	bufput(b->scratch, ob->data + b->table_mark, ob->size - b->table_mark);
+	ob->size = b->table_mark;
+	rec_table(ob, head_row, b->scratch, opaque); }
+
+static void
+rec_table_cell(struct buf *ob, struct buf *text, int flags, void *opaque) {
+	struct ast_build *b = opaque;
+	int n = ast_node(ob, b, AST_TABLE_CELL, flags);
+	if (flags & MKD_CELL_RAW) ast_buf(b, n, text);
+	else ast_kids(b, n, text); }
+
+static void
+rec_table_row(struct buf *ob, struct buf *cells, int flags, void *opaque) {
+	struct ast_build *b = opaque;
+	ast_kids(b, ast_node(ob, b, AST_TABLE_ROW, flags), cells); }
+
+
+/* span callbacks accept or refuse a span like the mirrored renderer, whose
+ * output is dropped, given the node numbers instead of rendered content */
+
+static int
+rec_autolink(struct buf *ob, struct buf *link, enum mkd_autolink type,
+							void *opaque) {
+	struct ast_build *b = opaque;
+	b->scratch->size = 0;
+	if (!b->make->autolink(b->scratch, link, type, b->make->opaque))
+		return 0;
+	ast_buf(b, ast_node(ob, b, AST_AUTOLINK, type), link);
+	return 1; }
+
+static int
+rec_codespan(struct buf *ob, struct buf *text, void *opaque) {
+	struct ast_build *b = opaque;
+	b->scratch->size = 0;
+	if (!b->make->codespan(b->scratch, text, b->make->opaque)) return 0;
+	ast_buf(b, ast_node(ob, b, AST_CODESPAN, 0), text);
+	return 1; }
+
+static int
+rec_double_emphasis(struct buf *ob, struct buf *text, char c, void *opaque) {
+	struct ast_build *b = opaque;
+	b->scratch->size = 0;
+	if (!b->make->double_emphasis(b->scratch, text, c, b->make->opaque))
+		return 0;
+	ast_kids(b, ast_node(ob, b, AST_DOUBLE_EMPHASIS, c), text);
+	return 1; }
+
+static int
+rec_emphasis(struct buf *ob, struct buf *text, char c, void *opaque) {
+	struct ast_build *b = opaque;
+	b->scratch->size = 0;
+	if (!b->make->emphasis(b->scratch, text, c, b->make->opaque))
+		return 0;
+	ast_kids(b, ast_node(ob, b, AST_EMPHASIS, c), text);
+	return 1; }
+
+static int
+rec_image(struct buf *ob, struct buf *link, struct buf *title,
+					struct buf *alt, void *opaque) {
+	struct ast_build *b = opaque;
+	int n;
+	b->scratch->size = 0;
+	if (!b->make->image(b->scratch, link, title, alt, b->make->opaque))
+		return 0;
+	n = ast_node(ob, b, AST_IMAGE, 0);
+	ast_buf(b, n, link);
+	ast_buf(b, n, title);
+	ast_buf(b, n, alt);
+	return 1; }
+
+static int
+rec_linebreak(struct buf *ob, void *opaque) {
+	struct ast_build *b = opaque;
+	b->scratch->size = 0;
+	if (!b->make->linebreak(b->scratch, b->make->opaque)) return 0;
+	ast_node(ob, b, AST_LINEBREAK, 0);
+	return 1; }
+
+static int
+rec_link(struct buf *ob, struct buf *link, struct buf *title,
+					struct buf *content, void *opaque) {
+	struct ast_build *b = opaque;
+	int n;
+	b->scratch->size = 0;
+	if (!b->make->link(b->scratch, link, title, content, b->make->opaque))
+		return 0;
+	n = ast_node(ob, b, AST_LINK, 0);
+	ast_buf(b, n, link);
+	ast_buf(b, n, title);
+	ast_kids(b, n, content);
+	return 1; }
+
+static int
+rec_raw_html_tag(struct buf *ob, struct buf *tag, void *opaque) {
+	struct ast_build *b = opaque;
+	b->scratch->size = 0;
+	if (!b->make->raw_html_tag(b->scratch, tag, b->make->opaque))
+		return 0;
+	ast_buf(b, ast_node(ob, b, AST_RAW_HTML_TAG, 0), tag);
+	return 1; }
+
+static int
+rec_triple_emphasis(struct buf *ob, struct buf *text, char c, void *opaque) {
+	struct ast_build *b = opaque;
+	b->scratch->size = 0;
+	if (!b->make->triple_emphasis(b->scratch, text, c, b->make->opaque))
+		return 0;
+	ast_kids(b, ast_node(ob, b, AST_TRIPLE_EMPHASIS, c), text);
+	return 1; }
+
+static void
+rec_entity(struct buf *ob, struct buf *entity, void *opaque) {
+	struct ast_build *b = opaque;
+	ast_buf(b, ast_node(ob, b, AST_ENTITY, 0), entity); }
+
+static void
+rec_normal_text(struct buf *ob, struct buf *text, void *opaque) {
+	struct ast_build *b = opaque;
+	if (text && text->size)
+		ast_buf(b, ast_node(ob, b, AST_NORMAL_TEXT, 0), text); }
+
+
+/* ast_recorder • fills the recording renderer of a syntax tree build */
+/*	entities and text are always recorded, their absence not changing
+ *	the parse, and streaming or not is chosen again when replaying */
+static void
+ast_recorder(struct mkd_renderer *rec, struct ast_build *b) {
+	const struct mkd_renderer *make = b->make;
+
+	*rec = *make;
+	rec->prolog = rec->epilog = 0;
+	rec->blockcode = (make->blockcode || make->blockcode_lines)
+						? rec_blockcode : 0;
+	rec->blockquote = make->blockquote ? rec_blockquote : 0;
+	rec->blockhtml = make->blockhtml ? rec_blockhtml : 0;
+	rec->header = make->header ? rec_header : 0;
+	rec->hrule = make->hrule ? rec_hrule : 0;
+	rec->list = make->list ? rec_list : 0;
+	rec->listitem = make->listitem ? rec_listitem : 0;
+	rec->paragraph = make->paragraph ? rec_paragraph : 0;
+	rec->table = make->table ? rec_table : 0;
+	rec->table_cell = make->table_cell ? rec_table_cell : 0;
+	rec->table_row = make->table_row ? rec_table_row : 0;
+	rec->autolink = make->autolink ? rec_autolink : 0;
+	rec->codespan = make->codespan ? rec_codespan : 0;
+	rec->double_emphasis = make->double_emphasis ? rec_double_emphasis : 0;
+	rec->emphasis = make->emphasis ? rec_emphasis : 0;
+	rec->image = make->image ? rec_image : 0;
+	rec->linebreak = make->linebreak ? rec_linebreak : 0;
+	rec->link = make->link ? rec_link : 0;
+	rec->raw_html_tag = make->raw_html_tag ? rec_raw_html_tag : 0;
+	rec->triple_emphasis = make->triple_emphasis ? rec_triple_emphasis : 0;
+	rec->entity = rec_entity;
+	rec->normal_text = rec_normal_text;
+	rec->opaque = b;
+	rec->table_begin = rec->table_end = 0;
+	if (make->table_begin && make->table_end) {
+		rec->table_begin = rec_table_begin;
+		rec->table_end = rec_table_end; }
+	rec->blockcode_lines = 0;
+	rec->parser_flags = 0; }
+
+
+/* ast_view • read-only buffer of the span n, NULL for a NULL buffer */
+static struct buf *
+ast_view(struct buf *view, const struct mkd_ast *ast, uint32_t n) {
+	const struct ast_span *sp = (const struct ast_span *)ast->spans.base + n;
+	if (sp->off == AST_NULL) return 0;
+	view->data = ast->text->data + sp->off;
+	view->size = sp->size;
+	view->asize = view->unit = 0;
+	view->ref = 0;
+	return view; }
+
+
+/* put_text • renders text as normal text */
+static void
+put_text(struct buf *ob, const struct mkd_renderer *rndr, struct buf *text) {
+	if (!text || !text->size) return;
+	if (rndr->normal_text) rndr->normal_text(ob, text, rndr->opaque);
+	else bufput(ob, text->data, text->size); }
+
+
+/* replay_blockcode • renders a code block, as a list of lines if needed */
+/*	the lines are split like parse_blockcode_lines does */
+static void
+replay_blockcode(struct buf *ob, const struct mkd_renderer *rndr,
+				struct buf *text, struct array *lines) {
+	static char newline[] = "\n";
+	struct buf *line;
+	size_t beg = 0, end;
+
+	if (!rndr->blockcode_lines) {
+		if (rndr->blockcode) rndr->blockcode(ob, text, rndr->opaque);
+		return; }
+	lines->size = 0;
+	while (text && beg < text->size) {
+		for (end = beg + 1; end < text->size
+		&& text->data[end - 1] != '\n'; end += 1);
+		if (end >= text->size && text->data[end - 1] == '\n')
+			end -= 1;
+		if (end > beg
+		&& (line = arr_item(lines, arr_newitem(lines))) != 0) {
+			line->data = text->data + beg;
+			line->size = end - beg;
+			line->asize = line->unit = 0;
+			line->ref = 0; }
+		if (end + 1 == text->size) break;
+		beg = end; }
+	if ((line = arr_item(lines, arr_newitem(lines))) != 0) {
+		line->data = newline;
+		line->size = 1;
+		line->asize = line->unit = 0;
+		line->ref = 0; }
+	rndr->blockcode_lines(ob, lines->base, lines->size, rndr->opaque); }
+
+
+/* replay_leaf • renders a node without children */
+static void
+replay_leaf(struct buf *ob, const struct mkd_ast *ast,
+		const struct mkd_renderer *rndr, const struct ast_node *node,
+		struct array *lines) {
+	struct buf v0, v1, v2, *b0 = 0, *b1 = 0, *b2 = 0;
+	void *opaque = rndr->opaque;
+
+	if (node->nb_spans > 0) b0 = ast_view(&v0, ast, node->spans);
+	if (node->nb_spans > 1) b1 = ast_view(&v1, ast, node->spans + 1);
+	if (node->nb_spans > 2) b2 = ast_view(&v2, ast, node->spans + 2);
+	switch (node->type) {
+	    case AST_RAW:
+		if (b0) bufput(ob, b0->data, b0->size);
+		break;
+	    case AST_TRIM:
+		if (ob->size && ob->data[ob->size - 1] == node->flags)
+			ob->size -= 1;
+		break;
+	    case AST_BLOCKCODE:
+		replay_blockcode(ob, rndr, b0, lines);
+		break;
+	    case AST_BLOCKHTML:
+		if (rndr->blockhtml) rndr->blockhtml(ob, b0, opaque);
+		break;
+	    case AST_HRULE:
+		if (rndr->hrule) rndr->hrule(ob, opaque);
+		break;
+	    case AST_AUTOLINK:
+		if (!rndr->autolink
+		|| !rndr->autolink(ob, b0, node->flags, opaque))
+			put_text(ob, rndr, b0);
+		break;
+	    case AST_CODESPAN:
+		if (!rndr->codespan || !rndr->codespan(ob, b0, opaque))
+			put_text(ob, rndr, b0);
+		break;
+	    case AST_IMAGE:
+		if (!rndr->image || !rndr->image(ob, b0, b1, b2, opaque))
+			put_text(ob, rndr, b2);
+		break;
+	    case AST_LINEBREAK:
+		if (!rndr->linebreak || !rndr->linebreak(ob, opaque)) {
+			v0.data = "\n";
+			v0.size = 1;
+			put_text(ob, rndr, &v0); }
+		break;
+	    case AST_RAW_HTML_TAG:
+		if (!rndr->raw_html_tag || !rndr->raw_html_tag(ob, b0, opaque))
+			put_text(ob, rndr, b0);
+		break;
+	    case AST_ENTITY:
+		if (rndr->entity) rndr->entity(ob, b0, opaque);
+		else if (b0) bufput(ob, b0->data, b0->size);
+		break;
+	    case AST_NORMAL_TEXT:
+		put_text(ob, rndr, b0);
+		break; } }
+
+
+/* replay_close • renders a node once its children are rendered */
+/*	refused spans are replaced by their content */
+static void
+replay_close(const struct mkd_ast *ast, const struct mkd_renderer *rndr,
+			const struct ast_node *node, struct ast_frame *f) {
+	struct buf v0, v1, *b0 = 0, *b1 = 0;
+	struct buf *ob = f->ob, *work = f->work;
+	void *opaque = rndr->opaque;
+	int r = 1;
+
+	if (node->nb_spans > 0) b0 = ast_view(&v0, ast, node->spans);
+	if (node->nb_spans > 1) b1 = ast_view(&v1, ast, node->spans + 1);
+	switch (node->type) {
+	    case AST_BLOCKQUOTE:
+		if (rndr->blockquote) rndr->blockquote(ob, work, opaque);
+		break;
+	    case AST_HEADER:
+		if (rndr->header)
+			rndr->header(ob, work, node->flags, opaque);
+		break;
+	    case AST_LIST:
+		if (rndr->list) rndr->list(ob, work, node->flags, opaque);
+		break;
+	    case AST_LISTITEM:
+		if (rndr->listitem)
+			rndr->listitem(ob, work, node->flags, opaque);
+		break;
+	    case AST_PARAGRAPH:
+		if (rndr->paragraph) rndr->paragraph(ob, work, opaque);
+		break;
+	    case AST_TABLE:
+		if (rndr->table_begin && rndr->table_end) {
+			if (node->nb_kids <= (node->flags < 0 ? 0 : node->flags))
+				rndr->table_begin(ob, f->head, opaque);
+			rndr->table_end(ob, f->head, opaque); }
+		else if (rndr->table)
+			rndr->table(ob, f->head, work, opaque);
+		break;
+	    case AST_TABLE_CELL:
+		if (!rndr->table_cell) break;
+		if (!(node->flags & MKD_CELL_RAW))
+			rndr->table_cell(ob, work, node->flags, opaque);
+		else if (rndr->table_begin && rndr->table_end)
+			rndr->table_cell(ob, b0, node->flags, opaque);
+		else {
+			/* raw text is as parsed when without active char */
+			put_text(work, rndr, b0);
+			rndr->table_cell(ob, work,
+				node->flags & ~MKD_CELL_RAW, opaque); }
+		break;
+	    case AST_TABLE_ROW:
+		if (rndr->table_row)
+			rndr->table_row(ob, work, node->flags, opaque);
+		break;
+	    case AST_DOUBLE_EMPHASIS:
+		r = rndr->double_emphasis
+		 && rndr->double_emphasis(ob, work, node->flags, opaque);
+		break;
+	    case AST_EMPHASIS:
+		r = rndr->emphasis
+		 && rndr->emphasis(ob, work, node->flags, opaque);
+		break;
+	    case AST_LINK:
+		r = rndr->link && rndr->link(ob, b0, b1, work, opaque);
+		break;
+	    case AST_TRIPLE_EMPHASIS:
+		r = rndr->triple_emphasis
+		 && rndr->triple_emphasis(ob, work, node->flags, opaque);
+		break; }
+	if (!r) bufput(ob, work->data, work->size); }
+
+
+/* has_kids • whether a node type has children, rendered before it */
+static int
+has_kids(int type) {
+	return type == AST_BLOCKQUOTE || type == AST_HEADER
+	    || type == AST_LIST || type == AST_LISTITEM
+	    || type == AST_PARAGRAPH || type == AST_TABLE
+	    || type == AST_TABLE_CELL || type == AST_TABLE_ROW
+	    || type == AST_DOUBLE_EMPHASIS || type == AST_EMPHASIS
+	    || type == AST_LINK || type == AST_TRIPLE_EMPHASIS; }
+
+
+/* depth_buffer • reusable output buffer, two per depth of the tree */
+static struct buf *
+depth_buffer(struct parray *bufs, int n) {
+	struct buf *buf;
+	while (bufs->size <= n) {
+		if ((buf = bufnew(WORK_UNIT)) == 0) return 0;
+		if (!parr_push(bufs, buf)) {
+			bufrelease(buf);
+			return 0; } }
+	buf = bufs->item[n];
+	buf->size = 0;
+	return buf; }
+
+
+/* ast_arity • number of buffer arguments recorded for a node */
+static uint32_t
+ast_arity(const struct ast_node *node) {
+	switch (node->type) {
+	    case AST_RAW: case AST_BLOCKCODE: case AST_BLOCKHTML:
+	    case AST_AUTOLINK: case AST_CODESPAN: case AST_RAW_HTML_TAG:
+	    case AST_ENTITY: case AST_NORMAL_TEXT:
+		return 1;
+	    case AST_LINK:
+		return 2;
+	    case AST_IMAGE:
+		return 3;
+	    case AST_TABLE_CELL:
+		return (node->flags & MKD_CELL_RAW) ? 1 : 0;
+	    default:
+		return 0; } }
+
+
+/* check_ast • whether a loaded syntax tree can be replayed safely */
+/*	children come before their parent and have a single one, as when
+ *	recorded, so that the replay is bounded by the size of the tree */
+static int
+check_ast(const struct mkd_ast *ast) {
+	const struct ast_node *nodes = ast->nodes.base, *node;
+	const struct ast_span *spans = ast->spans.base;
+	const uint32_t *kids = ast->kids.base;
+	unsigned char *seen;
+	uint32_t i, j, k;
+	int ok = 1;
+
+	for (i = 0; i < (uint32_t)ast->spans.size; i += 1)
+		if (spans[i].off != AST_NULL
+		&& (spans[i].off > ast->text->size
+		 || spans[i].size > ast->text->size - spans[i].off))
+			return 0;
+	if (ast->root > (uint32_t)ast->kids.size
+	|| ast->nb_root > ast->kids.size - ast->root)
+		return 0;
+	seen = calloc(ast->nodes.size / 8 + 1, 1);
+	if (!seen) return 0;
+	for (i = 0; ok && i <= (uint32_t)ast->nodes.size; i += 1) {
+		if (i < (uint32_t)ast->nodes.size) {
+			node = nodes + i;
+			if (node->type > AST_NORMAL_TEXT
+			|| node->nb_spans != ast_arity(node)
+			|| node->spans > (uint32_t)ast->spans.size
+			|| node->nb_spans > ast->spans.size - node->spans
+			|| node->kids > (uint32_t)ast->kids.size
+			|| node->nb_kids > ast->kids.size - node->kids) {
+				ok = 0;
+				break; }
+			/* only a code span can be NULL */
+			for (j = 0; j < node->nb_spans; j += 1)
+				if (spans[node->spans + j].off == AST_NULL
+				&& node->type != AST_CODESPAN)
+					ok = 0;
+			j = node->kids;
+			k = node->kids + node->nb_kids; }
+		else {
+			/* top-level nodes, any node being before them */
+			j = ast->root;
+			k = ast->root + ast->nb_root; }
+		for (; ok && j < k; j += 1) {
+			if (kids[j] >= i
+			|| (seen[kids[j] / 8] & (1 << kids[j] % 8)))
+				ok = 0;
+			else seen[kids[j] / 8] |= 1 << kids[j] % 8; } }
+	free(seen);
+	return ok; }
+
+
+/* replay_push • stacks a node whose children are to be rendered */
+static int
+replay_push(struct array *frames, struct parray *bufs,
+			const struct ast_node *node, uint32_t no, struct buf *ob) {
+	struct ast_frame *f;
+	int n = arr_newitem(frames);
+
+	if (n < 0) return 0;
+	f = arr_item(frames, n);
+	f->node = no;
+	f->next = 0;
+	f->ob = ob;
+	f->work = depth_buffer(bufs, 2 * n);
+	f->head = 0;
+	if (node->type == AST_TABLE && node->flags >= 0)
+		f->head = depth_buffer(bufs, 2 * n + 1);
+	if (!f->work || (node->type == AST_TABLE && node->flags >= 0
+							&& !f->head)) {
+		frames->size -= 1;
+		return 0; }
+	return 1; }
+
+
+/* replay • renders the nodes of a syntax tree into ob */
+/*	nested nodes are stacked instead of recursing, like in the parser */
+static void
+replay(struct buf *ob, const struct mkd_ast *ast,
+				const struct mkd_renderer *rndr) {
+	const struct ast_node *nodes = ast->nodes.base, *node;
+	const uint32_t *kids = ast->kids.base;
+	struct array frames, lines;
+	struct parray bufs;
+	struct ast_frame *f;
+	struct buf *target;
+	uint32_t i, k, head;
+	int n, stream = (rndr->table_begin && rndr->table_end);
+
+	arr_init(&frames, sizeof (struct ast_frame));
+	arr_init(&lines, sizeof (struct buf));
+	parr_init(&bufs);
+	for (i = 0; i < ast->nb_root; i += 1) {
+		k = kids[ast->root + i];
+		if (!has_kids(nodes[k].type))
+			replay_leaf(ob, ast, rndr, nodes + k, &lines);
+		else if (replay_push(&frames, &bufs, nodes + k, k, ob))
+		    while ((n = frames.size - 1) >= 0) {
+			f = arr_item(&frames, n);
+			node = nodes + f->node;
+			if (f->next >= node->nb_kids) {
+				replay_close(ast, rndr, node, f);
+				frames.size -= 1;
+				continue; }
+
+			/* the header row of a table has its own output */
+			target = f->work;
+			if (node->type == AST_TABLE) {
+				head = node->flags < 0 ? 0 : node->flags;
+				if (f->next < head) target = f->head;
+				else if (stream) {
+					if (f->next == head)
+						rndr->table_begin(f->ob,
+						    f->head, rndr->opaque);
+					target = f->ob; } }
+
+			/* rendering the next child */
+			k = kids[node->kids + f->next];
+			f->next += 1;
+			if (!has_kids(nodes[k].type))
+				replay_leaf(target, ast, rndr, nodes + k,
+								&lines);
+			else replay_push(&frames, &bufs, nodes + k, k,
+								target); } }
+	arr_free(&frames);
+	arr_free(&lines);
+	for (n = 0; n < bufs.size; n += 1)
+		bufrelease(bufs.item[n]);
+	parr_free(&bufs); }
+
+
+
+/*************************
+ * INCREMENTAL RENDERING *
+ *************************/
+
+/* normalize_lines • normalizes the lines of ib from beg up to end */
+/*	keeping their starts in ed->lines; returns the first line left */
+static size_t
+normalize_lines(struct mkd_edit *ed, const struct buf *ib, size_t beg,
+				size_t end, struct ref_table *refs) {
+	struct edit_line *line;
+	while (beg < end) {
+		line = arr_item(&ed->lines, arr_newitem(&ed->lines));
+		if (line) {
+			line->in = beg;
+			line->text = ed->text->size; }
+		beg = normalize_line(ed->text, ib, beg, refs); }
+	return beg; }
+
+
+/* cut_chunks • cuts ed->text up to end into chunks of EDIT_UNIT bytes */
+/*	the chunk starts are put in ed->cuts, the first one being at in */
+static void
+cut_chunks(struct mkd_edit *ed, size_t in, size_t end) {
+	struct edit_line *lines = ed->lines.base, *cut;
+	size_t at = 0, html = 0, retry = 0;
+	int lo = 0, hi, mid;
+
+	ed->cuts.size = 0;
+	do {	/* cuts are at line starts, after the references there */
+		hi = ed->lines.size;
+		while (hi - lo > 1) {
+			mid = lo + (hi - lo) / 2;
+			if (lines[mid].text <= at) lo = mid;
+			else hi = mid; }
+		if ((at == 0 || (lo < ed->lines.size && lines[lo].text == at))
+		&& (cut = arr_item(&ed->cuts, arr_newitem(&ed->cuts))) != 0) {
+			cut->in = at ? lines[lo].in : in;
+			cut->text = at; }
+		at = next_cut(&ed->rndr, ed->text, at + EDIT_UNIT,
+							&html, &retry);
+	} while (at < end); }
+
+
+/* edit_render • renders the whole input again into ob, after base */
+static void
+edit_render(struct mkd_edit *ed) {
+	struct render *rndr = &ed->rndr;
+	struct edit_line *cut;
+	struct edit_chunk *chunk;
+	size_t end;
+	int i;
+
+	/* first pass, keeping the line starts */
+	ed->ob->size = ed->base;
+	clear_ref_table(&rndr->refs);
+	ed->text->size = 0;
+	ed->lines.size = 0;
+	normalize_lines(ed, ed->in, 0, ed->in->size, &rndr->refs);
+	if (rndr->refs.refs.size)
+		index_ref_table(&rndr->refs);
+	end_text(ed->text);
+
+	/* second pass, one chunk after the other */
+	cut_chunks(ed, 0, ed->text->size);
+	cut = ed->cuts.base;
+	ed->chunks.size = 0;
+	if (rndr->make.prolog)
+		rndr->make.prolog(ed->ob, rndr->make.opaque);
+	for (i = 0; i < ed->cuts.size; i += 1) {
+		end = i + 1 < ed->cuts.size ? cut[i + 1].text : ed->text->size;
+		chunk = arr_item(&ed->chunks, arr_newitem(&ed->chunks));
+		if (chunk) {
+			chunk->in = cut[i].in;
+			chunk->out = ed->ob->size; }
+		parse_block(ed->ob, rndr, ed->text->data + cut[i].text,
+						end - cut[i].text); }
+	ed->end = ed->ob->size;
+	if (rndr->make.epilog)
+		rndr->make.epilog(ed->ob, rndr->make.opaque); }
+
+
+/* same_refs • whether two reference tables hold the same definitions */
+static int
+same_refs(const struct ref_table *a, const struct ref_table *b) {
+	const struct link_ref *x = a->refs.base, *y = b->refs.base;
+	const char *pa = a->pool->data, *pb = b->pool->data;
+	int i;
+
+	if (a->refs.size != b->refs.size) return 0;
+	for (i = 0; i < a->refs.size; i += 1)
+		if (x[i].id_size != y[i].id_size
+		||  x[i].link_size != y[i].link_size
+		||  x[i].title_size != y[i].title_size
+		||  memcmp(pa + x[i].id, pb + y[i].id, x[i].id_size)
+		||  memcmp(pa + x[i].link, pb + y[i].link, x[i].link_size)
+		||  memcmp(pa + x[i].title, pb + y[i].title, x[i].title_size))
+			return 0;
+	return 1; }
+
+
+/* splice_buf • replaces the bytes of buf from beg to end with data */
+static int
+splice_buf(struct buf *buf, size_t beg, size_t end,
+				const char *data, size_t size) {
+	if (size > end - beg
+	&& !bufgrow(buf, buf->size + (size - (end - beg))))
+		return 0;
+	memmove(buf->data + beg + size, buf->data + end, buf->size - end);
+	if (size) memcpy(buf->data + beg, data, size);
+	buf->size = buf->size - (end - beg) + size;
+	return 1; }
+
+
+/* edit_chunks • renders again the chunks around an edit of the input */
+/*	from the chunk before the edit up to the first chunk after it
+ *	whose text is unchanged and can still be cut from the text before;
+ *	returns 0 when the whole input has to be rendered again */
+static int
+edit_chunks(struct mkd_edit *ed, const struct buf *ib, size_t beg,
+		size_t old_end, size_t new_end, struct mkd_range *changed) {
+	struct render *rndr = &ed->rndr;
+	struct edit_chunk *chunk = ed->chunks.base;
+	struct edit_line *cut;
+	size_t pos, target, end = 0, html = 0, retry = 0, old_in, old_out;
+	size_t out_beg, pad;
+	int s, k, i, nb = ed->chunks.size, nb_new;
+
+	/* starting with the chunk before the edited one */
+	if (!nb) return 0;
+	s = 0;
+	while (s + 1 < nb && chunk[s + 1].in <= beg)
+		s += 1;
+	if (s > 0) s -= 1;
+
+	/* normalizing the new input up to the stopping chunk */
+	ed->text->size = 0;
+	ed->lines.size = 0;
+	clear_ref_table(&ed->new_refs);
+	pos = chunk[s].in;
+	for (k = s + 1; k < nb; k += 1) {
+		if (chunk[k].in < old_end) continue;
+		target = chunk[k].in - old_end + new_end;
+		pos = normalize_lines(ed, ib, pos, target, &ed->new_refs);
+		if (pos != target) continue;
+		/* the first line of the chunk, to look at */
+		end = ed->text->size;
+		pos = normalize_lines(ed, ib, pos, pos + 1, &ed->new_refs);
+		if (ed->text->size > end
+		&& next_cut(rndr, ed->text, end, &html, &retry) == end)
+			break; }
+	if (k >= nb) {
+		normalize_lines(ed, ib, pos, ib->size, &ed->new_refs);
+		end_text(ed->text);
+		end = ed->text->size; }
+	old_in = k < nb ? chunk[k].in : ed->in->size;
+	old_out = k < nb ? chunk[k].out : ed->end;
+
+	/* the replaced input must define the same references */
+	ed->old->size = 0;
+	clear_ref_table(&ed->old_refs);
+	for (pos = chunk[s].in; pos < old_in; )
+		pos = normalize_line(ed->old, ed->in, pos, &ed->old_refs);
+	if (!same_refs(&ed->old_refs, &ed->new_refs)) return 0;
+
+	/* making room for the new chunks */
+	cut_chunks(ed, chunk[s].in, end);
+	nb_new = ed->cuts.size;
+	if (!nb_new
+	|| (nb_new > k - s && !arr_insert(&ed->chunks, nb_new - (k - s), k)))
+		return 0;
+	chunk = ed->chunks.base;
+	if (nb_new < k - s) {
+		memmove(chunk + s + nb_new, chunk + k,
+					(nb - k) * sizeof *chunk);
+		ed->chunks.size -= k - s - nb_new; }
+
+	/* rendering them after a placeholder byte, for the renderers
+	 * looking at the output size, as render_parallel() does */
+	out_beg = chunk[s].out;
+	pad = out_beg > 0;
+	ed->out->size = 0;
+	if (pad) bufputc(ed->out, 0);
+	cut = ed->cuts.base;
+	for (i = 0; i < nb_new; i += 1) {
+		pos = i + 1 < nb_new ? cut[i + 1].text : end;
+		chunk[s + i].in = cut[i].in;
+		chunk[s + i].out = out_beg + ed->out->size - pad;
+		parse_block(ed->out, rndr, ed->text->data + cut[i].text,
+						pos - cut[i].text); }
+
+	/* with nothing before, the following chunk needs the same output */
+	if (!pad && k < nb && (old_out > 0) != (ed->out->size > 0))
+		return 0;
+
+	/* moving what follows */
+	for (i = s + nb_new; i < ed->chunks.size; i += 1) {
+		chunk[i].in = chunk[i].in - old_end + new_end;
+		chunk[i].out = chunk[i].out - old_out
+				+ out_beg + ed->out->size - pad; }
+	ed->end = ed->end - old_out + out_beg + ed->out->size - pad;
+	if (!splice_buf(ed->ob, out_beg, old_out,
+			ed->out->data + pad, ed->out->size - pad)
+	|| !splice_buf(ed->in, beg, old_end, ib->data + beg, new_end - beg))
+		return 0;
+	changed->beg = out_beg;
+	changed->old_end = old_out;
+	changed->new_end = out_beg + ed->out->size - pad;
+	return 1; }
+
+
+
+/****************
+ * RENDER CACHE *
+ ****************/
+
+/* hash_input • hash of a whole input, eight bytes at a time */
+static uint64_t
+hash_input(const char *data, size_t size) {
+	uint64_t h = 14695981039346656037ULL ^ size, w;
+	size_t i;
+
+	for (i = 0; i + 8 <= size; i += 8) {
+		memcpy(&w, data + i, 8);
+		h = (h ^ w) * 1099511628211ULL;
+		h ^= h >> 29; }
+	if (i < size) {
+		w = 0;
+		memcpy(&w, data + i, size - i);
+		h = (h ^ w) * 1099511628211ULL; }
+	/* final mix, spreading every input bit over both the low bits,
+	 * which select the hash chain, and the high ones, which select the
+	 * shard of a render cache */
+	h = (h ^ (h >> 33)) * 0xff51afd7ed558ccdULL;
+	h = (h ^ (h >> 33)) * 0xc4ceb9fe1a85ec53ULL;
+	return h ^ (h >> 33); }
+
+
+/* hash_field • mixes the bytes of a member of a renderer into a hash */
+static uint64_t
+hash_field(uint64_t h, const void *field, size_t size) {
+	return (h ^ hash_input(field, size)) * 1099511628211ULL; }
+
+
+/* renderer_hash • hash of the members of a renderer the output depends on */
+/*	callbacks and pointers are taken by value, and emphasis characters
+ *	by contents, so that a renderer can be copied or changed in place */
+static uint64_t
+renderer_hash(const struct mkd_renderer *rndr) {
+	uint64_t h = 0;
+	size_t emph = rndr->emph_chars ? strlen(rndr->emph_chars) + 1 : 0;
+
+	h = hash_field(h, &rndr->prolog, sizeof rndr->prolog);
+	h = hash_field(h, &rndr->epilog, sizeof rndr->epilog);
+	h = hash_field(h, &rndr->blockcode, sizeof rndr->blockcode);
+	h = hash_field(h, &rndr->blockquote, sizeof rndr->blockquote);
+	h = hash_field(h, &rndr->blockhtml, sizeof rndr->blockhtml);
+	h = hash_field(h, &rndr->header, sizeof rndr->header);
+	h = hash_field(h, &rndr->hrule, sizeof rndr->hrule);
+	h = hash_field(h, &rndr->list, sizeof rndr->list);
+	h = hash_field(h, &rndr->listitem, sizeof rndr->listitem);
+	h = hash_field(h, &rndr->paragraph, sizeof rndr->paragraph);
+	h = hash_field(h, &rndr->table, sizeof rndr->table);
+	h = hash_field(h, &rndr->table_cell, sizeof rndr->table_cell);
+	h = hash_field(h, &rndr->table_row, sizeof rndr->table_row);
+	h = hash_field(h, &rndr->autolink, sizeof rndr->autolink);
+	h = hash_field(h, &rndr->codespan, sizeof rndr->codespan);
+	h = hash_field(h, &rndr->double_emphasis,
+					sizeof rndr->double_emphasis);
+	h = hash_field(h, &rndr->emphasis, sizeof rndr->emphasis);
+	h = hash_field(h, &rndr->image, sizeof rndr->image);
+	h = hash_field(h, &rndr->linebreak, sizeof rndr->linebreak);
+	h = hash_field(h, &rndr->link, sizeof rndr->link);
+	h = hash_field(h, &rndr->raw_html_tag, sizeof rndr->raw_html_tag);
+	h = hash_field(h, &rndr->triple_emphasis,
+					sizeof rndr->triple_emphasis);
+	h = hash_field(h, &rndr->entity, sizeof rndr->entity);
+	h = hash_field(h, &rndr->normal_text, sizeof rndr->normal_text);
+	h = hash_field(h, &rndr->max_work_stack, sizeof rndr->max_work_stack);
+	h = hash_field(h, rndr->emph_chars ? rndr->emph_chars : "", emph);
+	h = hash_field(h, &rndr->opaque, sizeof rndr->opaque);
+	h = hash_field(h, &rndr->extra_block_tags,
+					sizeof rndr->extra_block_tags);
+	h = hash_field(h, &rndr->table_begin, sizeof rndr->table_begin);
+	h = hash_field(h, &rndr->table_end, sizeof rndr->table_end);
+	h = hash_field(h, &rndr->blockcode_lines,
+					sizeof rndr->blockcode_lines);
+	h = hash_field(h, &rndr->refdict, sizeof rndr->refdict);
+	return hash_field(h, &rndr->parser_flags, sizeof rndr->parser_flags); }
+
+
+/* cache_key_of • fills the key of a render, returning its shard */
+/*	rndr is the renderer_hash() of the renderer */
+static struct cache_shard *
+cache_key_of(struct cache_key *key, struct mkd_cache *cache,
+		const char *data, size_t size,
+		uint64_t rndr, enum cache_kind kind) {
+	key->hash = hash_input(data, size)
+				^ (uint64_t)kind * 0x9e3779b97f4a7c15ULL
+				^ rndr * 0xc2b2ae3d27d4eb4fULL;
+	key->data = data;
+	key->size = size;
+	key->rndr = rndr;
+	key->kind = kind;
+	return cache->shards + (key->hash >> 32) % CACHE_SHARDS; }
+
+
+/* cache_find • entry of the render with this key, or NULL */
+static struct cache_entry *
+cache_find(struct cache_shard *sh, const struct cache_key *key) {
+	struct cache_entry *e;
+
+	if (!sh->slot) return 0;
+	for (e = sh->slot[key->hash & sh->mask]; e; e = e->chain)
+		if (e->hash == key->hash && e->rndr == key->rndr
+		&& e->kind == key->kind && e->in->size == key->size
+		&& (!key->size || !memcmp(e->in->data, key->data, key->size)))
+			return e;
+	return 0; }
+
+
+/* cache_unlink • takes an entry out of the LRU list */
+static void
+cache_unlink(struct cache_shard *sh, struct cache_entry *e) {
+	if (e->newer) e->newer->older = e->older;
+	else sh->newest = e->older;
+	if (e->older) e->older->newer = e->newer;
+	else sh->oldest = e->newer; }
+
+
+/* cache_link • puts an entry at the head of the LRU list */
+static void
+cache_link(struct cache_shard *sh, struct cache_entry *e) {
+	e->newer = 0;
+	e->older = sh->newest;
+	if (sh->newest) sh->newest->newer = e;
+	else sh->oldest = e;
+	sh->newest = e; }
+
+
+/* cache_entry_size • bytes accounted for an entry */
+static size_t
+cache_entry_size(const struct cache_entry *e) {
+	return sizeof *e + e->in->asize + e->out->asize
+				+ (e->uses ? e->uses->asize : 0); }
+
+
+/* cache_size • bytes used by all the shards, after a change of add - sub */
+static size_t
+cache_size(struct mkd_cache *cache, size_t add, size_t sub) {
+	size_t size;
+
+	pthread_mutex_lock(&cache->size_lock);
+	cache->size = cache->size + add - sub;
+	size = cache->size;
+	pthread_mutex_unlock(&cache->size_lock);
+	return size; }
+
+
+/* cache_drop • removes an entry, releasing its share of the render */
+static void
+cache_drop(struct mkd_cache *cache, struct cache_shard *sh,
+						struct cache_entry *e) {
+	struct cache_entry **p = sh->slot + (e->hash & sh->mask);
+	size_t size = cache_entry_size(e);
+
+	while (*p != e) p = &(*p)->chain;
+	*p = e->chain;
+	cache_unlink(sh, e);
+	sh->nb -= 1;
+	sh->size -= size;
+	cache_size(cache, 0, size);
+	bufrelease(e->in);
+	bufrelease(e->uses);
+	pthread_mutex_lock(&cache->ref_lock);
+	bufrelease(e->out);
+	pthread_mutex_unlock(&cache->ref_lock);
+	free(e); }
+
+
+/* cache_grow • doubles the number of hash chains of a shard */
+static int
+cache_grow(struct cache_shard *sh) {
+	struct cache_entry **neo, *e, *next;
+	size_t i, mask = sh->mask ? sh->mask * 2 + 1 : 15;
+
+	neo = calloc(mask + 1, sizeof *neo);
+	if (!neo) return 0;
+	for (i = 0; sh->slot && i <= sh->mask; i += 1)
+		for (e = sh->slot[i]; e; e = next) {
+			next = e->chain;
+			e->chain = neo[e->hash & mask];
+			neo[e->hash & mask] = e; }
+	free(sh->slot);
+	sh->slot = neo;
+	sh->mask = mask;
+	return 1; }
+
+
+/* cache_evict • drops the oldest entries of other shards over the limit */
+/*	called with the lock of sh, other shards are skipped while locked
+ *	rather than waited for, as their holders may be waiting for sh */
+static void
+cache_evict(struct mkd_cache *cache, struct cache_shard *sh, size_t size) {
+	struct cache_shard *other;
+	int i;
+
+	for (i = 1; i < CACHE_SHARDS && size > cache->max_size; i += 1) {
+		other = cache->shards + (sh - cache->shards + i) % CACHE_SHARDS;
+		if (pthread_mutex_trylock(&other->lock)) continue;
+		while (other->oldest && size > cache->max_size) {
+			other->evictions += 1;
+			cache_drop(cache, other, other->oldest);
+			size = cache_size(cache, 0, 0); }
+		pthread_mutex_unlock(&other->lock); } }
+
+
+/* cache_add • keeps a render, dropping the oldest ones over the limit */
+/*	out is shared with the cache, which takes a reference to it, while
+ *	uses is given to the cache; a render of blocks replaces the one with
+ *	the same key, which used other references; the limit holds for the
+ *	whole cache, the oldest entries of sh being dropped first */
+static void
+cache_add(struct mkd_cache *cache, struct cache_shard *sh,
+		const struct cache_key *key, struct buf *out, struct buf *uses) {
+	struct cache_entry *e = cache_find(sh, key);
+	size_t size;
+
+	if (e && key->kind == CACHE_DOCUMENT) return;
+	if (e) cache_drop(cache, sh, e);
+	if ((sh->nb >= sh->mask && !cache_grow(sh))
+	|| (e = malloc(sizeof *e)) == 0) {
+		bufrelease(uses);
+		return; }
+	e->hash = key->hash;
+	e->rndr = key->rndr;
+	e->kind = key->kind;
+	e->in = bufnew(key->size ? key->size : 1);
+	e->out = out;
+	e->uses = uses;
+	if (e->in) bufput(e->in, key->data, key->size);
+	if (!e->in || e->in->size != key->size
+	|| cache_entry_size(e) > cache->max_size) {
+		bufrelease(e->in);
+		bufrelease(uses);
+		free(e);
+		return; }
+	out->ref += 1;
+	e->chain = sh->slot[key->hash & sh->mask];
+	sh->slot[key->hash & sh->mask] = e;
+	cache_link(sh, e);
+	sh->nb += 1;
+	sh->size += cache_entry_size(e);
+	size = cache_size(cache, cache_entry_size(e), 0);
+	while (size > cache->max_size && sh->oldest != e) {
+		sh->evictions += 1;
+		cache_drop(cache, sh, sh->oldest);
+		size = cache_size(cache, 0, 0); }
+	cache_evict(cache, sh, size); }
+
+
+
+/* same_ref_uses • whether ids resolve as when a block was rendered */
+static int
+same_ref_uses(struct render *rndr, const struct buf *uses) {
+	const struct ref_table *refs;
+	const struct link_ref *lr;
+	const char *data, *end;
+	size_t size, n;
+
+	if (!uses) return 1;
+	data = uses->data;
+	end = data + uses->size;
+	while (data < end) {
+		memcpy(&size, data, sizeof size);
+		data += sizeof size;
+		refs = &rndr->refs;
+		lr = find_link_ref(refs, data, size);
+		if (!lr && rndr->make.refdict) {
+			refs = &rndr->make.refdict->refs;
+			lr = find_link_ref(refs, data, size); }
+		data += size;
+		memcpy(&n, data, sizeof n);
+		data += sizeof n;
+		if (!lr) {
+			if (n != SIZE_MAX) return 0;
+			continue; }
+		if (n != lr->link_size
+		|| memcmp(data, refs->pool->data + lr->link, n))
+			return 0;
+		data += n;
+		memcpy(&n, data, sizeof n);
+		data += sizeof n;
+		if (n != lr->title_size
+		|| memcmp(data, refs->pool->data + lr->title, n))
+			return 0;
+		data += n; }
+	return 1; }
+
+
+/* cached_blocks • renders the top-level blocks through a block cache */
+/*	the text is cut between blocks as for single-pass chunks, which are
+ *	looked up by their text, the renderer of the caller and whether
+ *	some output precedes them, and taken only when the link references
+ *	they used still resolve the same */
+static void
+cached_blocks(struct buf *ob, struct render *rndr, struct buf *text) {
+	struct mkd_cache *cache = rndr->make.block_cache;
+	size_t beg, end, html = 0, retry = 0, ob_beg;
+	struct buf *copy, *out, *uses;
+	struct cache_shard *sh;
+	struct cache_entry *e;
+	struct cache_key key;
+	uint64_t *seen, shape = renderer_hash(&rndr->make);
+	int first;
+
+	copy = bufnew(TEXT_UNIT);
+	for (beg = 0; beg < text->size; beg = end) {
+		end = next_cut(rndr, text, beg + 1, &html, &retry);
+		sh = cache_key_of(&key, cache, text->data + beg, end - beg,
+		    shape, ob->size ? CACHE_BLOCKS : CACHE_FIRST_BLOCKS);
+		pthread_mutex_lock(&sh->lock);
+		e = cache_find(sh, &key);
+		if (e && same_ref_uses(rndr, e->uses)) {
+			sh->hits += 1;
+			cache_unlink(sh, e);
+			cache_link(sh, e);
+			bufput(ob, e->out->data, e->out->size);
+			pthread_mutex_unlock(&sh->lock);
+			continue; }
+		sh->misses += 1;
+		seen = sh->seen + key.hash % CACHE_SEEN;
+		first = *seen != key.hash;
+		*seen = key.hash;
+		pthread_mutex_unlock(&sh->lock);
+
+		/* blocks met for the first time are not kept, as most of
+		 * them are unique to their document */
+		uses = first ? 0 : bufnew(REF_UNIT);
+		if (!uses) {
+			parse_block(ob, rndr, text->data + beg, end - beg);
+			continue; }
+
+		/* the text of the key is kept, as blockquotes are rewritten
+		 * in place, and the references used are recorded */
+		copy->size = 0;
+		bufput(copy, key.data, key.size);
+		key.data = copy->data;
+		rndr->uses = uses;
+		ob_beg = ob->size;
+		parse_block(ob, rndr, text->data + beg, end - beg);
+		rndr->uses = 0;
+		if (!uses->size) {
+			bufrelease(uses);
+			uses = 0; }
+		out = bufnew(TEXT_UNIT);
+		if (!out || copy->size != key.size) {
+			bufrelease(uses);
+			bufrelease(out);
+			continue; }
+		bufput(out, ob->data + ob_beg, ob->size - ob_beg);
+		pthread_mutex_lock(&sh->lock);
+		cache_add(cache, sh, &key, out, uses);
+		pthread_mutex_unlock(&sh->lock);
+		mkd_cache_release(cache, out); }
+	bufrelease(copy); }
+
+
+/* render_blocks • renders the top-level blocks of the second pass */
+/*	through the block cache of the renderer, when it has one */
+static void
+render_blocks(struct buf *ob, struct render *rndr, struct buf *text) {
+	if (rndr->make.block_cache)
+		cached_blocks(ob, rndr, text);
+	else
+		parse_block(ob, rndr, text->data, text->size); }
+
+
+
+/**************
+ * DISK CACHE *
+ **************/
+
+/* disk_path • file name of an entry of a cache directory, or NULL */
+/*	the suffix tells a temporary file apart from the entry itself, and
+ *	is the template filled by mkstemp() */
+static char *
+disk_path(const char *dir, const struct buf *ib, const char *key,
+							const char *suffix) {
+	uint64_t hash = hash_input(ib->data, ib->size)
+			^ hash_input(key, strlen(key)) * 0x9e3779b97f4a7c15ULL;
+	size_t size = strlen(dir) + strlen(suffix) + 18;
+	char *path = malloc(size);
+
+	if (path)
+		snprintf(path, size, "%s/%016llx%s", dir,
+					(unsigned long long)hash, suffix);
+	return path; }
+
+
+/* disk_write • writes a whole vector of buffers, returning 0 or -1 */
+static int
+disk_write(int fd, struct iovec *iov, int iovcnt) {
+	ssize_t ret;
+
+	while (iovcnt > 0) {
+		if (iov->iov_len == 0) {
+			iov += 1;
+			iovcnt -= 1;
+			continue; }
+		ret = writev(fd, iov, iovcnt);
+		if (ret < 0 && errno == EINTR) continue;
+		if (ret <= 0) return -1;
+		while (iovcnt > 0 && (size_t)ret >= iov->iov_len) {
+			ret -= iov->iov_len;
+			iov += 1;
+			iovcnt -= 1; }
+		if (iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + ret;
+			iov->iov_len -= ret; } }
+	return 0; }
+
+
 
 /**********************
  * EXPORTED FUNCTIONS *
  **********************/
 
+/* markdown_cleanup • releases the memory of a render structure */
+static void
+markdown_cleanup(struct render *rndr) {
+	int i;
+	free_ref_table(&rndr->refs);
+	arr_free(&rndr->blocks);
+	arr_free(&rndr->spans);
+	arr_free(&rndr->quote_lines);
+	arr_free(&rndr->quote_cuts);
+	arr_free(&rndr->code_lines);
+	for (i = 0; i < rndr->lazy_items.size; i += 1)
+		bufrelease(rndr->lazy_items.item[i]);
+	parr_free(&rndr->lazy_items);
+	arr_free(&rndr->lazy_spans);
+	free_tag_table(rndr->own_tags);
+	assert(rndr->work.size == 0);
+	for (i = 0; i < rndr->work.asize; i += 1)
+		bufrelease(rndr->work.item[i]);
+	parr_free(&rndr->work); }
+
+
+/* markdown_setup • fills a render structure from the renderer */
+static void
+markdown_setup(struct render *rndr, const struct mkd_renderer *rndrer) {
+	size_t i;
+
+	rndr->make = *rndrer;
+	if (rndr->make.max_work_stack < 1)
+		rndr->make.max_work_stack = 1;
+	init_ref_table(&rndr->refs);
+	rndr->patch = 0;
+	rndr->lazy = 0;
+	rndr->threads = 1;
+	rndr->ast = 0;
+	rndr->uses = 0;
+	arr_init(&rndr->quote_lines, sizeof (struct quote_line));
+	arr_init(&rndr->quote_cuts, sizeof (size_t));
+	arr_init(&rndr->code_lines, sizeof (struct buf));
+	parr_init(&rndr->lazy_items);
+	arr_init(&rndr->lazy_spans, sizeof (struct lazy_span));
+	rndr->lazy_top = rndr->lazy_depth = 0;
+	parr_init(&rndr->work);
+	arr_init(&rndr->blocks, sizeof (struct block_task));
+	arr_init(&rndr->spans, sizeof (struct inline_span));
+	pthread_once(&default_tags_once, default_tag_table);
+	rndr->tags = &default_tags;
+	rndr->own_tags = 0;
+	if (rndr->make.blockhtml) build_block_tags(rndr);
+	for (i = 0; i < 256; i += 1) rndr->active_char[i] = 0;
+	if ((rndr->make.emphasis || rndr->make.double_emphasis
+						|| rndr->make.triple_emphasis)
+	&& rndr->make.emph_chars)
+		for (i = 0; rndr->make.emph_chars[i]; i += 1)
+			rndr->active_char
+			    [(unsigned char)rndr->make.emph_chars[i]]
+				= char_emphasis;
+	if (rndr->make.codespan) rndr->active_char['`'] = char_codespan;
+	if (rndr->make.linebreak) rndr->active_char['\n'] = char_linebreak;
+	if (rndr->make.image || rndr->make.link)
+		rndr->active_char['['] = char_link;
+	rndr->active_char['<'] = char_langle_tag;
+	rndr->active_char['\\'] = char_escape;
+	rndr->active_char['&'] = char_entity; }
+
+
 /* markdown • parses the input buffer and renders it into the output buffer */
 void
 markdown(struct buf *ob, struct buf *ib, const struct mkd_renderer *rndrer) {
-	struct link_ref *lr;
+	struct iovec iov;
+	iov.iov_base = ib->data;
+	iov.iov_len = ib->size;
+	markdown_iov(ob, &iov, 1, rndrer); }
+
+
+/* markdown_iov • parses the input segments as if they were concatenated */
+/*	lines are read in place, except those straddling two segments */
+void
+markdown_iov(struct buf *ob, const struct iovec *iov, int iovcnt,
+					const struct mkd_renderer *rndrer) {
+	struct backpatch patch;
+	struct piece_carry carry;
 	struct buf *text;
-	size_t i, beg, end;
 	struct render rndr;
+	int i;
 
 	/* filling the render structure */
 	if (!rndrer) return;
-	rndr.make = *rndrer;
-	if (rndr.make.max_work_stack < 1)
-		rndr.make.max_work_stack = 1;
-	arr_init(&rndr.refs, sizeof (struct link_ref));
-	parr_init(&rndr.work);
-	for (i = 0; i < 256; i += 1) rndr.active_char[i] = 0;
-	if ((rndr.make.emphasis || rndr.make.double_emphasis
-						|| rndr.make.triple_emphasis)
-	&& rndr.make.emph_chars)
-		for (i = 0; rndr.make.emph_chars[i]; i += 1)
-			rndr.active_char[(unsigned char)rndr.make.emph_chars[i]]
-				= char_emphasis;
-	if (rndr.make.codespan) rndr.active_char['`'] = char_codespan;
-	if (rndr.make.linebreak) rndr.active_char['\n'] = char_linebreak;
-	if (rndr.make.image || rndr.make.link)
-		rndr.active_char['['] = char_link;
-	rndr.active_char['<'] = char_langle_tag;
-	rndr.active_char['\\'] = char_escape;
-	rndr.active_char['&'] = char_entity;
+	markdown_setup(&rndr, rndrer);
+	text = bufnew(TEXT_UNIT);
+	init_carry(&carry, bufnew(STREAM_UNIT));
+
+	/* single-pass mode: references are collected while rendering */
+	if (rndr.make.parser_flags & MKD_SINGLE_PASS) {
+		init_backpatch(&patch);
+		rndr.patch = &patch;
+		if (rndr.make.prolog)
+			rndr.make.prolog(ob, rndr.make.opaque); }
 
 	/* first pass: looking for references, copying everything else */
+	for (i = 0; i < iovcnt; i += 1)
+		take_piece(ob, &rndr, text, &carry, iov[i].iov_base,
+					iov[i].iov_len, i + 1 >= iovcnt);
+
+	/* end of single-pass mode: backpatching forward references */
+	if (rndr.patch) {
+		single_pass_last(ob, &rndr);
+		rndr.patch = 0;
+		patch_blocks(ob, &rndr, &patch);
+		free_backpatch(&patch); }
+
+	/* second pass: actual rendering */
+	else {
+		if (rndr.refs.refs.size)
+			index_ref_table(&rndr.refs);
+		end_text(text);
+		if (rndr.make.prolog)
+			rndr.make.prolog(ob, rndr.make.opaque);
+		render_blocks(ob, &rndr, text); }
+	if (rndr.make.epilog)
+		rndr.make.epilog(ob, rndr.make.opaque);
+
+	/* clean-up */
+	bufrelease(text);
+	bufrelease(carry.buf);
+	markdown_cleanup(&rndr); }
+
+
+/* markdown_parallel • renders the input buffer on nthreads threads */
+/*	the output is the same as with markdown(), as long as the renderer
+ *	callbacks can run concurrently; single-pass mode is left to markdown() */
+void
+markdown_parallel(struct buf *ob, struct buf *ib,
+			const struct mkd_renderer *rndrer, int nthreads) {
+	struct render rndr;
+	struct buf *text;
+
+	if (!rndrer) return;
+	if (nthreads <= 1 || (rndrer->parser_flags & MKD_SINGLE_PASS)) {
+		markdown(ob, ib, rndrer);
+		return; }
+	markdown_setup(&rndr, rndrer);
 	text = bufnew(TEXT_UNIT);
-	beg = 0;
-	while (beg < ib->size) /* iterating over lines */
-		if (is_ref(ib->data, beg, ib->size, &end, &rndr.refs))
-			beg = end;
-		else { /* skipping to the next line */
-			end = beg;
-			while (end < ib->size
-			&& ib->data[end] != '\n' && ib->data[end] != '\r')
-				end += 1;
-			/* adding the line body if present */
-			if (end > beg) bufput(text, ib->data + beg, end - beg);
-			while (end < ib->size
-			&& (ib->data[end] == '\n' || ib->data[end] == '\r')) {
-				/* add one \n per newline */
-				if (ib->data[end] == '\n'
-				|| (end + 1 < ib->size
-						&& ib->data[end + 1] != '\n'))
-					bufputc(text, '\n');
-				end += 1; }
-			beg = end; }
-
-	/* sorting the reference array */
-	if (rndr.refs.size)
-		qsort(rndr.refs.base, rndr.refs.size, rndr.refs.unit,
-					cmp_link_ref_sort);
-
-	/* adding a final newline if not already present */
-	if (text->size
-	&&  text->data[text->size - 1] != '\n'
-	&&  text->data[text->size - 1] != '\r')
-		bufputc(text, '\n');
+
+	/* first pass: looking for references, copying everything else */
+	first_pass_parallel(text, &rndr, ib, nthreads);
+	if (rndr.refs.refs.size)
+		index_ref_table(&rndr.refs);
+	end_text(text);
 
 	/* second pass: actual rendering */
 	if (rndr.make.prolog)
 		rndr.make.prolog(ob, rndr.make.opaque);
-	parse_block(ob, &rndr, text->data, text->size);
+	rndr.threads = nthreads;
+	render_parallel(ob, &rndr, text, nthreads);
 	if (rndr.make.epilog)
 		rndr.make.epilog(ob, rndr.make.opaque);
 
 	/* clean-up */
 	bufrelease(text);
-	lr = rndr.refs.base;
-	for (i = 0; i < rndr.refs.size; i += 1) {
-		bufrelease(lr[i].id);
-		bufrelease(lr[i].link);
-		bufrelease(lr[i].title); }
-	arr_free(&rndr.refs);
-	assert(rndr.work.size == 0);
-	for (i = 0; i < rndr.work.asize; i += 1)
-		bufrelease(rndr.work.item[i]);
-	parr_free(&rndr.work); }
+	markdown_cleanup(&rndr); }
+
+
+/* markdown_batch • renders n documents on nthreads threads */
+/*	each thread reuses its render for its documents, which are gathered
+ *	into jobs of about the same input size */
+void
+markdown_batch(struct buf **outs, struct buf **ins, size_t n,
+		const struct mkd_renderer *rndrer, int nthreads, double *ms) {
+	struct batch bt;
+	size_t total = 0, part = 0, i;
+	int k;
+
+	if (!rndrer || !n) return;
+	if (nthreads < 1) nthreads = 1;
+	bt.nb = nthreads * BATCH_JOBS;
+	if ((size_t)bt.nb > n) bt.nb = n;
+	bt.outs = outs;
+	bt.ins = ins;
+	bt.ms = ms;
+	bt.first = malloc((bt.nb + 1) * sizeof *bt.first);
+	bt.workers = malloc(nthreads * sizeof *bt.workers);
+	bt.texts = malloc(nthreads * sizeof *bt.texts);
+	if (!bt.first || !bt.workers || !bt.texts) {
+		for (i = 0; i < n; i += 1)
+			if (outs[i] && ins[i]) markdown(outs[i], ins[i], rndrer);
+		free(bt.first);
+		free(bt.workers);
+		free(bt.texts);
+		return; }
+
+	/* cutting the documents into jobs of about the same size */
+	for (i = 0; i < n; i += 1)
+		if (ins[i]) total += ins[i]->size + 1;
+	bt.first[0] = 0;
+	for (i = 0, k = 1; i < n && k < bt.nb; i += 1) {
+		if (ins[i]) part += ins[i]->size + 1;
+		if (part * bt.nb >= total * k)
+			bt.first[k++] = i + 1; }
+	bt.nb = k;
+	bt.first[bt.nb] = n;
+	if (nthreads > bt.nb) nthreads = bt.nb;
+
+	/* rendering */
+	for (k = 0; k < nthreads; k += 1) {
+		markdown_setup(bt.workers + k, rndrer);
+		bt.texts[k] = bufnew(TEXT_UNIT); }
+	run_pool(nthreads, bt.nb, batch_part, &bt);
+
+	/* clean-up */
+	for (k = 0; k < nthreads; k += 1) {
+		markdown_cleanup(bt.workers + k);
+		bufrelease(bt.texts[k]); }
+	free(bt.first);
+	free(bt.workers);
+	free(bt.texts); }
+
+
+/* mkd_refdict_build • collects the link references of the input buffer */
+/*	the result is read-only and can be shared between threads */
+struct mkd_refdict *
+mkd_refdict_build(const struct buf *ib) {
+	struct mkd_refdict *dict;
+	size_t beg;
+
+	if (!ib) return 0;
+	dict = malloc(sizeof *dict);
+	if (!dict) return 0;
+	init_ref_table(&dict->refs);
+
+	/* same line iteration as the first pass of markdown() */
+	beg = 0;
+	while (beg < ib->size)
+		beg = normalize_line(0, ib, beg, &dict->refs);
+
+	index_ref_table(&dict->refs);
+	return dict; }
+
+
+/* mkd_refdict_free • releases a reference dictionary */
+void
+mkd_refdict_free(struct mkd_refdict *dict) {
+	if (!dict) return;
+	free_ref_table(&dict->refs);
+	free(dict); }
+
+
+/* mkd_stream_begin • starts a render whose input is given by pieces */
+/*	the output of the chunks which can no longer change is appended to ob
+ *	as soon as their input is complete */
+struct mkd_stream *
+mkd_stream_begin(struct buf *ob, const struct mkd_renderer *rndr) {
+	struct mkd_stream *st;
+
+	if (!ob || !rndr) return 0;
+	st = malloc(sizeof *st);
+	if (!st) return 0;
+	markdown_setup(&st->rndr, rndr);
+	init_backpatch(&st->patch);
+	st->rndr.patch = &st->patch;
+	st->ob = ob;
+	init_carry(&st->in, bufnew(STREAM_UNIT));
+	st->out = bufnew(TEXT_UNIT);
+	st->given = 0;
+	if (st->rndr.make.prolog)
+		st->rndr.make.prolog(st->out, st->rndr.make.opaque);
+	stream_flush(&st->patch, st->ob, st->out, &st->given);
+	return st; }
+
+
+/* mkd_stream_feed • takes in a piece of input, rendering what is complete */
+void
+mkd_stream_feed(struct mkd_stream *st, const void *data, size_t size) {
+	if (!st || !size) return;
+	take_piece(st->out, &st->rndr, 0, &st->in, data, size, 0);
+	stream_flush(&st->patch, st->ob, st->out, &st->given); }
+
+
+/* mkd_stream_end • renders the remaining input and releases the stream */
+void
+mkd_stream_end(struct mkd_stream *st) {
+	struct render *rndr;
+	if (!st) return;
+	rndr = &st->rndr;
+
+	/* remaining input and last chunk */
+	take_piece(st->out, &st->rndr, 0, &st->in, "", 0, 1);
+	single_pass_last(st->out, rndr);
+	rndr->patch = 0;
+
+	/* backpatching forward references */
+	patch_blocks(st->out, rndr, &st->patch);
+	if (rndr->make.epilog)
+		rndr->make.epilog(st->out, rndr->make.opaque);
+	st->patch.blocks.size = 0;
+	stream_flush(&st->patch, st->ob, st->out, &st->given);
+
+	/* cleanup */
+	free_backpatch(&st->patch);
+	bufrelease(st->in.buf);
+	bufrelease(st->out);
+	markdown_cleanup(rndr);
+	free(st); }
+
+
+/* mkd_iter_begin • starts a render to be run step by step */
+struct mkd_iter *
+mkd_iter_begin(struct buf *ob, const struct buf *ib,
+					const struct mkd_renderer *rndr) {
+	struct mkd_iter *it;
+
+	if (!ob || !ib || !rndr) return 0;
+	it = malloc(sizeof *it);
+	if (!it) return 0;
+	markdown_setup(&it->rndr, rndr);
+	it->ib = ib;
+	it->text = bufnew(TEXT_UNIT);
+	it->ob = ob;
+	it->out = bufnew(TEXT_UNIT);
+	it->given = 0;
+	it->beg = 0;
+	it->state = ITER_FIRST_PASS;
+	if (it->rndr.make.parser_flags & MKD_SINGLE_PASS) {
+		init_backpatch(&it->patch);
+		it->rndr.patch = &it->patch;
+		it->state = ITER_SINGLE_PASS;
+		if (it->rndr.make.prolog)
+			it->rndr.make.prolog(it->out, it->rndr.make.opaque); }
+	return it; }
+
+
+/* mkd_iter_next • runs the next step, returns whether steps remain */
+/*	a step normalizes ITER_UNIT bytes of input, or renders the prolog, a
+ *	whole top-level block or the epilog into ob; in single-pass mode, a
+ *	step takes in the lines beginning in ITER_UNIT bytes of input,
+ *	rendering the chunks they end like a stream */
+int
+mkd_iter_next(struct mkd_iter *it) {
+	struct render *rndr;
+	struct buf *text, win = { 0, 0, 0, 0, 0 };
+	size_t end;
+
+	if (!it || it->state == ITER_END) return 0;
+	rndr = &it->rndr;
+	text = it->text;
+	switch (it->state) {
+	    case ITER_SINGLE_PASS:
+		win.data = it->ib->data;
+		win.size = it->ib->size;
+		end = it->beg + ITER_UNIT;
+		while (it->beg < it->ib->size && it->beg < end)
+			it->beg = single_pass_line(it->out, rndr, &win,
+								it->beg);
+		if (it->beg < it->ib->size) break;
+		single_pass_last(it->out, rndr);
+		rndr->patch = 0;
+		patch_blocks(it->out, rndr, &it->patch);
+		it->patch.blocks.size = 0;
+		if (rndr->make.epilog)
+			rndr->make.epilog(it->out, rndr->make.opaque);
+		it->state = ITER_END;
+		break;
+	    case ITER_FIRST_PASS:
+		end = it->beg + ITER_UNIT;
+		while (it->beg < it->ib->size && it->beg < end)
+			it->beg = normalize_line(text, it->ib, it->beg,
+							&rndr->refs);
+		if (it->beg < it->ib->size) return 1;
+		if (rndr->refs.refs.size)
+			index_ref_table(&rndr->refs);
+		end_text(text);
+		if (rndr->make.prolog)
+			rndr->make.prolog(it->out, rndr->make.opaque);
+		it->beg = 0;
+		it->state = ITER_BLOCKS;
+		break;
+	    case ITER_BLOCKS:
+		/* one block, with the blank lines around it */
+		while (it->beg < text->size
+		&& (end = is_empty(text->data + it->beg,
+					text->size - it->beg)) != 0)
+			it->beg += end;
+		if (it->beg < text->size)
+			it->beg += parse_one_block(it->out, rndr,
+				text->data + it->beg, text->size - it->beg);
+		while (it->beg < text->size
+		&& (end = is_empty(text->data + it->beg,
+					text->size - it->beg)) != 0)
+			it->beg += end;
+		if (it->beg < text->size) break;
+		if (rndr->make.epilog)
+			rndr->make.epilog(it->out, rndr->make.opaque);
+		it->state = ITER_END;
+		break;
+	    case ITER_END:
+		break; }
+	if (rndr->patch)
+		stream_flush(&it->patch, it->ob, it->out, &it->given);
+	else
+		hand_over(it->ob, it->out, &it->given);
+	return it->state != ITER_END; }
+
+
+/* mkd_iter_free • releases a render, finished or not */
+void
+mkd_iter_free(struct mkd_iter *it) {
+	if (!it) return;
+	if (it->rndr.make.parser_flags & MKD_SINGLE_PASS)
+		free_backpatch(&it->patch);
+	bufrelease(it->text);
+	bufrelease(it->out);
+	markdown_cleanup(&it->rndr);
+	free(it); }
+
+
+/* cmp_lazy_span • orders the raw spans of a lazy render by address */
+static int
+cmp_lazy_span(const void *a, const void *b) {
+	const struct lazy_span *la = a, *lb = b;
+
+	if (la->data != lb->data) return la->data < lb->data ? -1 : 1;
+	if (la->size != lb->size) return la->size < lb->size ? -1 : 1;
+	return 0; }
+
+
+/* find_lazy_span • record of a raw span handed out, or NULL */
+/*	the spans are searched from the last one during the render, as
+ *	callbacks ask for the spans they have just been given, and sorted
+ *	on the first search after it */
+static struct lazy_span *
+find_lazy_span(struct mkd_lazy *lz, const struct buf *span) {
+	struct array *spans = &lz->rndr.lazy_spans;
+	struct lazy_span key, *ls;
+	int i;
+
+	key.data = (uintptr_t)span->data;
+	key.size = span->size;
+	if (lz->rendered > 1 && !lz->sorted) {
+		qsort(spans->base, spans->size, sizeof (struct lazy_span),
+							cmp_lazy_span);
+		lz->sorted = 1; }
+	if (lz->sorted)
+		return bsearch(&key, spans->base, spans->size,
+				sizeof (struct lazy_span), cmp_lazy_span);
+	for (i = spans->size - 1; i >= 0; i -= 1) {
+		ls = arr_item(spans, i);
+		if (!cmp_lazy_span(&key, ls)) return ls; }
+	return 0; }
+
+
+/* mkd_lazy_begin • collects references, for a render parsing spans on demand */
+struct mkd_lazy *
+mkd_lazy_begin(const struct buf *ib, const struct mkd_renderer *rndr) {
+	struct mkd_lazy *lz;
+	size_t beg = 0;
+
+	if (!ib || !rndr) return 0;
+	lz = malloc(sizeof *lz);
+	if (!lz) return 0;
+	markdown_setup(&lz->rndr, rndr);
+	lz->rndr.lazy = 1;
+	lz->text = bufnew(TEXT_UNIT);
+	lz->rendered = 0;
+	lz->sorted = 0;
+	while (beg < ib->size)
+		beg = normalize_line(lz->text, ib, beg, &lz->rndr.refs);
+	if (lz->rndr.refs.refs.size)
+		index_ref_table(&lz->rndr.refs);
+	end_text(lz->text);
+	return lz; }
+
+
+/* mkd_lazy_render • renders blocks, handing raw text spans to the renderer */
+/*	the blocks are rendered only once, later calls do nothing */
+void
+mkd_lazy_render(struct buf *ob, struct mkd_lazy *lz) {
+	struct render *rndr;
+
+	if (!ob || !lz || lz->rendered) return;
+	rndr = &lz->rndr;
+	lz->rendered = 1;
+	if (rndr->make.prolog)
+		rndr->make.prolog(ob, rndr->make.opaque);
+	parse_block(ob, rndr, lz->text->data, lz->text->size);
+	if (rndr->make.epilog)
+		rndr->make.epilog(ob, rndr->make.opaque);
+	lz->rendered = 2; }
+
+
+/* mkd_lazy_inline • parses and renders a span handed by mkd_lazy_render */
+/*	it can be called from the block callbacks, or later on a copy of
+ *	the span, which points into the render until mkd_lazy_free; the span
+ *	is parsed at the depth it was handed out at, cf keep_lazy_span */
+void
+mkd_lazy_inline(struct buf *ob, const struct buf *span, struct mkd_lazy *lz) {
+	struct render *rndr;
+	struct lazy_span *ls;
+	size_t top, depth;
+
+	if (!ob || !span || !lz) return;
+	rndr = &lz->rndr;
+	top = rndr->lazy_top;
+	depth = rndr->lazy_depth;
+	ls = find_lazy_span(lz, span);
+	if (ls) {
+		rndr->lazy_top = rndr->work.size;
+		rndr->lazy_depth = ls->depth; }
+	parse_inline(ob, rndr, span->data, span->size);
+	rndr->lazy_top = top;
+	rndr->lazy_depth = depth; }
+
+
+/* mkd_lazy_free • releases a lazy render */
+void
+mkd_lazy_free(struct mkd_lazy *lz) {
+	if (!lz) return;
+	bufrelease(lz->text);
+	markdown_cleanup(&lz->rndr);
+	free(lz); }
+
+
+/* mkd_edit_begin • renders the input buffer, keeping what its edits need */
+/*	the output is appended to ob, which is then updated by each edit */
+struct mkd_edit *
+mkd_edit_begin(struct buf *ob, const struct buf *ib,
+					const struct mkd_renderer *rndr) {
+	struct mkd_edit *ed;
+
+	if (!ob || !ib || !rndr) return 0;
+	ed = malloc(sizeof *ed);
+	if (!ed) return 0;
+	markdown_setup(&ed->rndr, rndr);
+	ed->ob = ob;
+	ed->base = ob->size;
+	ed->in = bufnew(STREAM_UNIT);
+	ed->text = bufnew(TEXT_UNIT);
+	ed->old = bufnew(TEXT_UNIT);
+	ed->out = bufnew(TEXT_UNIT);
+	arr_init(&ed->chunks, sizeof (struct edit_chunk));
+	arr_init(&ed->lines, sizeof (struct edit_line));
+	arr_init(&ed->cuts, sizeof (struct edit_line));
+	init_ref_table(&ed->old_refs);
+	init_ref_table(&ed->new_refs);
+	bufput(ed->in, ib->data, ib->size);
+	edit_render(ed);
+	return ed; }
+
+
+/* mkd_edit_update • renders again the output of the edited input */
+/*	ib is the whole new input, where the bytes from beg to new_end replaced
+ *	the old ones from beg to old_end; the output bytes replaced in ob are
+ *	put in *changed; returns 0 when only the blocks around the edit were
+ *	rendered again, 1 when the whole input was, -1 on bad arguments */
+int
+mkd_edit_update(struct mkd_edit *ed, const struct buf *ib, size_t beg,
+		size_t old_end, size_t new_end, struct mkd_range *changed) {
+	struct mkd_range range;
+
+	if (!ed || !ib) return -1;
+	if (!changed) changed = &range;
+	if (beg <= old_end && old_end <= ed->in->size
+	&& beg <= new_end && new_end <= ib->size
+	&& ib->size - new_end == ed->in->size - old_end
+	&& edit_chunks(ed, ib, beg, old_end, new_end, changed))
+		return 0;
+
+	/* references changed, or an inconsistent edit */
+	changed->beg = ed->base;
+	changed->old_end = ed->ob->size;
+	ed->in->size = 0;
+	bufput(ed->in, ib->data, ib->size);
+	edit_render(ed);
+	changed->new_end = ed->ob->size;
+	return 1; }
+
+
+/* mkd_edit_free • releases an editable render, leaving its output in ob */
+void
+mkd_edit_free(struct mkd_edit *ed) {
+	if (!ed) return;
+	bufrelease(ed->in);
+	bufrelease(ed->text);
+	bufrelease(ed->old);
+	bufrelease(ed->out);
+	arr_free(&ed->chunks);
+	arr_free(&ed->lines);
+	arr_free(&ed->cuts);
+	free_ref_table(&ed->old_refs);
+	free_ref_table(&ed->new_refs);
+	markdown_cleanup(&ed->rndr);
+	free(ed); }
+
+
+/* mkd_cache_new • empty render cache, keeping at most max_size bytes */
+struct mkd_cache *
+mkd_cache_new(size_t max_size) {
+	struct mkd_cache *cache;
+	int i;
+
+	cache = calloc(1, sizeof *cache);
+	if (!cache) return 0;
+	cache->max_size = max_size;
+	for (i = 0; i < CACHE_SHARDS; i += 1)
+		pthread_mutex_init(&cache->shards[i].lock, 0);
+	pthread_mutex_init(&cache->size_lock, 0);
+	pthread_mutex_init(&cache->ref_lock, 0);
+	return cache; }
+
+
+/* mkd_cache_get • render of the input buffer, shared with the cache */
+/*	the render comes from the cache or is added to it, and must be
+ *	released with mkd_cache_release; returns NULL when out of memory */
+struct buf *
+mkd_cache_get(struct mkd_cache *cache, struct buf *ib,
+					const struct mkd_renderer *rndr) {
+	struct cache_shard *sh;
+	struct cache_entry *e;
+	struct cache_key key;
+	struct buf *out;
+
+	if (!cache || !ib || !rndr) return 0;
+	sh = cache_key_of(&key, cache, ib->data, ib->size,
+					renderer_hash(rndr), CACHE_DOCUMENT);
+	pthread_mutex_lock(&sh->lock);
+	e = cache_find(sh, &key);
+	if (e) {
+		sh->hits += 1;
+		cache_unlink(sh, e);
+		cache_link(sh, e);
+		pthread_mutex_lock(&cache->ref_lock);
+		e->out->ref += 1;
+		pthread_mutex_unlock(&cache->ref_lock);
+		out = e->out;
+		pthread_mutex_unlock(&sh->lock);
+		return out; }
+	sh->misses += 1;
+	pthread_mutex_unlock(&sh->lock);
+
+	/* rendering without the lock, the first render being kept when
+	 * other threads rendered the same input meanwhile */
+	out = bufnew(TEXT_UNIT);
+	if (!out) return 0;
+	markdown(out, ib, rndr);
+	pthread_mutex_lock(&sh->lock);
+	cache_add(cache, sh, &key, out, 0);
+	pthread_mutex_unlock(&sh->lock);
+	return out; }
+
+
+/* mkd_cache_release • releases a render returned by mkd_cache_get */
+/*	the cache may be releasing it at the same time from another thread */
+void
+mkd_cache_release(struct mkd_cache *cache, struct buf *out) {
+	if (!cache) {
+		bufrelease(out);
+		return; }
+	pthread_mutex_lock(&cache->ref_lock);
+	bufrelease(out);
+	pthread_mutex_unlock(&cache->ref_lock); }
+
+
+/* markdown_cached • markdown() through a render cache */
+/*	the render is appended to ob, from the cache when it holds it */
+void
+markdown_cached(struct buf *ob, struct buf *ib,
+		const struct mkd_renderer *rndr, struct mkd_cache *cache) {
+	struct buf *out;
+
+	if (!cache || !(out = mkd_cache_get(cache, ib, rndr))) {
+		markdown(ob, ib, rndr);
+		return; }
+	bufput(ob, out->data, out->size);
+	mkd_cache_release(cache, out); }
+
+
+/* mkd_cache_stats • counters of a render cache, summed over its shards */
+void
+mkd_cache_stats(struct mkd_cache *cache, struct mkd_cache_stats *st) {
+	struct cache_shard *sh;
+	int i;
+
+	if (!cache || !st) return;
+	memset(st, 0, sizeof *st);
+	for (i = 0; i < CACHE_SHARDS; i += 1) {
+		sh = cache->shards + i;
+		pthread_mutex_lock(&sh->lock);
+		st->hits += sh->hits;
+		st->misses += sh->misses;
+		st->evictions += sh->evictions;
+		st->entries += sh->nb;
+		st->size += sh->size;
+		pthread_mutex_unlock(&sh->lock); } }
+
+
+/* mkd_cache_clear • drops every render of a cache, keeping its counters */
+void
+mkd_cache_clear(struct mkd_cache *cache) {
+	struct cache_shard *sh;
+	int i;
+
+	if (!cache) return;
+	for (i = 0; i < CACHE_SHARDS; i += 1) {
+		sh = cache->shards + i;
+		pthread_mutex_lock(&sh->lock);
+		while (sh->oldest)
+			cache_drop(cache, sh, sh->oldest);
+		memset(sh->seen, 0, sizeof sh->seen);
+		pthread_mutex_unlock(&sh->lock); } }
+
+
+/* mkd_cache_free • releases a render cache */
+/*	renders still held by callers are then released with bufrelease */
+void
+mkd_cache_free(struct mkd_cache *cache) {
+	int i;
+
+	if (!cache) return;
+	mkd_cache_clear(cache);
+	for (i = 0; i < CACHE_SHARDS; i += 1) {
+		free(cache->shards[i].slot);
+		pthread_mutex_destroy(&cache->shards[i].lock); }
+	pthread_mutex_destroy(&cache->size_lock);
+	pthread_mutex_destroy(&cache->ref_lock);
+	free(cache); }
+
+/* mkd_disk_get • appends to ob the render of ib kept in a cache directory */
+/*	key tells apart the renderers and their options; the entry is read
+ *	at once after the output, and checked against the key and the input
+ *	before being moved into place; returns 1 when found, 0 otherwise */
+int
+mkd_disk_get(struct buf *ob, const char *dir, const struct buf *ib,
+							const char *key) {
+	size_t size, done = 0, head, key_size, in_size, out_size;
+	char line[DISK_HEAD], *data, *eol;
+	struct stat st;
+	ssize_t ret;
+	char *path;
+	int fd;
+
+	if (!ob || !dir || !ib || !key) return 0;
+	path = disk_path(dir, ib, key, "");
+	fd = path ? open(path, O_RDONLY) : -1;
+	free(path);
+	if (fd < 0) return 0;
+	if (fstat(fd, &st) < 0 || st.st_size <= 0
+	|| (uintmax_t)st.st_size > SIZE_MAX - ob->size
+	|| !bufgrow(ob, ob->size + st.st_size)) {
+		close(fd);
+		return 0; }
+	size = st.st_size;
+	data = ob->data + ob->size;
+	while (done < size) {
+		ret = read(fd, data + done, size - done);
+		if (ret < 0 && errno == EINTR) continue;
+		if (ret <= 0) break;
+		done += ret; }
+	close(fd);
+
+	/* checking the header, the key and the input */
+	eol = memchr(data, '\n', done < DISK_HEAD ? done : DISK_HEAD);
+	if (!eol) return 0;
+	head = eol - data;
+	memcpy(line, data, head);
+	line[head] = 0;
+	head += 1;
+	if (sscanf(line, DISK_MAGIC " %zu %zu %zu",
+			&key_size, &in_size, &out_size) != 3
+	|| key_size != strlen(key) || in_size != ib->size
+	|| done < head + key_size + in_size
+	|| out_size != done - head - key_size - in_size
+	|| memcmp(data + head, key, key_size) != 0
+	|| memcmp(data + head + key_size, ib->data, in_size) != 0)
+		return 0;
+	memmove(data, data + head + key_size + in_size, out_size);
+	ob->size += out_size;
+	return 1; }
+
+
+/* mkd_disk_put • keeps in a cache directory the render ob of ib */
+/*	the entry is written to a temporary file from mkstemp() renamed into
+ *	place, so that concurrent readers only find whole entries, and
+ *	removed on failure; returns 0 on success, -1 on failure with errno
+ *	set */
+int
+mkd_disk_put(const char *dir, const struct buf *ib, const char *key,
+						const struct buf *ob) {
+	char head[DISK_HEAD];
+	struct iovec iov[4];
+	char *path, *tmp;
+	int fd, ret = -1, err;
+
+	if (!dir || !ib || !key || !ob) {
+		errno = EINVAL;
+		return -1; }
+	path = disk_path(dir, ib, key, "");
+	tmp = disk_path(dir, ib, key, ".XXXXXX");
+	fd = path && tmp ? mkstemp(tmp) : -1;
+	if (fd >= 0) {
+		iov[0].iov_base = head;
+		iov[0].iov_len = snprintf(head, sizeof head,
+		    DISK_MAGIC " %zu %zu %zu\n", strlen(key), ib->size,
+		    ob->size);
+		iov[1].iov_base = (void *)key;
+		iov[1].iov_len = strlen(key);
+		iov[2].iov_base = ib->data;
+		iov[2].iov_len = ib->size;
+		iov[3].iov_base = ob->data;
+		iov[3].iov_len = ob->size;
+		ret = disk_write(fd, iov, 4);
+		if (close(fd) < 0) ret = -1;
+		if (ret == 0 && rename(tmp, path) < 0) ret = -1;
+		if (ret < 0) {
+			err = errno;
+			unlink(tmp);
+			errno = err; } }
+	else if (!path || !tmp)
+		errno = ENOMEM;
+	free(path);
+	free(tmp);
+	return ret; }
+
+
+/* mkd_ast_build • parses the input buffer into a syntax tree */
+/*	the tree records the decisions of rndr, cf README */
+struct mkd_ast *
+mkd_ast_build(const struct buf *ib, const struct mkd_renderer *rndrer) {
+	struct mkd_renderer rec;
+	struct ast_build b;
+	struct render rndr;
+	struct mkd_ast *ast;
+	struct buf *ob;
+	size_t beg = 0;
+
+	if (!ib || !rndrer) return 0;
+	ast = malloc(sizeof *ast);
+	if (!ast) return 0;
+	ast->text = bufnew(TEXT_UNIT);
+	arr_init(&ast->nodes, sizeof (struct ast_node));
+	arr_init(&ast->kids, sizeof (uint32_t));
+	arr_init(&ast->spans, sizeof (struct ast_span));
+	ast->root = ast->nb_root = 0;
+	ast->image = 0;
+	b.ast = ast;
+	b.make = rndrer;
+	b.pool = bufnew(WORK_UNIT);
+	b.scratch = bufnew(WORK_UNIT);
+	b.text = 0;
+	b.text_size = 0;
+	b.table_mark = 0;
+	b.failed = !ast->text || !b.pool || !b.scratch;
+	ast_recorder(&rec, &b);
+	markdown_setup(&rndr, &rec);
+	rndr.ast = &b;
+
+	/* first pass: looking for references, copying everything else */
+	while (!b.failed && beg < ib->size)
+		beg = normalize_line(ast->text, ib, beg, &rndr.refs);
+	if (rndr.refs.refs.size)
+		index_ref_table(&rndr.refs);
+	if (!b.failed) end_text(ast->text);
+
+	/* second pass: recording the nodes, then the top-level ones */
+	ob = b.failed ? 0 : bufnew(WORK_UNIT);
+	if (ob) {
+		b.text = ast->text->data;
+		b.text_size = ast->text->size;
+		parse_block(ob, &rndr, ast->text->data, ast->text->size);
+		ast->root = ast->kids.size;
+		ast->nb_root = ob->size / sizeof (uint32_t);
+		if (!arr_grow(&ast->kids, ast->root + ast->nb_root))
+			b.failed = 1;
+		else {
+			memcpy((uint32_t *)ast->kids.base + ast->root,
+					ob->data, ob->size);
+			ast->kids.size += ast->nb_root; }
+		bufput(ast->text, b.pool->data, b.pool->size);
+		if (ast->text->size != b.text_size + b.pool->size)
+			b.failed = 1;
+		bufrelease(ob); }
+	else b.failed = 1;
+
+	/* clean-up */
+	bufrelease(b.pool);
+	bufrelease(b.scratch);
+	markdown_cleanup(&rndr);
+	if (b.failed) {
+		mkd_ast_free(ast);
+		return 0; }
+	return ast; }
+
+
+/* mkd_render_ast • renders a syntax tree, as markdown() would */
+void
+mkd_render_ast(struct buf *ob, const struct mkd_ast *ast,
+					const struct mkd_renderer *rndr) {
+	if (!ob || !ast || !rndr) return;
+	if (rndr->prolog) rndr->prolog(ob, rndr->opaque);
+	replay(ob, ast, rndr);
+	if (rndr->epilog) rndr->epilog(ob, rndr->opaque); }
+
+
+/* mkd_ast_free • releases a syntax tree */
+void
+mkd_ast_free(struct mkd_ast *ast) {
+	if (!ast) return;
+	if (!ast->image) {
+		bufrelease(ast->text);
+		arr_free(&ast->nodes);
+		arr_free(&ast->kids);
+		arr_free(&ast->spans); }
+	free(ast); }
+
+
+/* mkd_ast_save • appends the serialized syntax tree to ob */
+/*	returns 0 on success, -1 when out of memory */
+int
+mkd_ast_save(struct buf *ob, const struct mkd_ast *ast) {
+	struct ast_image head;
+	size_t size;
+
+	if (!ob || !ast) return -1;
+	memcpy(head.magic, AST_MAGIC, sizeof head.magic);
+	head.order = AST_ORDER;
+	head.version = AST_VERSION;
+	head.nb_nodes = ast->nodes.size;
+	head.nb_kids = ast->kids.size;
+	head.nb_spans = ast->spans.size;
+	head.root = ast->root;
+	head.nb_root = ast->nb_root;
+	head.text_size = ast->text->size;
+	size = sizeof head + head.nb_nodes * sizeof (struct ast_node)
+		+ head.nb_kids * sizeof (uint32_t)
+		+ head.nb_spans * sizeof (struct ast_span) + head.text_size;
+	if (!bufgrow(ob, ob->size + size)) return -1;
+	bufput(ob, &head, sizeof head);
+	bufput(ob, ast->nodes.base, head.nb_nodes * sizeof (struct ast_node));
+	bufput(ob, ast->kids.base, head.nb_kids * sizeof (uint32_t));
+	bufput(ob, ast->spans.base, head.nb_spans * sizeof (struct ast_span));
+	bufput(ob, ast->text->data, head.text_size);
+	return 0; }
+
+
+/* mkd_ast_load • syntax tree reading a serialized image in place */
+/*	data must be 4-byte aligned and left unchanged until mkd_ast_free */
+struct mkd_ast *
+mkd_ast_load(const void *data, size_t size) {
+	const struct ast_image *head = data;
+	struct mkd_ast *ast;
+	const char *p = data;
+
+	if (!data || size < sizeof *head || (uintptr_t)data % 4 != 0
+	|| memcmp(head->magic, AST_MAGIC, sizeof head->magic) != 0
+	|| head->order != AST_ORDER || head->version != AST_VERSION
+	|| head->nb_nodes > INT_MAX || head->nb_kids > INT_MAX
+	|| head->nb_spans > INT_MAX
+	|| (size - sizeof *head) / sizeof (struct ast_node) < head->nb_nodes)
+		return 0;
+	size -= sizeof *head + head->nb_nodes * sizeof (struct ast_node);
+	if (size / sizeof (uint32_t) < head->nb_kids) return 0;
+	size -= head->nb_kids * sizeof (uint32_t);
+	if (size / sizeof (struct ast_span) < head->nb_spans) return 0;
+	size -= head->nb_spans * sizeof (struct ast_span);
+	if (size < head->text_size) return 0;
+
+	ast = malloc(sizeof *ast);
+	if (!ast) return 0;
+	p += sizeof *head;
+	ast->nodes.base = (void *)p;
+	ast->nodes.size = head->nb_nodes;
+	p += head->nb_nodes * sizeof (struct ast_node);
+	ast->kids.base = (void *)p;
+	ast->kids.size = head->nb_kids;
+	p += head->nb_kids * sizeof (uint32_t);
+	ast->spans.base = (void *)p;
+	ast->spans.size = head->nb_spans;
+	p += head->nb_spans * sizeof (struct ast_span);
+	ast->nodes.asize = ast->kids.asize = ast->spans.asize = 0;
+	ast->nodes.unit = sizeof (struct ast_node);
+	ast->kids.unit = sizeof (uint32_t);
+	ast->spans.unit = sizeof (struct ast_span);
+	ast->view.data = (char *)p;
+	ast->view.size = head->text_size;
+	ast->view.asize = ast->view.unit = 0;
+	ast->view.ref = 0;
+	ast->text = &ast->view;
+	ast->root = head->root;
+	ast->nb_root = head->nb_root;
+	ast->image = data;
+	if (!check_ast(ast)) {
+		free(ast);
+		return 0; }
+	return ast; }
 
 /* vim: set filetype=c: */
@@ -34,6 +34,30 @@ enum mkd_autolink {
 	MKDA_IMPLICIT_EMAIL	/* e-mail link without mailto: */
 };
 
+/* mkd_refdict • opaque immutable dictionary of link references */
+struct mkd_refdict;
+
+/* mkd_stream • opaque state of a render fed by pieces of input */
+struct mkd_stream;
+
+/* mkd_iter • opaque state of a render run step by step */
+struct mkd_iter;
+
+/* mkd_lazy • opaque state of a render whose spans are parsed on demand */
+struct mkd_lazy;
+
+/* mkd_ast • opaque syntax tree, parsed once and rendered many times */
+struct mkd_ast;
+
+/* mkd_edit • opaque state of a render updated by the edits of its input */
+struct mkd_edit;
+
+/* mkd_cache • opaque render cache, shared by threads */
+struct mkd_cache;
+
+/* iovec • input segment, from <sys/uio.h> */
+struct iovec;
+
 /* mkd_renderer • functions for rendering parsed data */
 struct mkd_renderer {
 	/* document level callbacks */
@@ -79,9 +103,41 @@ struct mkd_renderer {
 	void (*normal_text)(struct buf *ob, struct buf *text, void *opaque);
 
 	/* renderer data */
-	int max_work_stack; /* prevent arbitrary deep recursion, cf README */
+	int max_work_stack; /* limit on nesting depth, cf README */
 	const char *emph_chars; /* chars that trigger emphasis rendering */
 	void *opaque; /* opaque data send to every rendering callback */
+	const char *const *extra_block_tags; /* NULL-terminated, lowercase */
+
+	/* streaming callbacks - used instead of the above when non-NULL */
+	void (*table_begin)(struct buf *ob, struct buf *head_row, void *opaque);
+	void (*table_end)(struct buf *ob, struct buf *head_row, void *opaque);
+	void (*blockcode_lines)(struct buf *ob, struct buf *lines, size_t nb,
+							void *opaque);
+
+	/* shared data */
+	const struct mkd_refdict *refdict; /* fallback for link references */
+
+	/* parser options */
+	unsigned int parser_flags; /* MKD_SINGLE_PASS */
+
+	/* shared caches - used by the two-pass renders, cf README */
+	struct mkd_cache *block_cache; /* renders of top-level blocks */
+};
+
+/* mkd_range • bytes of a buffer replaced by others */
+struct mkd_range {
+	size_t beg;
+	size_t old_end; /* end of the replaced bytes */
+	size_t new_end; /* end of the bytes replacing them */
+};
+
+/* mkd_cache_stats • counters of a render cache */
+struct mkd_cache_stats {
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long evictions; /* renders dropped to stay within size */
+	size_t entries;
+	size_t size; /* bytes used by the entries */
 };
 
 
@@ -93,6 +149,7 @@ struct mkd_renderer {
 /* list/listitem flags */
 #define MKD_LIST_ORDERED	1
 #define MKD_LI_BLOCK		2  /* <li> containing block data */
+#define MKD_LI_RAW		16 /* text not parsed, see mkd_lazy_inline */
 
 /* table cell flags */
 #define MKD_CELL_ALIGN_DEFAULT	0
@@ -101,6 +158,10 @@ struct mkd_renderer {
 #define MKD_CELL_ALIGN_CENTER	3  /* LEFT | RIGHT */
 #define MKD_CELL_ALIGN_MASK	3
 #define MKD_CELL_HEAD		4
+#define MKD_CELL_RAW		8  /* text without span markup, see README */
+
+/* parser flags */
+#define MKD_SINGLE_PASS		1  /* render while collecting references */
 
 
 
@@ -112,6 +173,145 @@ struct mkd_renderer {
 void
 markdown(struct buf *ob, struct buf *ib, const struct mkd_renderer *rndr);
 
+/* markdown_iov • parses the input segments as if they were concatenated */
+void
+markdown_iov(struct buf *ob, const struct iovec *iov, int iovcnt,
+					const struct mkd_renderer *rndr);
+
+/* markdown_parallel • renders the input buffer on nthreads threads */
+void
+markdown_parallel(struct buf *ob, struct buf *ib,
+			const struct mkd_renderer *rndr, int nthreads);
+
+/* markdown_batch • renders n documents on nthreads threads */
+void
+markdown_batch(struct buf **outs, struct buf **ins, size_t n,
+		const struct mkd_renderer *rndr, int nthreads, double *ms);
+
+/* mkd_refdict_build • collects the link references of the input buffer */
+struct mkd_refdict *
+mkd_refdict_build(const struct buf *ib);
+
+/* mkd_refdict_free • releases a reference dictionary */
+void
+mkd_refdict_free(struct mkd_refdict *dict);
+
+/* mkd_stream_begin • starts a render whose input is given by pieces */
+struct mkd_stream *
+mkd_stream_begin(struct buf *ob, const struct mkd_renderer *rndr);
+
+/* mkd_stream_feed • takes in a piece of input, rendering what is complete */
+void
+mkd_stream_feed(struct mkd_stream *st, const void *data, size_t size);
+
+/* mkd_stream_end • renders the remaining input and releases the stream */
+void
+mkd_stream_end(struct mkd_stream *st);
+
+/* mkd_iter_begin • starts a render to be run step by step */
+struct mkd_iter *
+mkd_iter_begin(struct buf *ob, const struct buf *ib,
+					const struct mkd_renderer *rndr);
+
+/* mkd_iter_next • runs the next step, returns whether steps remain */
+int
+mkd_iter_next(struct mkd_iter *it);
+
+/* mkd_iter_free • releases a render, finished or not */
+void
+mkd_iter_free(struct mkd_iter *it);
+
+/* mkd_lazy_begin • collects references, for a render parsing spans on demand */
+struct mkd_lazy *
+mkd_lazy_begin(const struct buf *ib, const struct mkd_renderer *rndr);
+
+/* mkd_lazy_render • renders blocks, handing raw text spans to the renderer */
+void
+mkd_lazy_render(struct buf *ob, struct mkd_lazy *lz);
+
+/* mkd_lazy_inline • parses and renders a span handed by mkd_lazy_render */
+void
+mkd_lazy_inline(struct buf *ob, const struct buf *span, struct mkd_lazy *lz);
+
+/* mkd_lazy_free • releases a lazy render */
+void
+mkd_lazy_free(struct mkd_lazy *lz);
+
+/* mkd_edit_begin • renders the input buffer, keeping what its edits need */
+struct mkd_edit *
+mkd_edit_begin(struct buf *ob, const struct buf *ib,
+					const struct mkd_renderer *rndr);
+
+/* mkd_edit_update • renders again the output of the edited input */
+int
+mkd_edit_update(struct mkd_edit *ed, const struct buf *ib, size_t beg,
+		size_t old_end, size_t new_end, struct mkd_range *changed);
+
+/* mkd_edit_free • releases an editable render, leaving its output in ob */
+void
+mkd_edit_free(struct mkd_edit *ed);
+
+/* mkd_cache_new • empty render cache, keeping at most max_size bytes */
+struct mkd_cache *
+mkd_cache_new(size_t max_size);
+
+/* mkd_cache_get • render of the input buffer, shared with the cache */
+struct buf *
+mkd_cache_get(struct mkd_cache *cache, struct buf *ib,
+					const struct mkd_renderer *rndr);
+
+/* mkd_cache_release • releases a render returned by mkd_cache_get */
+void
+mkd_cache_release(struct mkd_cache *cache, struct buf *out);
+
+/* markdown_cached • markdown() through a render cache */
+void
+markdown_cached(struct buf *ob, struct buf *ib,
+		const struct mkd_renderer *rndr, struct mkd_cache *cache);
+
+/* mkd_cache_stats • counters of a render cache, summed over its shards */
+void
+mkd_cache_stats(struct mkd_cache *cache, struct mkd_cache_stats *st);
+
+/* mkd_cache_clear • drops every render of a cache, keeping its counters */
+void
+mkd_cache_clear(struct mkd_cache *cache);
+
+/* mkd_cache_free • releases a render cache */
+void
+mkd_cache_free(struct mkd_cache *cache);
+
+/* mkd_disk_get • appends to ob the render of ib kept in a cache directory */
+int
+mkd_disk_get(struct buf *ob, const char *dir, const struct buf *ib,
+							const char *key);
+
+/* mkd_disk_put • keeps in a cache directory the render ob of ib */
+int
+mkd_disk_put(const char *dir, const struct buf *ib, const char *key,
+						const struct buf *ob);
+
+/* mkd_ast_build • parses the input buffer into a syntax tree */
+struct mkd_ast *
+mkd_ast_build(const struct buf *ib, const struct mkd_renderer *rndr);
+
+/* mkd_render_ast • renders a syntax tree, as markdown() would */
+void
+mkd_render_ast(struct buf *ob, const struct mkd_ast *ast,
+					const struct mkd_renderer *rndr);
+
+/* mkd_ast_free • releases a syntax tree */
+void
+mkd_ast_free(struct mkd_ast *ast);
+
+/* mkd_ast_save • appends the serialized syntax tree to ob */
+int
+mkd_ast_save(struct buf *ob, const struct mkd_ast *ast);
+
+/* mkd_ast_load • syntax tree reading a serialized image in place */
+struct mkd_ast *
+mkd_ast_load(const void *data, size_t size);
+
 
 #endif /* ndef LITHIUM_MARKDOWN_H */
 
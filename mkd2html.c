@@ -32,9 +32,12 @@
 /* usage • print the option list */
 static void
 usage(FILE *out, const char *name) {
-	fprintf(out, "Usage: %s [-h | -x] [-d | -m | -n] [input-file]\n\n",
-	    name);
-	fprintf(out, "\t-d, --discount\n"
+	fprintf(out, "Usage: %s [-h | -x] [-d | -m | -n] [-s | -t threads]"
+	    " [-c dir] [input-file]\n\n", name);
+	fprintf(out, "\t-c, --cache=DIR\n"
+	    "\t\tKeep the outputs in DIR, and reuse them for unchanged\n"
+	    "\t\tinputs and options\n"
+	    "\t-d, --discount\n"
 	    "\t\tEnable some Discount extensions (image size specification,\n"
 	    "\t\tclass blocks and 'abbr:', 'class:', 'id:' and 'raw:'\n"
 	    "\t\tpseudo-protocols)\n"
@@ -48,11 +51,48 @@ usage(FILE *out, const char *name) {
 	    "\t\tEnable support Discount extensions and Natasha's own\n"
 	    "\t\textensions (id header attribute, class paragraph attribute,\n"
 	    "\t\t'ins' and 'del' elements, and plain span elements)\n"
+	    "\t-s, --single-pass\n"
+	    "\t\tRender the input while reading it, instead of reading\n"
+	    "\t\tit whole and collecting link references first\n"
+	    "\t-t, --threads=N\n"
+	    "\t\tRender the blocks of the input on N threads\n"
 	    "\t-x, --xhtml\n"
 	    "\t\tOutput XHTML-style self-closing tags (e.g. <br />)\n"); }
 
 
 
+/* write_output • writes the output buffer to stdout and empties it */
+static void
+write_output(struct buf *ob) {
+	size_t ret = fwrite(ob->data, 1, ob->size, stdout);
+	if (ret < ob->size)
+		fprintf(stderr, "Warning: only %zu output byte written, "
+				"out of %zu\n",
+				ret,
+				ob->size);
+	ob->size = 0; }
+
+
+/* stream_file • renders the input while reading it */
+static void
+stream_file(FILE *in, const struct mkd_renderer *rndr) {
+	struct mkd_stream *st;
+	struct buf *ib, *ob;
+	size_t ret;
+
+	ib = bufnew(READ_UNIT);
+	ob = bufnew(OUTPUT_UNIT);
+	bufgrow(ib, READ_UNIT);
+	st = mkd_stream_begin(ob, rndr);
+	while ((ret = fread(ib->data, 1, ib->asize, in)) > 0) {
+		mkd_stream_feed(st, ib->data, ret);
+		write_output(ob); }
+	mkd_stream_end(st);
+	write_output(ob);
+	bufrelease(ib);
+	bufrelease(ob); }
+
+
 /* main • main function, interfacing STDIO with the parser */
 int
 main(int argc, char **argv) {
@@ -61,13 +101,19 @@ main(int argc, char **argv) {
 	FILE *in = stdin;
 	const struct mkd_renderer *hrndr, *xrndr;
 	const struct mkd_renderer **prndr;
-	int ch, argerr, help;
+	struct mkd_renderer single_rndr;
+	int ch, argerr, help, single, threads;
+	const char *cache_dir = 0;
+	char ext = 'm', out = 'H', key[32];
 	struct option longopts[] = {
+	    { "cache",		required_argument,	0,	'c' },
 	    { "discount",	no_argument,	0,	'd' },
 	    { "html",		no_argument,	0,	'H' },
 	    { "help",		no_argument,	0,	'h' },
 	    { "markdown",	no_argument,	0,	'm' },
 	    { "natext",		no_argument,	0,	'n' },
+	    { "single-pass",	no_argument,	0,	's' },
+	    { "threads",	required_argument,	0,	't' },
 	    { "xhtml",		no_argument,	0,	'x' },
 	    { 0,		0,		0,	0 } };
 
@@ -77,16 +123,22 @@ main(int argc, char **argv) {
 	prndr = &hrndr;
 
 	/* argument parsing */
-	argerr = help = 0;
+	argerr = help = single = 0;
+	threads = 1;
 	while (!argerr &&
-	    (ch = getopt_long(argc, argv, "dHhmnx", longopts, 0)) != -1)
+	    (ch = getopt_long(argc, argv, "c:dHhmnst:x", longopts, 0)) != -1)
 		switch (ch) {
+		    case 'c': /* cache directory */
+			cache_dir = optarg;
+			break;
 		    case 'd': /* discount extension */
 			hrndr = &discount_html;
 			xrndr = &discount_xhtml;
+			ext = 'd';
 			break;
 		    case 'H': /* HTML output */
 			prndr = &hrndr;
+			out = 'H';
 			break;
 		    case 'h': /* display help */
 			argerr = help = 1;
@@ -94,13 +146,23 @@ main(int argc, char **argv) {
 		    case 'm': /* strict markdown */
 			hrndr = &mkd_html;
 			xrndr = &mkd_xhtml;
+			ext = 'm';
 			break;
 		    case 'n': /* Discount + Natasha's extensions */
 			hrndr = &nat_html;
 			xrndr = &nat_xhtml;
+			ext = 'n';
+			break;
+		    case 's': /* single-pass parsing */
+			single = 1;
+			break;
+		    case 't': /* parallel rendering */
+			threads = atoi(optarg);
+			if (threads < 1) argerr = 1;
 			break;
 		    case 'x': /* XHTML output */
 			prndr = &xrndr;
+			out = 'x';
 			break;
 		    default:
 			argerr = 1; }
@@ -118,6 +180,12 @@ main(int argc, char **argv) {
 				argv[0], strerror(errno));
 			return 1; } }
 
+	/* streaming the input, unless its output may be cached */
+	if (single && !cache_dir) {
+		stream_file(in, *prndr);
+		if (in != stdin) fclose(in);
+		return 0; }
+
 	/* reading everything */
 	ib = bufnew(READ_UNIT);
 	bufgrow(ib, READ_UNIT);
@@ -127,17 +195,31 @@ main(int argc, char **argv) {
 		bufgrow(ib, ib->size + READ_UNIT); }
 	if (in != stdin) fclose(in);
 
-	/* performing markdown parsing */
+	/* looking for the output in the cache */
 	ob = bufnew(OUTPUT_UNIT);
-	markdown(ob, ib, *prndr);
+	snprintf(key, sizeof key, "mkd2html -%c%c%s", out, ext,
+						single ? "s" : "");
+	if (cache_dir && mkd_disk_get(ob, cache_dir, ib, key)) {
+		write_output(ob);
+		bufrelease(ib);
+		bufrelease(ob);
+		return 0; }
+
+	/* performing markdown parsing */
+	if (single) {
+		single_rndr = **prndr;
+		single_rndr.parser_flags |= MKD_SINGLE_PASS;
+		markdown(ob, ib, &single_rndr); }
+	else if (threads > 1)
+		markdown_parallel(ob, ib, *prndr, threads);
+	else
+		markdown(ob, ib, *prndr);
+	if (cache_dir && mkd_disk_put(cache_dir, ib, key, ob) < 0)
+		fprintf(stderr, "Warning: unable to cache the output in "
+				"\"%s\": %s\n", cache_dir, strerror(errno));
 
 	/* writing the result to stdout */
-	ret = fwrite(ob->data, 1, ob->size, stdout);
-	if (ret < ob->size)
-		fprintf(stderr, "Warning: only %zu output byte written, "
-				"out of %zu\n",
-				ret,
-				ob->size);
+	write_output(ob);
 
 	/* cleanup */
 	bufrelease(ib);
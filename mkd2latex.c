@@ -26,6 +26,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <getopt.h>
 #include <string.h>
 
 #define READ_UNIT 1024
@@ -245,6 +246,16 @@ latex_blockcode(struct buf *ob, struct buf *text, void *opaque) {
 	if (text) bufput(ob, text->data, text->size);
 	BUFPUTSL(ob, "\\end{verbatim}\n"); }
 
+static void
+latex_blockcode_lines(struct buf *ob, struct buf *lines, size_t nb,
+						void *opaque) {
+	size_t i;
+	if (ob->size) bufputc(ob, '\n');
+	BUFPUTSL(ob, "\\begin{verbatim}\n");
+	for (i = 0; i < nb; i += 1)
+		bufput(ob, lines[i].data, lines[i].size);
+	BUFPUTSL(ob, "\\end{verbatim}\n"); }
+
 static void
 latex_blockquote(struct buf *ob, struct buf *text, void *opaque) {
 	if (ob->size) bufputc(ob, '\n');
@@ -394,6 +405,18 @@ static struct mkd_renderer to_latex = {
 	/* renderer data */
 	64,
 	"*_",
+	NULL,
+	NULL,
+
+	/* streaming callbacks */
+	NULL,
+	NULL,
+	latex_blockcode_lines,
+
+	NULL,
+
+	0,
+
 	NULL };
 
 
@@ -402,19 +425,56 @@ static struct mkd_renderer to_latex = {
  * MAIN FUNCTION *
  *****************/
 
+/* usage • print the option list */
+static void
+usage(FILE *out, const char *name) {
+	fprintf(out, "Usage: %s [-h] [-c dir] [input-file]\n\n", name);
+	fprintf(out, "\t-c, --cache=DIR\n"
+	    "\t\tKeep the outputs in DIR, and reuse them for unchanged\n"
+	    "\t\tinputs\n"
+	    "\t-h, --help\n"
+	    "\t\tDisplay this help text and exit without further processing\n");
+}
+
+
 /* main • main function, interfacing STDIO with the parser */
 int
 main(int argc, char **argv) {
 	struct buf *ib, *ob;
 	size_t ret;
 	FILE *in = stdin;
+	const char *cache_dir = 0;
+	int ch, argerr, help;
+	struct option longopts[] = {
+	    { "cache",		required_argument,	0,	'c' },
+	    { "help",		no_argument,		0,	'h' },
+	    { 0,		0,			0,	0 } };
+
+	/* argument parsing */
+	argerr = help = 0;
+	while (!argerr &&
+	    (ch = getopt_long(argc, argv, "c:h", longopts, 0)) != -1)
+		switch (ch) {
+		    case 'c': /* cache directory */
+			cache_dir = optarg;
+			break;
+		    case 'h': /* display help */
+			argerr = help = 1;
+			break;
+		    default:
+			argerr = 1; }
+	if (argerr) {
+		usage(help ? stdout : stderr, argv[0]);
+		return help ? EXIT_SUCCESS : EXIT_FAILURE; }
+	argc -= optind;
+	argv += optind;
 
 	/* opening the file if given from the command line */
-	if (argc > 1) {
-		in = fopen(argv[1], "r");
+	if (argc > 0) {
+		in = fopen(argv[0], "r");
 		if (!in) {
 			fprintf(stderr,"Unable to open input file \"%s\": %s\n",
-				argv[1], strerror(errno));
+				argv[0], strerror(errno));
 			return 1; } }
 
 	/* reading everything */
@@ -426,9 +486,14 @@ main(int argc, char **argv) {
 		bufgrow(ib, ib->size + READ_UNIT); }
 	if (in != stdin) fclose(in);
 
-	/* performing markdown to LaTeX */
+	/* performing markdown to LaTeX, unless the output is cached */
 	ob = bufnew(OUTPUT_UNIT);
-	markdown(ob, ib, &to_latex);
+	if (!cache_dir || !mkd_disk_get(ob, cache_dir, ib, "mkd2latex")) {
+		markdown(ob, ib, &to_latex);
+		if (cache_dir
+		&& mkd_disk_put(cache_dir, ib, "mkd2latex", ob) < 0)
+			fprintf(stderr, "Warning: unable to cache the output "
+			    "in \"%s\": %s\n", cache_dir, strerror(errno)); }
 
 	/* writing the result to stdout */
 	ret = fwrite(ob->data, 1, ob->size, stdout);
@@ -40,9 +40,12 @@
 
 static void
 usage(FILE *out, const char *name) {
-	fprintf(out, "Usage: %s [-h] [-d <date>] [-s <section> ] "
+	fprintf(out, "Usage: %s [-h] [-c <dir>] [-d <date>] [-s <section> ] "
 	    "[ -t <title> ] [input-file]\n\n", name);
-	fprintf(out, "\t-d, --date\n"
+	fprintf(out, "\t-c, --cache=DIR\n"
+	    "\t\tKeep the outputs in DIR, and reuse them for unchanged\n"
+	    "\t\tinputs and options\n"
+	    "\t-d, --date\n"
 	    "\t\tSet the date of the manpage (default: now),\n"
 	    "\t-h, --help\n"
 	    "\t\tDisplay this help text and exit without further processing\n"
@@ -96,6 +99,16 @@ man_blockcode(struct buf *ob, struct buf *text, void *opaque) {
 	if (text) man_text_escape(ob, text->data, text->size);
 	BUFPUTSL(ob, ".Ed"); }
 
+static void
+man_blockcode_lines(struct buf *ob, struct buf *lines, size_t nb,
+						void *opaque) {
+	size_t i;
+	if (ob->size) bufputc(ob, '\n');
+	BUFPUTSL(ob, ".Bd -literal\n");
+	for (i = 0; i < nb; i += 1)
+		man_text_escape(ob, lines[i].data, lines[i].size);
+	BUFPUTSL(ob, ".Ed"); }
+
 static void
 man_blockquote(struct buf *ob, struct buf *text, void *opaque) {
 	if (ob->size) bufputc(ob, '\n');
@@ -216,6 +229,18 @@ static struct mkd_renderer to_man = {
 	/* renderer data */
 	64,
 	"*_",
+	NULL,
+	NULL,
+
+	/* streaming callbacks */
+	NULL,
+	NULL,
+	man_blockcode_lines,
+
+	NULL,
+
+	0,
+
 	NULL };
 
 
@@ -227,10 +252,11 @@ static struct mkd_renderer to_man = {
 /* main • main function, interfacing STDIO with the parser */
 int
 main(int argc, char **argv) {
-	struct buf *ib, *ob;
+	struct buf *ib, *ob, *key;
 	size_t ret;
 	size_t i;
 	FILE *in = stdin;
+	const char *cache_dir = NULL;
 	int ch, argerr, help;
 	char *tmp;
 	char datebuf[64];
@@ -240,6 +266,7 @@ main(int argc, char **argv) {
 	struct metadata man_metadata;
 
 	struct option longopts[] = {
+		{ "cache",	required_argument,	0,	'c' },
 		{ "date",	required_argument,	0, 	'd' },
 		{ "help",	no_argument,		0,	'h' },
 		{ "section",	required_argument,	0,	's' },
@@ -253,8 +280,11 @@ main(int argc, char **argv) {
 	/* opening the file if given from the command line */
 	argerr = help = 0;
 	while (!argerr &&
-	    (ch = getopt_long(argc, argv, "d:hs:t:", longopts, 0)) != -1)
+	    (ch = getopt_long(argc, argv, "c:d:hs:t:", longopts, 0)) != -1)
 		switch (ch) {
+			case 'c':
+				cache_dir = optarg;
+				break;
 			case 'd':
 				man_metadata.date = optarg;
 				break;
@@ -329,10 +359,21 @@ main(int argc, char **argv) {
 		bufgrow(ib, ib->size + READ_UNIT); }
 	if (in != stdin) fclose(in);
 
+	/* the metadata are part of the output, hence of the cache key */
+	key = bufnew(OUTPUT_UNIT);
+	bufprintf(key, "mkd2man\n%d\n%s\n%s", man_metadata.section,
+	    man_metadata.date, man_metadata.title);
+	bufnullterm(key);
+
 	to_man.opaque = &man_metadata;
-	/* performing markdown to man */
+	/* performing markdown to man, unless the output is cached */
 	ob = bufnew(OUTPUT_UNIT);
-	markdown(ob, ib, &to_man);
+	if (!cache_dir || !mkd_disk_get(ob, cache_dir, ib, key->data)) {
+		markdown(ob, ib, &to_man);
+		if (cache_dir
+		&& mkd_disk_put(cache_dir, ib, key->data, ob) < 0)
+			fprintf(stderr, "Warning: unable to cache the output "
+			    "in \"%s\": %s\n", cache_dir, strerror(errno)); }
 
 	/* writing the result to stdout */
 	ret = fwrite(ob->data, 1, ob->size, stdout);
@@ -345,6 +386,7 @@ main(int argc, char **argv) {
 	/* cleanup */
 	bufrelease(ib);
 	bufrelease(ob);
+	bufrelease(key);
 	return EXIT_SUCCESS; }
 
 /* vim: set filetype=c: */
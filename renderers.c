@@ -92,6 +92,16 @@ rndr_blockcode(struct buf *ob, struct buf *text, void *opaque) {
 	if (text) lus_body_escape(ob, text->data, text->size);
 	BUFPUTSL(ob, "</code></pre>\n"); }
 
+static void
+rndr_blockcode_lines(struct buf *ob, struct buf *lines, size_t nb,
+						void *opaque) {
+	size_t i;
+	if (ob->size) bufputc(ob, '\n');
+	BUFPUTSL(ob, "<pre><code>");
+	for (i = 0; i < nb; i += 1)
+		lus_body_escape(ob, lines[i].data, lines[i].size);
+	BUFPUTSL(ob, "</code></pre>\n"); }
+
 static void
 rndr_blockquote(struct buf *ob, struct buf *text, void *opaque) {
 	if (ob->size) bufputc(ob, '\n');
@@ -259,6 +269,17 @@ const struct mkd_renderer mkd_html = {
 
 	64,
 	"*_",
+	NULL,
+	NULL,
+
+	NULL,
+	NULL,
+	rndr_blockcode_lines,
+
+	NULL,
+
+	0,
+
 	NULL };
 
 
@@ -325,6 +346,17 @@ const struct mkd_renderer mkd_xhtml = {
 
 	64,
 	"*_",
+	NULL,
+	NULL,
+
+	NULL,
+	NULL,
+	rndr_blockcode_lines,
+
+	NULL,
+
+	0,
+
 	NULL };
 
 
@@ -443,20 +475,28 @@ discount_blockquote(struct buf *ob, struct buf *text, void *opaque) {
 	BUFPUTSL(ob, "</div>\n"); }
 
 static void
-discount_table(struct buf *ob, struct buf *head_row, struct buf *rows,
-					void *opaque) {
+discount_table_begin(struct buf *ob, struct buf *head_row, void *opaque) {
 	if (ob->size) bufputc(ob, '\n');
 	BUFPUTSL(ob, "<table>\n");
 	if (head_row) {
 		BUFPUTSL(ob, "<thead>\n");
 		bufput(ob, head_row->data, head_row->size);
-		BUFPUTSL(ob, "</thead>\n<tbody>\n"); }
-	if (rows)
-		bufput(ob, rows->data, rows->size);
+		BUFPUTSL(ob, "</thead>\n<tbody>\n"); } }
+
+static void
+discount_table_end(struct buf *ob, struct buf *head_row, void *opaque) {
 	if (head_row)
 		BUFPUTSL(ob, "</tbody>\n");
 	BUFPUTSL(ob, "</table>\n"); }
 
+static void
+discount_table(struct buf *ob, struct buf *head_row, struct buf *rows,
+					void *opaque) {
+	discount_table_begin(ob, head_row, opaque);
+	if (rows)
+		bufput(ob, rows->data, rows->size);
+	discount_table_end(ob, head_row, opaque); }
+
 static void
 discount_table_row(struct buf *ob, struct buf *cells, int flags, void *opaque){
 	(void)flags;
@@ -481,7 +521,10 @@ discount_table_cell(struct buf *ob, struct buf *text, int flags, void *opaque){
 			BUFPUTSL(ob, " align=\"center\"");
 			break; }
 	bufputc(ob, '>');
-	if (text) bufput(ob, text->data, text->size);
+	if (text && (flags & MKD_CELL_RAW))
+		lus_body_escape(ob, text->data, text->size);
+	else if (text)
+		bufput(ob, text->data, text->size);
 	if (flags & MKD_CELL_HEAD)
 		BUFPUTSL(ob, "</th>\n");
 	else
@@ -519,6 +562,17 @@ const struct mkd_renderer discount_html = {
 
 	64,
 	"*_",
+	NULL,
+	NULL,
+
+	discount_table_begin,
+	discount_table_end,
+	rndr_blockcode_lines,
+
+	NULL,
+
+	0,
+
 	NULL };
 const struct mkd_renderer discount_xhtml = {
 	NULL,
@@ -551,6 +605,17 @@ const struct mkd_renderer discount_xhtml = {
 
 	64,
 	"*_",
+	NULL,
+	NULL,
+
+	discount_table_begin,
+	discount_table_end,
+	rndr_blockcode_lines,
+
+	NULL,
+
+	0,
+
 	NULL };
 
 
@@ -663,6 +728,17 @@ const struct mkd_renderer nat_html = {
 
 	64,
 	"*_-+|",
+	NULL,
+	NULL,
+
+	NULL,
+	NULL,
+	rndr_blockcode_lines,
+
+	NULL,
+
+	0,
+
 	NULL };
 const struct mkd_renderer nat_xhtml = {
 	NULL,
@@ -695,4 +771,15 @@ const struct mkd_renderer nat_xhtml = {
 
 	64,
 	"*_-+|",
+	NULL,
+	NULL,
+
+	NULL,
+	NULL,
+	rndr_blockcode_lines,
+
+	NULL,
+
+	0,
+
 	NULL };